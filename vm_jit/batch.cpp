@@ -0,0 +1,222 @@
+#include "batch.h"
+#include "handlers.h"
+#include "explorer.h"
+#include "jitter/jitter.h"
+#include "lifter/lifter.h"
+#include "rewriter.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace batch
+{
+    bool parse_manifest(const std::string& path, std::vector<job_t>& jobs)
+    {
+        std::ifstream file(path);
+        if (!file)
+        {
+            std::printf("Failed to open %s\n", path.c_str());
+            return false;
+        }
+
+        std::string line;
+        for (size_t n = 1; std::getline(file, line); n++)
+        {
+            if (auto comment = line.find('#'); comment != std::string::npos)
+                line.resize(comment);
+
+            std::istringstream is(line);
+            std::vector<std::string> fields;
+            for (std::string field; is >> field;)
+                fields.push_back(field);
+
+            if (fields.empty())
+                continue;
+
+            if (fields.size() < 4 || fields.size() > 5)
+            {
+                std::printf("%s:%zu: expected binary, entry offset, vip, rkey [, ror key]\n", path.c_str(), n);
+                return false;
+            }
+
+            try
+            {
+                job_t job;
+                job.binary = fields[0];
+                job.entry_offset = std::stoull(fields[1], nullptr, 0);
+                job.vip = std::stoull(fields[2], nullptr, 0);
+                job.rkey = std::stoull(fields[3], nullptr, 0);
+                if (fields.size() == 5)
+                    job.ror_key = std::stoull(fields[4], nullptr, 0);
+                jobs.push_back(std::move(job));
+            }
+            catch (const std::exception&)
+            {
+                std::printf("%s:%zu: bad number\n", path.c_str(), n);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct binary_t
+    {
+        pe::image image;
+        vm::handler_cache handlers;
+        // (entry offset, code) of every finished asmjit job
+        //
+        std::vector<std::pair<uint64_t, std::vector<uint8_t>>> patches;
+        std::mutex lock;
+        // Handlers the scan found, anything decoded after it was missed
+        //
+        size_t prefetched = 0;
+
+        explicit binary_t(pe::image&& image) : image(std::move(image)) {}
+    };
+
+    static std::string hex(uint64_t v)
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%llx", (unsigned long long)v);
+        return buffer;
+    }
+
+    static vm::state make_state(const job_t& job, const pe::image& image)
+    {
+        auto state = vm::state(image, job.vip, job.rkey);
+        state.vip_r = job.vip_r;
+        state.vreg_r = job.vreg_r;
+        state.rkey_r = job.rkey_r;
+        return state;
+    }
+
+    static bool run_job(const job_t& job, binary_t& binary, const options_t& options)
+    {
+        auto state = make_state(job, binary.image);
+        // Parallelism comes from the pool, every job walks its paths on one thread
+        //
+        auto trace = vm::explorer(binary.handlers).run(state, job.ror_key);
+
+        if (options.llvm)
+        {
+            llvm::LLVMContext ctx;
+            llvm::Module program("Module", ctx);
+            auto lifter = lifter::lifter(program);
+            lifter.opt_level = options.opt_level;
+            for (const auto& block : trace.blocks)
+                lifter.add_block(block);
+            if (!lifter.compile(job.binary + "." + hex(job.entry_offset)))
+            {
+                std::printf("Failed to build IR for %s.%s\n", job.binary.c_str(), hex(job.entry_offset).c_str());
+                return false;
+            }
+        }
+
+        if (options.jit)
+        {
+            auto jitter = jitter::jitter(options.backend);
+            for (const auto& block : trace.blocks)
+                jitter.add_block(block);
+
+            auto* code = jitter.compile();
+            if (!code)
+            {
+                std::printf("Failed to build IR for %s.%s\n", job.binary.c_str(), hex(job.entry_offset).c_str());
+                return false;
+            }
+            std::lock_guard guard(binary.lock);
+            binary.patches.emplace_back(job.entry_offset, std::vector<uint8_t>(code->data(), code->data() + code->size()));
+        }
+        return true;
+    }
+
+    bool run(const std::vector<job_t>& jobs, const options_t& options)
+    {
+        // Load every image once
+        //
+        std::map<std::string, std::unique_ptr<binary_t>> binaries;
+        for (const auto& job : jobs)
+        {
+            if (binaries.contains(job.binary))
+                continue;
+
+            auto image = pe::image::load(job.binary);
+            if (!image)
+            {
+                std::printf("Failed to load %s\n", job.binary.c_str());
+                return false;
+            }
+            auto binary = std::make_unique<binary_t>(std::move(*image));
+            binary->handlers.knowledge = options.knowledge;
+            binaries.emplace(job.binary, std::move(binary));
+        }
+
+        // Handler tables are filled from a scan of every image before any job runs
+        //
+        for (auto& [path, binary] : binaries)
+        {
+            const auto& job = *std::find_if(jobs.begin(), jobs.end(), [&](const job_t& j) { return j.binary == path; });
+            binary->handlers.prefetch(make_state(job, binary->image), vm::find_handlers(binary->image), options.threads);
+            binary->prefetched = binary->handlers.size();
+        }
+
+        // A failed job leaves its entry unpatched, the others still go through
+        //
+        std::atomic<size_t> next = 0;
+        std::atomic<bool> jobs_ok = true;
+        auto worker = [&]
+        {
+            for (size_t i = next++; i < jobs.size(); i = next++)
+            {
+                if (!run_job(jobs[i], *binaries.at(jobs[i].binary), options))
+                    jobs_ok = false;
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < std::max(options.threads, 1u); i++)
+            pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool)
+            t.join();
+
+        for (const auto& [path, binary] : binaries)
+        {
+            if (binary->handlers.size() > binary->prefetched)
+                std::printf("%s: %zu traced handlers were missed by the scan\n", path.c_str(), binary->handlers.size() - binary->prefetched);
+        }
+
+        if (!options.jit)
+            return jobs_ok;
+
+        // Code goes into a new section of each output file, entries only get a jump
+        //
+        stats::scope_t scope(stats::phase_t::Write);
+        bool ok = jobs_ok;
+        for (auto& [path, binary] : binaries)
+        {
+            // Workers finish in any order, sort so the section layout doesn't depend on it
+            //
+            if (binary->patches.empty())
+            {
+                std::printf("%s: no entries compiled, not written\n", path.c_str());
+                continue;
+            }
+            std::sort(binary->patches.begin(), binary->patches.end(),
+                [](const auto& a, const auto& b) { return a.first < b.first; });
+
+            pe::rewriter rewriter(binary->image);
+            for (auto& [offset, code] : binary->patches)
+                rewriter.add(offset, std::move(code));
+            ok &= rewriter.write(path, path + ".patched");
+        }
+        return ok;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "vm.h"
+#include "knowledge.h"
+#include "jitter/jitter.h"
+
+#include <string>
+#include <vector>
+
+namespace batch
+{
+    // One line of the manifest:
+    //
+    //   # binary        entry offset  vip          rkey                 [ror key]
+    //   sample.exe      0x2C07C       0x140067050  0x1337DEAD6969CAFE   5
+    //
+    // Numbers accept any base std::stoull understands with base 0.
+    //
+    struct job_t
+    {
+        std::string binary;
+        uint64_t entry_offset = 0;
+        vm::vip_t vip = 0;
+        uint64_t rkey = 0;
+        uint64_t ror_key = 5;
+        // Register roles, only entry discovery sets anything but the defaults
+        //
+        x86::zydis_register_t vip_r = ZYDIS_REGISTER_R8;
+        x86::zydis_register_t vreg_r = ZYDIS_REGISTER_R9;
+        x86::zydis_register_t rkey_r = ZYDIS_REGISTER_R10;
+    };
+
+    struct options_t
+    {
+        bool llvm = false;
+        unsigned opt_level = 2;
+        bool jit = false;
+        jitter::backend_t backend = jitter::backend_t::Compiler;
+        unsigned threads = 1;
+        // Shared by every binary, classifications learned on one carry over to the next
+        //
+        vm::knowledge_base* knowledge = nullptr;
+    };
+
+    bool parse_manifest(const std::string& path, std::vector<job_t>& jobs);
+
+    // Every image is loaded once and shares one handler cache between its entries.
+    // Jobs run on a thread pool, asmjit output for a binary is written to a new
+    // section of <binary>.patched once all of its entries are done, binaries with no
+    // compiled entry are left alone.
+    //
+    bool run(const std::vector<job_t>& jobs, const options_t& options);
+}
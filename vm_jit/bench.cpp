@@ -0,0 +1,422 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+namespace bench
+{
+    namespace x86 = asmjit::x86;
+
+    static const char* const reg_names[15] =
+    {
+        "rax", "rbx", "rcx", "rdx", "rdi", "rsi", "rbp", "r8",
+        "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+
+    static const x86::Gp context_regs[15] =
+    {
+        x86::rax, x86::rbx, x86::rcx, x86::rdx, x86::rdi, x86::rsi, x86::rbp, x86::r8,
+        x86::r9,  x86::r10, x86::r11, x86::r12, x86::r13, x86::r14, x86::r15,
+    };
+
+    // Callee saved in either host ABI, the registers ABI overwrites all of them
+    //
+    static const x86::Gp saved_regs[8] =
+    {
+        x86::rbx, x86::rbp, x86::rdi, x86::rsi, x86::r12, x86::r13, x86::r14, x86::r15,
+    };
+
+#ifdef _WIN32
+    static const x86::Gp& arg0 = x86::rcx;
+#else
+    static const x86::Gp& arg0 = x86::rdi;
+#endif
+
+    static size_t page_size()
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+        return size;
+#endif
+    }
+
+    static bool protect(uint8_t* address, size_t size, uint32_t characteristics)
+    {
+        bool write = characteristics & pe::section_mem_write;
+        bool execute = characteristics & pe::section_mem_execute;
+#ifdef _WIN32
+        DWORD flags = execute ? (write ? PAGE_EXECUTE_READWRITE : PAGE_EXECUTE_READ) :
+            (write ? PAGE_READWRITE : PAGE_READONLY);
+        DWORD old;
+        return VirtualProtect(address, size, flags, &old);
+#else
+        int flags = PROT_READ | (write ? PROT_WRITE : 0) | (execute ? PROT_EXEC : 0);
+        return mprotect(address, size, flags) != -1;
+#endif
+    }
+
+    // Serialized so the call can't start before or finish after the counter is read
+    //
+    static void read_tsc(x86::Assembler& as)
+    {
+        as.lfence();
+        as.rdtsc();
+        as.shl(x86::rdx, 32);
+        as.or_(x86::rax, x86::rdx);
+    }
+
+    static target_t make_native(const std::string& name, std::function<void(uint64_t*)> native)
+    {
+        target_t out;
+        out.name = name;
+        out.abi = abi_t::Native;
+        out.call = [native = std::move(native)](uint64_t* context)
+        {
+            _mm_lfence();
+            auto start = __rdtsc();
+            native(context);
+            _mm_lfence();
+            return __rdtsc() - start;
+        };
+        return out;
+    }
+
+    static bool make_trampoline(asmjit::JitRuntime& rt, const std::string& name, const void* code, abi_t abi, target_t& out)
+    {
+        asmjit::CodeHolder holder;
+        holder.init(rt.environment());
+        x86::Assembler as(&holder);
+        auto target = as.newLabel();
+
+        // [rsp + 48] context, [rsp + 40] start time, then 40 bytes so the call site is
+        // aligned and has Win64 home space
+        //
+        for (const auto& reg : saved_regs)
+            as.push(reg);
+        as.push(arg0);
+        read_tsc(as);
+        as.push(x86::rax);
+        as.sub(x86::rsp, 40);
+
+        if (abi == abi_t::Registers)
+        {
+            // Context pointer is loaded into rax last, it is the only free register left
+            //
+            as.mov(x86::rax, x86::qword_ptr(x86::rsp, 48));
+            for (int i = 14; i >= 0; i--)
+                as.mov(context_regs[i], x86::qword_ptr(x86::rax, i * 8));
+            as.call(x86::qword_ptr(target));
+
+            as.push(x86::rax);
+            as.mov(x86::rax, x86::qword_ptr(x86::rsp, 56));
+            as.pop(x86::qword_ptr(x86::rax));
+            for (int i = 1; i < 15; i++)
+                as.mov(x86::qword_ptr(x86::rax, i * 8), context_regs[i]);
+        }
+        else
+        {
+            as.mov(arg0, x86::qword_ptr(x86::rsp, 48));
+            as.call(x86::qword_ptr(target));
+        }
+
+        as.add(x86::rsp, 40);
+        read_tsc(as);
+        as.sub(x86::rax, x86::qword_ptr(x86::rsp));
+        as.add(x86::rsp, 16);
+        for (int i = 7; i >= 0; i--)
+            as.pop(saved_regs[i]);
+        as.ret();
+
+        as.bind(target);
+        auto address = reinterpret_cast<uint64_t>(code);
+        as.embed(&address, sizeof(address));
+
+        uint64_t (*call)(uint64_t*) = nullptr;
+        if (rt.add(&call, &holder) != asmjit::kErrorOk)
+        {
+            std::printf("Failed to build trampoline for %s\n", name.c_str());
+            return false;
+        }
+        out.call = call;
+        out.name = name;
+        out.abi = abi;
+        return true;
+    }
+
+    static uint64_t median(std::vector<uint64_t>& samples)
+    {
+        if (samples.empty())
+            return 0;
+        auto mid = samples.begin() + samples.size() / 2;
+        std::nth_element(samples.begin(), mid, samples.end());
+        return *mid;
+    }
+
+    harness::~harness()
+    {
+        if (!base)
+            return;
+#ifdef _WIN32
+        VirtualFree(base, 0, MEM_RELEASE);
+#else
+        munmap(base, length);
+#endif
+    }
+
+    bool harness::map(const pe::image& image, const vm::entry_t& entry)
+    {
+        const auto* view = image.translate(image.image_base, image.size_of_image);
+        if (!view)
+            return false;
+
+        // Bytecode and handlers hold absolute addresses, there is no relocating them
+        //
+        length = (image.size_of_image + page_size() - 1) & ~(page_size() - 1);
+        auto* wanted = reinterpret_cast<void*>(image.image_base);
+#ifdef _WIN32
+        base = static_cast<uint8_t*>(VirtualAlloc(wanted, length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+        auto* ptr = mmap(wanted, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        base = ptr == MAP_FAILED ? nullptr : static_cast<uint8_t*>(ptr);
+        if (base && base != wanted)
+        {
+            munmap(base, length);
+            base = nullptr;
+        }
+#endif
+        if (!base)
+        {
+            std::printf("Image base 0x%llx is not available\n", (unsigned long long)image.image_base);
+            return false;
+        }
+        std::memcpy(base, view, image.size_of_image);
+
+        // The host program would have allocated the vreg file before calling the entry
+        //
+        if (entry.vreg_slot && !provide(entry.vreg_slot, 0x800))
+            return false;
+
+        // Pages shared by two sections get both sets of rights, headers stay read only.
+        // Applied on the first run, globals can still be provided until then.
+        //
+        pages.assign(length / page_size(), pe::section_mem_read);
+        for (const auto& s : image.sections)
+        {
+            auto rights = s.characteristics & (pe::section_mem_read | pe::section_mem_write | pe::section_mem_execute);
+            for (uint64_t p = s.rva / page_size(); p < pages.size() && p * page_size() < (uint64_t)s.rva + s.virtual_size; p++)
+                pages[p] |= rights;
+        }
+        return true;
+    }
+
+    bool harness::seal()
+    {
+        for (size_t p = 0, next = 0; p < pages.size(); p = next)
+        {
+            for (next = p + 1; next < pages.size() && pages[next] == pages[p]; next++);
+            if (!protect(base + p * page_size(), (next - p) * page_size(), pages[p]))
+            {
+                std::printf("Failed to protect image pages\n");
+                return false;
+            }
+        }
+        pages.clear();
+        return true;
+    }
+
+    bool harness::provide(uint64_t slot, size_t size)
+    {
+        auto image_base = reinterpret_cast<uint64_t>(base);
+        if (!base || pages.empty() || slot < image_base || slot - image_base > length - sizeof(uint64_t))
+        {
+            std::printf("Global 0x%llx is outside the image or it is already running\n", (unsigned long long)slot);
+            return false;
+        }
+
+        auto* ptr = base + (slot - image_base);
+        uint64_t current;
+        std::memcpy(&current, ptr, sizeof(current));
+        if (current)
+            return true;
+
+        auto& memory = storage.emplace_back((size + 7) / 8, 0);
+        auto address = reinterpret_cast<uint64_t>(memory.data());
+        std::memcpy(ptr, &address, sizeof(address));
+        return true;
+    }
+
+    bool harness::add(const std::string& name, const void* code, abi_t abi)
+    {
+        target_t target;
+        if (!code || !make_trampoline(rt, name, code, abi, target))
+            return false;
+        targets.push_back(target);
+        return true;
+    }
+
+    bool harness::add(const std::string& name, const uint8_t* code, size_t size, abi_t abi)
+    {
+        asmjit::CodeHolder holder;
+        holder.init(rt.environment());
+        x86::Assembler as(&holder);
+        as.embed(code, size);
+
+        void* copy = nullptr;
+        if (rt.add(&copy, &holder) != asmjit::kErrorOk)
+        {
+            std::printf("Failed to copy %s into executable memory\n", name.c_str());
+            return false;
+        }
+        return add(name, copy, abi);
+    }
+
+    bool harness::add(const std::string& name, std::function<void(uint64_t*)> native)
+    {
+        if (!native)
+            return false;
+        targets.push_back(make_native(name, std::move(native)));
+        return true;
+    }
+
+    std::vector<result_t> harness::run(const std::vector<context_t>& inputs, size_t iterations)
+    {
+        if (!seal())
+            return {};
+
+        // Every call is repeated, the first one warms caches and is not counted
+        //
+        auto measure = [&](const target_t& target, std::vector<context_t>& outputs)
+        {
+            std::vector<uint64_t> samples;
+            outputs.clear();
+            for (const auto& input : inputs)
+            {
+                context_t context;
+                for (size_t n = 0; n <= iterations; n++)
+                {
+                    context = input;
+                    auto cycles = target.call(context.data());
+                    if (n)
+                        samples.push_back(cycles);
+                }
+                outputs.push_back(context);
+            }
+            return median(samples);
+        };
+
+        // Trampoline cost per ABI, measured on a target that only returns
+        //
+        uint64_t overhead[3] = {};
+        {
+            asmjit::CodeHolder holder;
+            holder.init(rt.environment());
+            x86::Assembler as(&holder);
+            as.ret();
+
+            void* empty = nullptr;
+            if (rt.add(&empty, &holder) != asmjit::kErrorOk)
+                empty = nullptr;
+            std::vector<context_t> outputs;
+            for (auto abi : { abi_t::Registers, abi_t::Context })
+            {
+                target_t target;
+                if (empty && make_trampoline(rt, "empty", empty, abi, target))
+                    overhead[(size_t)abi] = measure(target, outputs);
+            }
+            overhead[(size_t)abi_t::Native] = measure(make_native("empty", [](uint64_t*) {}), outputs);
+        }
+
+        std::vector<result_t> results;
+        std::vector<context_t> reference;
+        for (const auto& target : targets)
+        {
+            result_t result;
+            result.name = target.name;
+
+            std::vector<context_t> outputs;
+            auto cycles = measure(target, outputs);
+            auto cost = overhead[(size_t)target.abi];
+            result.cycles = cycles > cost ? cycles - cost : 0;
+
+            if (reference.empty())
+                reference = outputs;
+
+            for (size_t i = 0; i < outputs.size(); i++)
+            {
+                if (outputs[i] == reference[i])
+                    continue;
+
+                // Only the first difference is printed, the count tells the rest
+                //
+                if (!result.mismatches++)
+                {
+                    for (size_t r = 0; r < 15; r++)
+                    {
+                        if (outputs[i][r] != reference[i][r])
+                        {
+                            std::printf("%s: input %zu %s 0x%llx, expected 0x%llx\n", target.name.c_str(), i, reg_names[r],
+                                (unsigned long long)outputs[i][r], (unsigned long long)reference[i][r]);
+                        }
+                    }
+                }
+            }
+            results.push_back(result);
+        }
+        return results;
+    }
+
+    std::vector<context_t> make_inputs(size_t count)
+    {
+        // splitmix64
+        //
+        uint64_t state = 0x9E3779B97F4A7C15;
+        auto next = [&]
+        {
+            uint64_t z = (state += 0x9E3779B97F4A7C15);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+            return z ^ (z >> 31);
+        };
+
+        std::vector<context_t> out(count);
+        for (auto& context : out)
+        {
+            for (auto& reg : context)
+                reg = next();
+        }
+        return out;
+    }
+
+    void print(const std::vector<result_t>& results)
+    {
+        if (results.empty())
+            return;
+
+        const auto reference = results.front().cycles;
+        for (const auto& result : results)
+        {
+            auto speedup = result.cycles ? (double)reference / result.cycles : 0.0;
+            std::printf("%-10s %10llu cycles/call %8.2fx %zu mismatches\n", result.name.c_str(),
+                (unsigned long long)result.cycles, speedup, result.mismatches);
+        }
+    }
+}
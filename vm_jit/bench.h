@@ -0,0 +1,105 @@
+#pragma once
+#include "image.h"
+#include "entry.h"
+
+#include <asmjit/asmjit.h>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+    // Registers in the order the VM entry pushes them, the same as the lifter's
+    // ContextTy and the IR's Arg and Return indices
+    //
+    using context_t = std::array<uint64_t, 15>;
+
+    enum class abi_t : uint8_t
+    {
+        // Context goes in and comes back in the registers themselves, the VM entry
+        // and asmjit output
+        //
+        Registers,
+        // void(ContextTy*) in the host calling convention, the LLVM output
+        //
+        Context,
+        // Plain C++ callable timed around the call, the interpreter
+        //
+        Native,
+    };
+
+    struct target_t
+    {
+        std::string name;
+        abi_t abi = abi_t::Registers;
+        // Sets the registers from the context, calls the target and stores them back,
+        // returns the cycles the call took
+        //
+        std::function<uint64_t(uint64_t* context)> call;
+    };
+
+    struct result_t
+    {
+        std::string name;
+        // Median over every call, trampoline overhead subtracted
+        //
+        uint64_t cycles = 0;
+        // Inputs whose output context differs from the first target's
+        //
+        size_t mismatches = 0;
+    };
+
+    // Runs the original VM entry and its devirtualized versions in process on the same
+    // register contexts. The image is mapped at its preferred base with its own section
+    // protections, nothing is relocated or imported and no CRT code runs. Globals the
+    // host program fills in before calling the entry have to be provided, the vreg file
+    // is found from the entry itself.
+    //
+    // The first target added is the reference every other output is compared against.
+    //
+    struct harness
+    {
+        asmjit::JitRuntime rt;
+        std::vector<target_t> targets;
+
+        uint8_t* base = nullptr;
+        size_t length = 0;
+        std::vector<std::vector<uint64_t>> storage;
+        // Section rights per page until they are applied
+        //
+        std::vector<uint32_t> pages;
+
+        harness() = default;
+        harness(const harness&) = delete;
+        harness& operator=(const harness&) = delete;
+        ~harness();
+
+        bool map(const pe::image& image, const vm::entry_t& entry);
+
+        // Points a null pointer global at zeroed memory owned by the harness, a global
+        // that already holds a value is left alone. Only before the first run.
+        //
+        bool provide(uint64_t slot, size_t size);
+        bool seal();
+
+        // Code already executable at its address, the mapped entry or a JIT'd function
+        //
+        bool add(const std::string& name, const void* code, abi_t abi);
+        // Position independent code copied into executable memory first
+        //
+        bool add(const std::string& name, const uint8_t* code, size_t size, abi_t abi);
+        // Runs outside the mapped image, only its output is compared
+        //
+        bool add(const std::string& name, std::function<void(uint64_t* context)> native);
+
+        std::vector<result_t> run(const std::vector<context_t>& inputs, size_t iterations);
+    };
+
+    // Fixed pseudo random contexts, the same on every run
+    //
+    std::vector<context_t> make_inputs(size_t count);
+
+    void print(const std::vector<result_t>& results);
+}
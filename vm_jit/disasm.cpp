@@ -1,5 +1,9 @@
 #include "disasm.h"
 
+#include <cassert>
+#include <cstdio>
+#include <numeric>
+
 namespace x86
 {
     namespace reg
@@ -35,23 +39,43 @@ namespace x86
         {
             return ZydisRegisterGetWidth(ZYDIS_MACHINE_MODE_LONG_64, reg) / 8;
         }
+
+        int gpr_index(const zydis_register_t& reg)
+        {
+            auto full = extend(reg);
+            if (full < ZYDIS_REGISTER_RAX || full > ZYDIS_REGISTER_R15)
+                return -1;
+            return full - ZYDIS_REGISTER_RAX;
+        }
     }
 
-    std::string instruction_t::to_string() const
+    static const ZydisDecoder& decoder()
     {
-        char buffer[256];
-        char out[512];
+        // Decoder is immutable after init, one instance serves every unroll call
+        //
+        static const ZydisDecoder instance = []
+        {
+            ZydisDecoder decoder;
+            ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_ADDRESS_WIDTH_64);
+            return decoder;
+        }();
+        return instance;
+    }
 
-        ZydisFormatter formatter;
-        ZydisFormatterInit(&formatter, ZYDIS_FORMATTER_STYLE_INTEL);
-        ZydisFormatterFormatInstruction(&formatter, &instr, buffer, sizeof(buffer), address);
-        std::snprintf(out, 512, "0x%016llx %s", address, buffer);
-        return { out };
+    static const ZydisFormatter& formatter()
+    {
+        static const ZydisFormatter instance = []
+        {
+            ZydisFormatter formatter;
+            ZydisFormatterInit(&formatter, ZYDIS_FORMATTER_STYLE_INTEL);
+            return formatter;
+        }();
+        return instance;
     }
 
-    bool instruction_t::is_jmp() const
+    static bool is_jmp(ZydisMnemonic mnemonic)
     {
-        switch (instr.mnemonic)
+        switch (mnemonic)
         {
         case ZYDIS_MNEMONIC_JB:
         case ZYDIS_MNEMONIC_JBE:
@@ -82,15 +106,65 @@ namespace x86
         return false;
     }
 
-    bool instruction_t::is(ZydisMnemonic mnemonic, const std::vector<ZydisOperandType>& operands)
+    uint64_t instruction_t::address() const
+    {
+        return routine->addresses[index];
+    }
+
+    ZydisMnemonic instruction_t::mnemonic() const
+    {
+        return routine->mnemonics[index];
+    }
+
+    uint8_t instruction_t::operand_count() const
+    {
+        return routine->operand_counts[index];
+    }
+
+    const operand_t& instruction_t::operand(size_t n) const
+    {
+        assert(n < max_operands);
+        return routine->operands[index * max_operands + n];
+    }
+
+    std::span<const uint8_t> instruction_t::raw() const
+    {
+        return routine->bytes[index];
+    }
+
+    std::string instruction_t::to_string() const
+    {
+        char buffer[256];
+        char out[512];
+
+        // Formatting is a cold path, full instruction is decoded again from raw bytes
+        //
+        ZydisDecodedInstruction instr;
+        auto bytes = raw();
+        if (!ZYAN_SUCCESS(ZydisDecoderDecodeBuffer(&decoder(), bytes.data(), bytes.size(), &instr)))
+            std::snprintf(buffer, sizeof(buffer), "(bad)");
+        else
+            ZydisFormatterFormatInstruction(&formatter(), &instr, buffer, sizeof(buffer), address());
+
+        std::snprintf(out, 512, "0x%016llx %s", address(), buffer);
+        return { out };
+    }
+
+    bool instruction_t::is_jmp() const
+    {
+        return x86::is_jmp(mnemonic());
+    }
+
+    bool instruction_t::is(ZydisMnemonic mnemonic, std::initializer_list<ZydisOperandType> operands) const
     {
-        if (instr.mnemonic != mnemonic ||
-            instr.operand_count < operands.size())
+        if (this->mnemonic() != mnemonic ||
+            operand_count() < operands.size())
             return false;
 
-        for (int i = 0; i < operands.size(); i++)
+        size_t i = 0;
+        for (auto type : operands)
         {
-            if (instr.operands[i].type != operands[i])
+            if (operand(i++).type != type)
                 return false;
         }
 
@@ -99,117 +173,217 @@ namespace x86
 
     int routine_t::next(const fn_instruction_filter_t& filter, int from) const
     {
-        if (from >= stream.size()) return -1;
-        for (int i = from; i < stream.size(); i++)
-            if (filter(stream[i].instr)) return i;
+        if (from >= size()) return -1;
+        for (int i = from; i < size(); i++)
+            if (filter((*this)[i])) return i;
         return -1;
     }
 
-    int routine_t::next(ZydisMnemonic& opcode, std::vector<ZydisOperandType>& params, int from) const
+    int routine_t::next(ZydisMnemonic mnemonic, std::initializer_list<ZydisOperandType> params, int from) const
     {
-        if (from >= stream.size()) return -1;
-        for (int i = from; i < stream.size(); i++)
-        {
-            auto& ins = stream[i].instr;
-            if (ins.mnemonic == opcode && params.size() <= ins.operand_count)
-            {
-                bool found = true;
-                for (int j = 0; j < params.size(); j++)
-                    if (params[j] != ins.operands[j].type)
-                        found = false;
-                if (found)
-                    return i;
-            }
-        }
-        return -1;
+        return next(mnemonic, [&](const instruction_t& instr) { return instr.is(mnemonic, params); }, from);
     }
 
     int routine_t::prev(const fn_instruction_filter_t& filter, int from) const
     {
-        if (from == -1) from = (int)stream.size() - 1;
-        if (from >= stream.size()) return -1;
+        if (from == -1) from = (int)size() - 1;
+        if (from >= size()) return -1;
         for (int i = from; i >= 0; i--)
-            if (filter(stream[i].instr)) return i;
+            if (filter((*this)[i])) return i;
         return -1;
     }
 
-    int routine_t::prev(ZydisMnemonic& opcode, std::vector<ZydisOperandType>& params, int from) const
+    int routine_t::prev(ZydisMnemonic mnemonic, std::initializer_list<ZydisOperandType> params, int from) const
     {
-        if (from == -1) from = (int)stream.size() - 1;
-        if (from >= stream.size()) return -1;
-        for (int i = from; i >= 0; i--)
-        {
-            auto& ins = stream[i].instr;
-            if (ins.mnemonic == opcode && params.size() <= ins.operand_count)
+        return prev(mnemonic, [&](const instruction_t& instr) { return instr.is(mnemonic, params); }, from);
+    }
+
+    std::span<const uint32_t> routine_t::positions(ZydisMnemonic mnemonic) const
+    {
+        auto [lo, hi] = std::equal_range(index_mnemonics.begin(), index_mnemonics.end(), mnemonic);
+        return { index_positions.data() + (lo - index_mnemonics.begin()), (size_t)(hi - lo) };
+    }
+
+    int routine_t::next(ZydisMnemonic mnemonic, int from) const
+    {
+        auto list = positions(mnemonic);
+        auto it = std::lower_bound(list.begin(), list.end(), (uint32_t)std::max(from, 0));
+        return it == list.end() ? -1 : (int)*it;
+    }
+
+    int routine_t::prev(ZydisMnemonic mnemonic, int from) const
+    {
+        if (from == -1) from = (int)size() - 1;
+        if (from < 0) return -1;
+
+        auto list = positions(mnemonic);
+        auto it = std::upper_bound(list.begin(), list.end(), (uint32_t)from);
+        return it == list.begin() ? -1 : (int)*--it;
+    }
+
+    void routine_t::build_index()
+    {
+        // Sort positions by mnemonic, stable so positions stay ascending inside every group
+        //
+        index_positions.resize(size());
+        std::iota(index_positions.begin(), index_positions.end(), 0);
+        std::stable_sort(index_positions.begin(), index_positions.end(), [&](uint32_t a, uint32_t b)
             {
-                bool found = true;
-                for (int j = 0; j < params.size(); j++)
-                    if (params[j] != ins.operands[j].type)
-                        found = false;
-                if (found)
-                    return i;
-            }
-        }
-        return -1;
+                return mnemonics[a] < mnemonics[b];
+            });
+
+        index_mnemonics.resize(size());
+        for (size_t i = 0; i < size(); i++)
+            index_mnemonics[i] = mnemonics[index_positions[i]];
     }
 
     void routine_t::dump() const
     {
-        char buffer[256];
-        ZydisFormatter formatter;
-        ZydisFormatterInit(&formatter, ZYDIS_FORMATTER_STYLE_INTEL);
-
-        for (const auto& [addr, instr, raw] : stream)
-        {
-            ZydisFormatterFormatInstruction(&formatter, &instr, buffer, sizeof(buffer), addr);
-            std::printf("> 0x%016llx %s\n", addr, buffer);
-        }
+        for (auto instr : *this)
+            std::printf("> %s\n", instr.to_string().c_str());
     }
 
     std::vector<uint8_t> routine_t::to_raw() const
     {
         std::vector<uint8_t> out;
-        for (const auto& i : stream)
-            out.insert(out.end(), i.raw.begin(), i.raw.end());
+        for (const auto& raw : bytes)
+            out.insert(out.end(), raw.begin(), raw.end());
         return out;
     }
 
-    routine_t unroll(uintptr_t address)
+    std::vector<uint8_t> routine_t::to_normalized() const
     {
+        std::vector<uint8_t> out;
+        for (size_t i = 0; i < size(); i++)
+        {
+            const auto base = out.size();
+            out.insert(out.end(), bytes[i].begin(), bytes[i].end());
+
+            const auto& enc = encodings[i];
+            std::fill_n(out.begin() + base + enc.disp_offset, enc.disp_size, 0);
+            std::fill_n(out.begin() + base + enc.imm_offset, enc.imm_size, 0);
+        }
+        return out;
+    }
+
+    void routine_t::reserve(size_t n)
+    {
+        addresses.reserve(n);
+        bytes.reserve(n);
+        mnemonics.reserve(n);
+        operand_counts.reserve(n);
+        operands.reserve(n * max_operands);
+        write_masks.reserve(n);
+        encodings.reserve(n);
+        index_mnemonics.reserve(n);
+        index_positions.reserve(n);
+    }
+
+    void routine_t::push_back(uint64_t address, const zydis_instruction_t& instr, const uint8_t* raw)
+    {
+        addresses.push_back(address);
+        bytes.push_back({ raw, instr.length });
+        mnemonics.push_back(instr.mnemonic);
+
+        size_t base = operands.size();
+        operands.resize(base + max_operands);
+
+        uint8_t count = 0;
+        for (size_t i = 0; i < instr.operand_count && count < max_operands; i++)
+        {
+            const auto& op = instr.operands[i];
+            if (op.visibility == ZYDIS_OPERAND_VISIBILITY_HIDDEN)
+                continue;
+
+            auto& out = operands[base + count++];
+            out.type = op.type;
+            out.size = op.size;
+            switch (op.type)
+            {
+            case ZYDIS_OPERAND_TYPE_REGISTER:
+                out.reg = op.reg.value;
+                break;
+            case ZYDIS_OPERAND_TYPE_MEMORY:
+                out.mem.base = op.mem.base;
+                out.mem.index = op.mem.index;
+                out.mem.scale = op.mem.scale;
+                out.mem.disp = op.mem.disp.value;
+                break;
+            case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+                out.imm = op.imm.value.u;
+                break;
+            default:
+                break;
+            }
+        }
+        operand_counts.push_back(count);
+
+        // Defs over every operand, hidden ones included (push/pop touch rsp, mul writes rdx)
+        //
+        uint16_t writes = 0;
+        for (size_t i = 0; i < instr.operand_count; i++)
+        {
+            const auto& op = instr.operands[i];
+            if (op.type != ZYDIS_OPERAND_TYPE_REGISTER || !(op.actions & ZYDIS_OPERAND_ACTION_MASK_WRITE))
+                continue;
+            if (auto idx = reg::gpr_index(op.reg.value); idx != -1)
+                writes |= 1u << idx;
+        }
+        write_masks.push_back(writes);
+
+        // Zydis reports field sizes in bits, the second immediate (enter, extrq) is never
+        // seen in handlers and stays part of the normalized bytes
+        //
+        encoding_t enc;
+        enc.disp_offset = instr.raw.disp.offset;
+        enc.disp_size = instr.raw.disp.size / 8;
+        enc.imm_offset = instr.raw.imm[0].offset;
+        enc.imm_size = instr.raw.imm[0].size / 8;
+        encodings.push_back(enc);
+    }
+
+    routine_t unroll(const pe::image& image, uint64_t address)
+    {
+        // Handlers are short, one reservation covers the whole unroll
+        //
         routine_t routine;
+        routine.reserve(64);
 
-        ZydisDecoder decoder;
         ZydisDecodedInstruction zydis_ins;
-        ZydisDecoderInit(&decoder, ZYDIS_MACHINE_MODE_LONG_64, ZYDIS_ADDRESS_WIDTH_64);
 
-        while (ZYAN_SUCCESS(ZydisDecoderDecodeBuffer(&decoder, reinterpret_cast<void*>(address), 0x1000, &zydis_ins)))
-        {
-            instruction_t instr;
-            instr.address = address;
-            instr.instr = zydis_ins;
-            instr.raw = { (uint8_t*)address, (uint8_t*)address + zydis_ins.length };
+        // Addresses are image VAs, bytes are read through the mapped view
+        //
+        // Eagerly scanned candidates may be junk, a jmp chain that loops must not hang us
+        //
+        size_t budget = max_unroll;
 
-            if (instr.is_jmp())
+        const uint8_t* buffer = nullptr;
+        while (budget-- && (buffer = image.translate(address)) &&
+            ZYAN_SUCCESS(ZydisDecoderDecodeBuffer(&decoder(), buffer, image.available(address), &zydis_ins)))
+        {
+            if (is_jmp(zydis_ins.mnemonic))
             {
                 if (zydis_ins.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER)
                 {
-                    routine.stream.push_back(instr);
-                    return routine;
+                    routine.push_back(address, zydis_ins, buffer);
+                    break;
                 }
 
                 ZydisCalcAbsoluteAddress(&zydis_ins, &zydis_ins.operands[0], address, &address);
             }
             else if (zydis_ins.mnemonic == ZYDIS_MNEMONIC_RET)
             {
-                routine.stream.push_back(instr);
-                return routine;
+                routine.push_back(address, zydis_ins, buffer);
+                break;
             }
             else
             {
-                routine.stream.push_back(instr);
+                routine.push_back(address, zydis_ins, buffer);
                 address += zydis_ins.length;
             }
         }
+
+        routine.build_index();
         return routine;
     }
-}
+}
\ No newline at end of file
@@ -1,16 +1,20 @@
 #pragma once
+#include "image.h"
+
 #include <Zydis/Zydis.h>
 #include <vector>
 #include <string>
-#include <map>
+#include <span>
+#include <initializer_list>
 #include <functional>
+#include <concepts>
+#include <algorithm>
 
 namespace x86
 {
     using zydis_instruction_t = ZydisDecodedInstruction;
     using zydis_decoded_operand_t = ZydisDecodedOperand;
     using zydis_register_t = ZydisRegister;
-    using fn_instruction_filter_t = std::function<bool(const zydis_instruction_t&)>;
 
     namespace reg
     {
@@ -18,37 +22,166 @@ namespace x86
         std::string to_string(const zydis_register_t&);
         bool is_selector(const zydis_register_t&);
         uint16_t size(const zydis_register_t&);
+        // Position of the enclosing 64-bit GPR (rax = 0 ... r15 = 15) or -1
+        //
+        int gpr_index(const zydis_register_t&);
+    };
+
+    static constexpr size_t gpr_count = 16;
+
+    // Only visible operands are kept, hidden ones (flags, rsp for push/pop) are dropped
+    //
+    static constexpr size_t max_operands = 4;
+
+    struct operand_t
+    {
+        ZydisOperandType type = ZYDIS_OPERAND_TYPE_UNUSED;
+        uint16_t size = 0;
+        zydis_register_t reg = ZYDIS_REGISTER_NONE;
+        struct
+        {
+            zydis_register_t base = ZYDIS_REGISTER_NONE;
+            zydis_register_t index = ZYDIS_REGISTER_NONE;
+            uint8_t scale = 0;
+            int64_t disp = 0;
+        } mem;
+        uint64_t imm = 0;
     };
 
+    struct routine_t;
+
+    // Byte offsets and sizes of the variable fields of one encoding, 0 size if absent
+    //
+    struct encoding_t
+    {
+        uint8_t disp_offset = 0;
+        uint8_t disp_size = 0;
+        uint8_t imm_offset = 0;
+        uint8_t imm_size = 0;
+    };
+
+    // Lightweight view of a single instruction inside routine_t
+    //
     struct instruction_t
     {
-        uint64_t address;
-        zydis_instruction_t instr;
-        std::vector<uint8_t> raw;
+        const routine_t* routine;
+        size_t index;
+
+        uint64_t address() const;
+        ZydisMnemonic mnemonic() const;
+        uint8_t operand_count() const;
+        const operand_t& operand(size_t n) const;
+        std::span<const uint8_t> raw() const;
 
         std::string to_string() const;
         bool is_jmp() const;
-        bool is(ZydisMnemonic mnemonic, const std::vector<ZydisOperandType>& operands = {});
+        bool is(ZydisMnemonic mnemonic, std::initializer_list<ZydisOperandType> operands = {}) const;
     };
 
+    using fn_instruction_filter_t = std::function<bool(const instruction_t&)>;
+
+    template<typename Filter>
+    concept instruction_filter = std::predicate<Filter, const instruction_t&>;
+
+    // Decoded handler stored as structure of arrays. Instruction bytes are not copied,
+    // they point into the mapped image the routine was unrolled from.
+    //
     struct routine_t
     {
-        std::vector<instruction_t> stream;
+        std::vector<uint64_t> addresses;
+        std::vector<std::span<const uint8_t>> bytes;
+        std::vector<ZydisMnemonic> mnemonics;
+        std::vector<uint8_t> operand_counts;
+        std::vector<operand_t> operands;
+        // GPRs written by every instruction, hidden operands included
+        //
+        std::vector<uint16_t> write_masks;
+        // Where displacement and immediate bytes sit inside every encoding
+        //
+        std::vector<encoding_t> encodings;
+
+        // Query index built once after decoding: positions sorted by (mnemonic, position)
+        //
+        std::vector<ZydisMnemonic> index_mnemonics;
+        std::vector<uint32_t> index_positions;
+
+        void build_index();
+
+        // Indexed queries, O(log n) by mnemonic
+        //
+        std::span<const uint32_t> positions(ZydisMnemonic mnemonic) const;
+        int next(ZydisMnemonic mnemonic, int from = 0) const;
+        int prev(ZydisMnemonic mnemonic, int from = -1) const;
+        int next(ZydisMnemonic mnemonic, std::initializer_list<ZydisOperandType> params, int from = 0) const;
+        int prev(ZydisMnemonic mnemonic, std::initializer_list<ZydisOperandType> params, int from = -1) const;
+
+        // Filter evaluated only on instructions with matching mnemonic
+        //
+        template<instruction_filter Filter>
+        int next(ZydisMnemonic mnemonic, Filter&& filter, int from = 0) const
+        {
+            auto list = positions(mnemonic);
+            auto it = std::lower_bound(list.begin(), list.end(), (uint32_t)std::max(from, 0));
+            for (; it != list.end(); ++it)
+            {
+                if (filter((*this)[*it]))
+                    return (int)*it;
+            }
+            return -1;
+        }
+
+        template<instruction_filter Filter>
+        int prev(ZydisMnemonic mnemonic, Filter&& filter, int from = -1) const
+        {
+            if (from == -1) from = (int)size() - 1;
+            if (from < 0) return -1;
 
+            auto list = positions(mnemonic);
+            auto it = std::upper_bound(list.begin(), list.end(), (uint32_t)from);
+            while (it != list.begin())
+            {
+                --it;
+                if (filter((*this)[*it]))
+                    return (int)*it;
+            }
+            return -1;
+        }
+
+        // Linear scan fallback for arbitrary filters
+        //
         int next(const fn_instruction_filter_t& filter, int from = 0) const;
-        int next(ZydisMnemonic& opcode, std::vector<ZydisOperandType>& params, int from = 0) const;
         int prev(const fn_instruction_filter_t& filter, int from = -1) const;
-        int prev(ZydisMnemonic& opcode, std::vector<ZydisOperandType>& params, int from = -1) const;
 
         void dump() const;
 
         std::vector<uint8_t> to_raw() const;
+        // Same bytes with displacements and immediates zeroed, identical for handlers
+        // that only differ by addresses, jump targets and keys
+        //
+        std::vector<uint8_t> to_normalized() const;
+
+        void reserve(size_t n);
+        void push_back(uint64_t address, const zydis_instruction_t& instr, const uint8_t* raw);
+
+        struct iterator
+        {
+            const routine_t* routine;
+            size_t index;
 
-        size_t size() const { return stream.size(); }
-        auto begin() { return stream.begin(); }
-        auto end() { return stream.end(); }
-        auto operator[](size_t n) const { return stream[n]; }
+            instruction_t operator*() const { return { routine, index }; }
+            iterator& operator++() { index++; return *this; }
+            bool operator!=(const iterator& other) const { return index != other.index; }
+        };
+
+        size_t size() const { return addresses.size(); }
+        iterator begin() const { return { this, 0 }; }
+        iterator end() const { return { this, size() }; }
+        instruction_t operator[](size_t n) const { return { this, n }; }
     };
 
-    routine_t unroll(uintptr_t address);
+    // Upper bound on decoded instructions (followed jmps included) per unroll
+    //
+    static constexpr size_t max_unroll = 0x4000;
+
+    routine_t unroll(const pe::image& image, uint64_t address);
 }
@@ -0,0 +1,133 @@
+#include "entry.h"
+#include "pattern.h"
+#include "scan.h"
+
+#include <cstdio>
+
+namespace vm
+{
+    namespace p = x86::pattern;
+
+    // push rax, rbx, rcx, rdx, rdi, rsi, rbp, r8 ... r15
+    //
+    static const scan::pattern_t prologue = scan::pattern_t::parse(
+        "50 53 51 52 57 56 55 41 50 41 51 41 52 41 53 41 54 41 55 41 56 41 57");
+
+    // First dispatch, same shape as the operand fetch in handlers but with free registers
+    //
+    using dispatch_p = p::seq<
+        p::ins<ZYDIS_MNEMONIC_MOV, p::reg_cap<0>, p::mem_cap<1>>,
+        p::ins<ZYDIS_MNEMONIC_ADD, p::reg_cap<1>, p::imm<8>>,
+        p::ins<ZYDIS_MNEMONIC_XOR, p::reg_cap<0>, p::reg_cap<2>>,
+        p::ins<ZYDIS_MNEMONIC_ROR, p::reg_cap<0>, p::imm_cap<0>>,
+        p::ins<ZYDIS_MNEMONIC_XOR, p::reg_cap<2>, p::reg_cap<0>>
+    >;
+    using load_imm_p = p::ins<ZYDIS_MNEMONIC_MOV, p::reg_cap<0>, p::imm_cap<0>>;
+    using load_rip_p = p::ins<ZYDIS_MNEMONIC_LEA, p::reg_cap<0>, p::mem<ZYDIS_REGISTER_RIP>>;
+
+    // Last constant loaded into reg before position from
+    //
+    static std::optional<uint64_t> find_load(const x86::routine_t& routine, x86::zydis_register_t reg, int from)
+    {
+        p::captures_t c;
+        c.reg[0] = reg;
+        auto i_imm = p::rfind<load_imm_p>(routine, c, from);
+
+        p::captures_t r;
+        r.reg[0] = reg;
+        auto i_rip = p::rfind<load_rip_p>(routine, r, from);
+
+        if (i_imm == -1 && i_rip == -1)
+            return std::nullopt;
+        if (i_imm > i_rip)
+            return c.imm[0];
+
+        auto instr = routine[i_rip];
+        return instr.address() + instr.raw().size() + instr.operand(1).mem.disp;
+    }
+
+    static std::optional<entry_t> analyze(const pe::image& image, uint64_t address)
+    {
+        auto routine = x86::unroll(image, address);
+
+        p::captures_t c;
+        auto i_fetch = p::rfind<dispatch_p>(routine, c);
+        if (i_fetch == -1)
+            return std::nullopt;
+
+        entry_t out;
+        out.address = address;
+        out.vip_r = c.reg[1];
+        out.rkey_r = c.reg[2];
+        out.ror_key = c.imm[0];
+
+        auto vip = find_load(routine, out.vip_r, i_fetch);
+        auto rkey = find_load(routine, out.rkey_r, i_fetch);
+        auto offset = image.va_to_offset(address);
+        if (!vip || !rkey || !offset)
+            return std::nullopt;
+
+        out.vip = *vip;
+        out.rkey = *rkey;
+        out.offset = *offset;
+
+        // The virtual register file is the last other register set up before dispatch
+        //
+        for (int i = i_fetch - 1; i >= 0; i--)
+        {
+            if (routine.mnemonics[i] != ZYDIS_MNEMONIC_MOV && routine.mnemonics[i] != ZYDIS_MNEMONIC_LEA)
+                continue;
+
+            const auto& op = routine[i].operand(0);
+            if (op.type != ZYDIS_OPERAND_TYPE_REGISTER || x86::reg::gpr_index(op.reg) == -1)
+                continue;
+
+            auto reg = x86::reg::extend(op.reg);
+            if (reg != out.vip_r && reg != out.rkey_r && reg != c.reg[0] && reg != ZYDIS_REGISTER_RSP)
+            {
+                out.vreg_r = reg;
+
+                const auto& src = routine[i].operand(1);
+                if (routine.mnemonics[i] == ZYDIS_MNEMONIC_MOV && src.type == ZYDIS_OPERAND_TYPE_MEMORY &&
+                    src.mem.base == ZYDIS_REGISTER_RIP)
+                {
+                    out.vreg_slot = routine[i].address() + routine[i].raw().size() + src.mem.disp;
+                }
+                break;
+            }
+        }
+
+        // Handlers index vregs through this register, a guess would misclassify them all
+        //
+        if (out.vreg_r == ZYDIS_REGISTER_NONE)
+        {
+            std::printf("Entry at 0x%llx sets up no vreg register before dispatch, skipping it\n",
+                (unsigned long long)address);
+            return std::nullopt;
+        }
+        return out;
+    }
+
+    std::vector<entry_t> find_entries(const pe::image& image)
+    {
+        std::vector<entry_t> out;
+
+        for (const auto& section : image.sections)
+        {
+            if (!section.is_executable())
+                continue;
+
+            const auto base = image.image_base + section.rva;
+            const auto* begin = image.translate(base, section.virtual_size);
+            if (!begin)
+                continue;
+
+            for (const auto& match : scan::find_all({ begin, section.virtual_size }, { &prologue, 1 }))
+            {
+                if (auto entry = analyze(image, base + match.offset))
+                    out.push_back(*entry);
+            }
+        }
+        return out;
+    }
+}
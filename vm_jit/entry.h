@@ -0,0 +1,51 @@
+#pragma once
+#include "vm.h"
+
+#include <vector>
+
+namespace vm
+{
+    // VM entry found in the image, everything needed to start tracing it
+    //
+    struct entry_t
+    {
+        uint64_t address = 0;
+        // File offset of the entry, the devirtualized function is written here
+        //
+        uint64_t offset = 0;
+        vip_t vip = 0;
+        uint64_t rkey = 0;
+        uint64_t ror_key = 0;
+
+        x86::zydis_register_t vip_r = ZYDIS_REGISTER_NONE;
+        x86::zydis_register_t vreg_r = ZYDIS_REGISTER_NONE;
+        x86::zydis_register_t rkey_r = ZYDIS_REGISTER_NONE;
+        // Global the vreg file pointer is loaded from, 0 if the entry sets it up otherwise.
+        // The host program allocates the file before the first call.
+        //
+        uint64_t vreg_slot = 0;
+    };
+
+    /*
+    * Entries start by saving the context in the inverse order of the Exit handler,
+    * then load the bytecode pointer and rolling key and dispatch the first handler:
+    *
+    *   push    rax
+    *   push    rbx
+    *   ...
+    *   push    r15
+    *   mov     r8, 140067050h
+    *   mov     r10, 1337DEAD6969CAFEh
+    *   ...
+    *   mov     rax, [r8]
+    *   add     r8, 8
+    *   xor     rax, r10
+    *   ror     rax, 5
+    *   xor     r10, rax
+    *   jmp     rax
+    *
+    * Executable sections are scanned for the push sequence first, only hits are decoded.
+    * Hits where a register role can't be told are reported and left out.
+    */
+    std::vector<entry_t> find_entries(const pe::image& image);
+}
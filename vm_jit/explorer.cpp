@@ -0,0 +1,368 @@
+#include "explorer.h"
+#include "matcher.h"
+#include "stats.h"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+
+namespace vm
+{
+    instruction_t explorer::step(state& state, uint64_t& ror_key)
+    {
+        instruction_t instr;
+        instr.vip = state.vip;
+
+        // Keys derived from unknown memory can send a path outside the image
+        //
+        if (!state.image->translate(state.vip, sizeof(uint64_t)))
+            return instr;
+
+        auto next_handler = state.decrypt_vip(ror_key);
+        stats::count(stats::counter_t::Decrypts);
+        auto* section = state.image->section(next_handler);
+        if (!section || !section->is_executable())
+            return instr;
+
+        const auto& handler = handlers.get(state, next_handler);
+        const auto& ror_keys = handler.ror_keys;
+
+        instr.op = handler.op;
+        instr.operand = 0;
+
+        if (ror_keys.size() > 1)
+        {
+            // Extract operand
+            //
+            assert(ror_keys.size() == 2);
+            if (!state.image->translate(state.vip, sizeof(uint64_t)))
+                return instruction_t{ opcodes::Invalid, instr.vip };
+            instr.operand = state.decrypt_vip(ror_keys[0]);
+            stats::count(stats::counter_t::Decrypts);
+        }
+
+        if (instr.op == opcodes::Invalid)
+        {
+            std::lock_guard guard(undecoded_lock);
+            undecoded.emplace(next_handler, &handler);
+            return instr;
+        }
+
+        emulate(state, instr);
+        stats::count(stats::counter_t::Instructions);
+
+        if (instr.op == opcodes::Jnz)
+        {
+            ror_key = handler.jcc_key;
+        }
+        else if (instr.op != opcodes::Exit)
+        {
+            // Last key is always next handler decryption key
+            //
+            ror_key = ror_keys.back();
+        }
+        return instr;
+    }
+
+    void explorer::dump_undecoded()
+    {
+        for (const auto& [address, handler] : undecoded)
+        {
+            std::printf("Undecoded handler at 0x%llx\n", (unsigned long long)address);
+            handler->routine.dump();
+        }
+        undecoded.clear();
+    }
+
+    void explorer::run(const state& entry, uint64_t ror_key, const block_sink_t& sink)
+    {
+        if (threads > 1)
+            return run_parallel(entry, ror_key, sink);
+
+        worklist.clear();
+        visited.clear();
+        invalid.clear();
+        worklist.push_back({ entry, ror_key });
+
+        while (!worklist.empty())
+        {
+            auto path = std::move(worklist.back());
+            worklist.pop_back();
+
+            // Another path got there first
+            //
+            if (visited.contains(path.state.vip))
+                continue;
+
+            block_t block;
+            block.vip = path.state.vip;
+
+            while (true)
+            {
+                // Bytecode that did not decode ends every path into it, a join there
+                // would point at a vip that is in no block
+                //
+                if (invalid.contains(path.state.vip))
+                    break;
+
+                if (!visited.insert(path.state.vip).second)
+                {
+                    block.next = path.state.vip;
+                    break;
+                }
+
+                auto instr = step(path.state, path.ror_key);
+                if (instr.op == opcodes::Invalid)
+                {
+                    invalid.insert(instr.vip);
+                    break;
+                }
+
+                block.instructions.push_back(instr);
+
+                if (instr.op == opcodes::Exit)
+                    break;
+
+                if (instr.op == opcodes::Jnz)
+                {
+                    // Taken edge resumes from the keys popped by the handler
+                    //
+                    path_t taken{ path.state, instr.branch_ror_key };
+                    taken.state.vip = instr.operand;
+                    taken.state.rkey = instr.branch_rkey;
+                    worklist.push_back(std::move(taken));
+                }
+            }
+            sink(block);
+        }
+        dump_undecoded();
+    }
+
+    trace_t explorer::run(const state& entry, uint64_t ror_key)
+    {
+        trace_t out;
+        run(entry, ror_key, [&](const block_t& block)
+            {
+                out.blocks.push_back(block);
+            });
+        return out;
+    }
+
+    // Visited set and instruction graph in one, sharded so that claims
+    // from different workers rarely touch the same lock.
+    //
+    template<typename T>
+    struct sharded_map
+    {
+        static constexpr size_t shard_count = 64;
+
+        struct shard_t
+        {
+            std::mutex lock;
+            std::unordered_map<vip_t, T> items;
+        };
+        std::array<shard_t, shard_count> shards;
+
+        shard_t& shard(vip_t vip)
+        {
+            // Bytecode slots are 8 byte aligned, drop the low bits before picking a shard
+            //
+            return shards[(vip >> 3) % shard_count];
+        }
+
+        // Returns the new entry, or nullptr if vip was already claimed. Entries never move,
+        // the claiming thread can fill them in without holding the lock.
+        //
+        T* claim(vip_t vip)
+        {
+            auto& s = shard(vip);
+            std::lock_guard guard(s.lock);
+            auto [it, inserted] = s.items.try_emplace(vip);
+            return inserted ? &it->second : nullptr;
+        }
+
+        // Only valid once every worker is done
+        //
+        const T* find(vip_t vip)
+        {
+            auto& s = shard(vip);
+            auto it = s.items.find(vip);
+            return it != s.items.end() ? &it->second : nullptr;
+        }
+    };
+
+    void explorer::run_parallel(const state& entry, uint64_t ror_key, const block_sink_t& sink)
+    {
+        struct queue_t
+        {
+            std::mutex lock;
+            std::deque<path_t> paths;
+        };
+
+        std::vector<queue_t> queues(threads);
+        sharded_map<node_t> nodes;
+        // Paths queued or being traced, workers leave once it drops to zero
+        //
+        std::atomic<size_t> pending = 1;
+        // Paths sitting in a queue, idle workers sleep until one shows up
+        //
+        std::atomic<size_t> queued = 1;
+        std::mutex idle_lock;
+        std::condition_variable idle;
+
+        queues[0].paths.push_back({ entry, ror_key });
+
+        auto take = [&](size_t self) -> std::optional<path_t>
+        {
+            // Own queue is LIFO, stealing takes the oldest path from the others
+            //
+            {
+                auto& q = queues[self];
+                std::lock_guard guard(q.lock);
+                if (!q.paths.empty())
+                {
+                    auto path = std::move(q.paths.back());
+                    q.paths.pop_back();
+                    queued--;
+                    return path;
+                }
+            }
+            for (size_t i = 1; i < queues.size(); i++)
+            {
+                auto& q = queues[(self + i) % queues.size()];
+                std::lock_guard guard(q.lock);
+                if (!q.paths.empty())
+                {
+                    auto path = std::move(q.paths.front());
+                    q.paths.pop_front();
+                    queued--;
+                    return path;
+                }
+            }
+            return std::nullopt;
+        };
+
+        // Waiters check their condition under idle_lock, taking it before notifying
+        // means a wakeup can't slip in between their check and their wait
+        //
+        auto wake = [&](bool all)
+        {
+            {
+                std::lock_guard guard(idle_lock);
+            }
+            if (all)
+                idle.notify_all();
+            else
+                idle.notify_one();
+        };
+
+        auto worker = [&](size_t self)
+        {
+            while (true)
+            {
+                auto path = take(self);
+                if (!path)
+                {
+                    std::unique_lock guard(idle_lock);
+                    idle.wait(guard, [&] { return queued.load() || !pending.load(); });
+                    if (!pending.load())
+                        return;
+                    continue;
+                }
+
+                while (auto* node = nodes.claim(path->state.vip))
+                {
+                    node->instr = step(path->state, path->ror_key);
+                    if (node->instr.op == opcodes::Invalid || node->instr.op == opcodes::Exit)
+                        break;
+
+                    node->fall = path->state.vip;
+
+                    if (node->instr.op == opcodes::Jnz)
+                    {
+                        path_t taken{ path->state, node->instr.branch_ror_key };
+                        taken.state.vip = node->instr.operand;
+                        taken.state.rkey = node->instr.branch_rkey;
+
+                        pending++;
+                        {
+                            auto& q = queues[self];
+                            std::lock_guard guard(q.lock);
+                            q.paths.push_back(std::move(taken));
+                            queued++;
+                        }
+                        wake(false);
+                    }
+                }
+
+                // Last path done, nothing can queue another one
+                //
+                if (pending.fetch_sub(1) == 1)
+                    wake(true);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; i++)
+            pool.emplace_back(worker, i);
+        worker(0);
+        for (auto& t : pool)
+            t.join();
+
+        // Handler dumps would interleave if workers printed them as they go
+        //
+        dump_undecoded();
+
+        // Replay the sequential walk over the finished graph
+        //
+        std::vector<vip_t> order{ entry.vip };
+        std::unordered_set<vip_t> seen;
+
+        while (!order.empty())
+        {
+            auto vip = order.back();
+            order.pop_back();
+
+            if (seen.contains(vip))
+                continue;
+
+            block_t block;
+            block.vip = vip;
+
+            while (true)
+            {
+                // Same as the sequential walk, no joins into bytecode that did not decode
+                //
+                const auto* node = nodes.find(vip);
+                if (!node || node->instr.op == opcodes::Invalid)
+                {
+                    seen.insert(vip);
+                    break;
+                }
+
+                if (!seen.insert(vip).second)
+                {
+                    block.next = vip;
+                    break;
+                }
+
+                block.instructions.push_back(node->instr);
+
+                if (node->instr.op == opcodes::Exit)
+                    break;
+
+                if (node->instr.op == opcodes::Jnz)
+                    order.push_back(node->instr.operand);
+
+                vip = node->fall;
+            }
+            sink(block);
+        }
+    }
+}
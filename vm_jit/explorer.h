@@ -0,0 +1,86 @@
+#pragma once
+#include "vm.h"
+#include "handlers.h"
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace vm
+{
+    // Straight line run of bytecode. Jnz does not end a block, the fall-through
+    // continues in place and the taken edge is explored as a separate block.
+    //
+    struct block_t
+    {
+        vip_t vip = ~0ull;
+        std::vector<instruction_t> instructions;
+        // Set when the block runs into bytecode that was already emitted. Always a vip
+        // some block holds, a block that runs into bytecode that did not decode ends
+        // there with next unset.
+        //
+        vip_t next = ~0ull;
+    };
+
+    struct trace_t
+    {
+        std::vector<block_t> blocks;
+    };
+
+    using block_sink_t = std::function<void(const block_t&)>;
+
+    // Follows both edges of every Jnz. Each pending path carries its own copy of the
+    // decryption state, so the taken edge resumes with the vip, rolling key, ror key
+    // and stack depth it had at the branch. Visited VIPs are never traced twice.
+    //
+    // With more than one thread, paths are traced on a work-stealing pool into a
+    // vip -> instruction graph first. Blocks are then cut from that graph in the same
+    // order the single threaded walk would produce, so output does not depend on
+    // scheduling.
+    //
+    struct explorer
+    {
+        handler_cache& handlers;
+        unsigned threads;
+
+        explicit explorer(handler_cache& handlers, unsigned threads = 1)
+            : handlers(handlers), threads(threads ? threads : 1) {}
+
+        // Blocks are passed to sink in discovery order, the first one is the entry
+        //
+        void run(const state& entry, uint64_t ror_key, const block_sink_t& sink);
+        trace_t run(const state& entry, uint64_t ror_key);
+
+    private:
+        struct path_t
+        {
+            vm::state state;
+            uint64_t ror_key;
+        };
+
+        // Traced instruction and where its path continues
+        //
+        struct node_t
+        {
+            instruction_t instr;
+            vip_t fall = ~0ull;
+        };
+
+        std::vector<path_t> worklist;
+        std::unordered_set<vip_t> visited;
+        std::unordered_set<vip_t> invalid;
+
+        // Handlers that did not classify, by address. Dumped once a run is done so
+        // output from parallel workers doesn't interleave.
+        //
+        std::map<uint64_t, const handler_t*> undecoded;
+        std::mutex undecoded_lock;
+
+        instruction_t step(state& state, uint64_t& ror_key);
+        void dump_undecoded();
+
+        void run_parallel(const state& entry, uint64_t ror_key, const block_sink_t& sink);
+    };
+}
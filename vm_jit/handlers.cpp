@@ -0,0 +1,287 @@
+#include "handlers.h"
+#include "matcher.h"
+#include "scan.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <optional>
+#include <thread>
+
+namespace vm
+{
+    // Reads keys back from the positions a knowledge base entry points at. Positions
+    // that don't hold what they should (hash collision) reject the entry.
+    //
+    static bool apply(handler_t& handler, const knowledge_t& known)
+    {
+        const auto& routine = handler.routine;
+        auto holds = [&](int i, ZydisMnemonic mnemonic)
+        {
+            return i >= 0 && (size_t)i < routine.size() &&
+                routine[i].is(mnemonic, { ZYDIS_OPERAND_TYPE_REGISTER, ZYDIS_OPERAND_TYPE_IMMEDIATE });
+        };
+
+        std::vector<uint64_t> ror_keys;
+        for (auto i : known.ror_keys)
+        {
+            if (!holds(i, ZYDIS_MNEMONIC_ROR))
+                return false;
+            ror_keys.push_back(routine[i].operand(1).imm);
+        }
+
+        uint64_t jcc_key = 0;
+        if (known.jcc_key != -1)
+        {
+            if (!holds(known.jcc_key, ZYDIS_MNEMONIC_MOV))
+                return false;
+            jcc_key = routine[known.jcc_key].operand(1).imm;
+        }
+
+        handler.op = known.op;
+        handler.ror_keys = std::move(ror_keys);
+        handler.jcc_key = jcc_key;
+        return true;
+    }
+
+    static knowledge_t learn(const state& state, const handler_t& handler)
+    {
+        knowledge_t out;
+        out.op = handler.op;
+        for (auto i : find_ror_keys(state, handler.routine))
+            out.ror_keys.push_back((uint16_t)i);
+        if (handler.op == opcodes::Jnz)
+            out.jcc_key = find_jcc_key(handler.routine);
+        return out;
+    }
+
+    // Symbolic results come as values, their positions are looked up by value in
+    // routine order: each fetch ror is the next ror by immediate holding its key and
+    // the Jnz key the last mov of its value. Fails if any of them can't be found.
+    //
+    static std::optional<knowledge_t> learn(const handler_t& handler, const summary_t& summary)
+    {
+        const auto& routine = handler.routine;
+        auto holds = [&](size_t i, ZydisMnemonic mnemonic, uint64_t imm)
+        {
+            return routine[i].is(mnemonic, { ZYDIS_OPERAND_TYPE_REGISTER, ZYDIS_OPERAND_TYPE_IMMEDIATE }) &&
+                routine[i].operand(1).imm == imm;
+        };
+
+        knowledge_t out;
+        out.op = summary.op;
+
+        size_t i = 0;
+        for (auto key : summary.ror_keys)
+        {
+            while (i < routine.size() && !holds(i, ZYDIS_MNEMONIC_ROR, key))
+                i++;
+            if (i == routine.size())
+                return std::nullopt;
+            out.ror_keys.push_back((uint16_t)i++);
+        }
+
+        if (summary.op == opcodes::Jnz)
+        {
+            for (size_t j = routine.size(); j-- > 0;)
+            {
+                if (holds(j, ZYDIS_MNEMONIC_MOV, summary.jcc_key))
+                {
+                    out.jcc_key = (int32_t)j;
+                    break;
+                }
+            }
+            if (out.jcc_key == -1)
+                return std::nullopt;
+        }
+        return out;
+    }
+
+    // The symbolic stack effect has to agree with what the IR builder assumes for the
+    // opcode. Exit also pops the return address, what it leaves behind is never used.
+    //
+    static bool agrees(const summary_t& summary)
+    {
+        auto expected = (int64_t)stack_delta(summary.op) * 8;
+        return summary.op == opcodes::Exit ? summary.stack_delta <= expected : summary.stack_delta == expected;
+    }
+
+    const handler_t& handler_cache::get(const state& state, uint64_t address)
+    {
+        {
+            std::shared_lock guard(lock);
+            if (auto it = handlers.find(address); it != handlers.end())
+                return it->second;
+        }
+
+        // Decode outside of the lock, if two threads race on the same
+        // handler the first one to insert wins.
+        //
+        handler_t handler;
+        {
+            stats::scope_t scope(stats::phase_t::Decode);
+            handler.routine = x86::unroll(*state.image, address);
+        }
+        stats::count(stats::counter_t::Handlers);
+
+        uint64_t key = 0;
+        if (knowledge)
+        {
+            key = knowledge_base::key(state, handler.routine);
+            if (auto known = knowledge->find(key); known && apply(handler, *known))
+            {
+                stats::count(stats::counter_t::KnowledgeHits);
+                std::unique_lock guard(lock);
+                return handlers.emplace(address, std::move(handler)).first->second;
+            }
+        }
+
+        bool symbolic = false;
+        {
+            stats::scope_t scope(stats::phase_t::Classify);
+            handler.ror_keys = extract_ror_keys(state, handler.routine);
+            handler.op = classify(state, handler.routine);
+
+            // A Jnz shape without its key load can't be decrypted, let symbolic execution try it
+            //
+            if (handler.op == opcodes::Jnz)
+            {
+                auto i_load = find_jcc_key(handler.routine);
+                if (i_load == -1)
+                    handler.op = opcodes::Invalid;
+                else
+                    handler.jcc_key = handler.routine[i_load].operand(1).imm;
+            }
+
+            // Only shapes the patterns don't know pay for symbolic execution
+            //
+            if (handler.op == opcodes::Invalid)
+            {
+                handler.summary = summarize(state, handler.routine);
+                if (handler.summary.op != opcodes::Invalid && agrees(handler.summary))
+                {
+                    handler.op = handler.summary.op;
+                    handler.ror_keys = handler.summary.ror_keys;
+                    handler.jcc_key = handler.summary.jcc_key;
+                    symbolic = true;
+                }
+            }
+        }
+
+        if (knowledge && handler.op != opcodes::Invalid)
+        {
+            auto learned = symbolic ? learn(handler, handler.summary) : learn(state, handler);
+            if (learned)
+                knowledge->insert(key, *learned);
+        }
+
+        std::unique_lock guard(lock);
+        return handlers.emplace(address, std::move(handler)).first->second;
+    }
+
+    void handler_cache::prefetch(const state& state, const std::vector<uint64_t>& addresses, unsigned threads)
+    {
+        std::atomic<size_t> next = 0;
+        auto worker = [&]
+        {
+            for (size_t i = next++; i < addresses.size(); i = next++)
+                get(state, addresses[i]);
+        };
+
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < std::max(threads, 1u); i++)
+            pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool)
+            t.join();
+    }
+
+    // Length of the dispatch tail at p, 0 if there is none. The register the next
+    // handler is fetched into varies, vip and rolling key stay in r8 and r10:
+    //
+    /*
+    *   mov     reg, [r8]               49 8B /r
+    *   add     r8, 8                   49 83 C0 08
+    *   xor     reg, r10                4C 31 D0+r      or 49 33 C2+r*8
+    *   ror     reg, imm8 / 1 / cl      48 C1 C8+r ib   or 48 D1 C8+r    or 48 D3 C8+r
+    *   xor     r10, reg                4C 33 D0+r      or 49 31 C2+r*8
+    *   jmp     reg                     FF E0+r
+    *   push    reg; ret                50+r C3
+    */
+    static size_t tail_length(const uint8_t* p, size_t size)
+    {
+        if (size < 18 || p[0] != 0x49 || p[1] != 0x8B || (p[2] & 0xC7) != 0)
+            return 0;
+        const uint8_t r = (p[2] >> 3) & 7;
+        // rsp holds the VM stack
+        //
+        if (r == 4)
+            return 0;
+
+        size_t i = 3;
+        auto take = [&](std::initializer_list<uint8_t> bytes)
+        {
+            if (i + bytes.size() > size || !std::equal(bytes.begin(), bytes.end(), p + i))
+                return false;
+            i += bytes.size();
+            return true;
+        };
+
+        if (!take({ 0x49, 0x83, 0xC0, 0x08 }))
+            return 0;
+        if (!take({ 0x4C, 0x31, (uint8_t)(0xD0 + r) }) && !take({ 0x49, 0x33, (uint8_t)(0xC2 + r * 8) }))
+            return 0;
+        if (take({ 0x48, 0xC1, (uint8_t)(0xC8 + r) }))
+            i++;
+        else if (!take({ 0x48, 0xD1, (uint8_t)(0xC8 + r) }) && !take({ 0x48, 0xD3, (uint8_t)(0xC8 + r) }))
+            return 0;
+        if (!take({ 0x4C, 0x33, (uint8_t)(0xD0 + r) }) && !take({ 0x49, 0x31, (uint8_t)(0xC2 + r * 8) }))
+            return 0;
+        if (!take({ 0xFF, (uint8_t)(0xE0 + r) }) && !take({ (uint8_t)(0x50 + r), 0xC3 }))
+            return 0;
+        return i;
+    }
+
+    std::vector<uint64_t> find_handlers(const pe::image& image)
+    {
+        // Dispatches are found by their fetch and checked by tail_length, they have too
+        // many encodings for byte patterns. Exit handlers end in the context restore.
+        //
+        static const std::vector<scan::pattern_t> tails =
+        {
+            scan::pattern_t::parse("49 8B ?? 49 83 C0 08"),
+            scan::pattern_t::parse("41 5F 41 5E 41 5D 41 5C 41 5B 41 5A 41 59 41 58 5D 5E 5F 5A 59 5B 58 C3"),
+        };
+
+        std::vector<uint64_t> out;
+        for (const auto& section : image.sections)
+        {
+            if (!section.is_executable())
+                continue;
+
+            const auto base = image.image_base + section.rva;
+            const auto* data = image.translate(base, section.virtual_size);
+            if (!data)
+                continue;
+
+            for (const auto& match : scan::find_all({ data, section.virtual_size }, tails))
+            {
+                // Operand fetches have the same head and are followed by the handler body
+                //
+                auto length = match.pattern == 0 ?
+                    tail_length(data + match.offset, section.virtual_size - match.offset) : tails[match.pattern].size();
+                if (!length)
+                    continue;
+
+                auto next = match.offset + length;
+                // Padding between handlers is skipped, only real code is worth decoding
+                //
+                while (next < section.virtual_size && data[next] == 0xCC)
+                    next++;
+                if (next < section.virtual_size)
+                    out.push_back(base + next);
+            }
+        }
+        return out;
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "disasm.h"
+#include "vm.h"
+#include "semantics.h"
+#include "knowledge.h"
+
+#include <unordered_map>
+#include <shared_mutex>
+#include <mutex>
+#include <vector>
+
+namespace vm
+{
+    // Bump whenever a change to matching, the symbolic fallback or the knowledge base
+    // can change what a handler classifies as. Cached traces are keyed on it.
+    //
+    static constexpr uint32_t classifier_version = 3;
+
+    // Everything we learn about a handler that does not depend on the bytecode
+    //
+    struct handler_t
+    {
+        x86::routine_t routine;
+        opcodes op = opcodes::Invalid;
+        std::vector<uint64_t> ror_keys;
+        uint64_t jcc_key = 0;
+        // Symbolic view of the same routine, fills in for shapes the patterns don't know.
+        // Only filled in for handlers neither the knowledge base nor the patterns knew.
+        //
+        summary_t summary;
+    };
+
+    // Handlers are decoded and classified once per address,
+    // repeated visits are a single lookup. Safe to share between threads,
+    // returned references stay valid for the lifetime of the cache.
+    //
+    struct handler_cache
+    {
+        std::unordered_map<uint64_t, handler_t> handlers;
+        mutable std::shared_mutex lock;
+        // Consulted before any matching and taught every handler matching or the
+        // symbolic fallback classifies
+        //
+        knowledge_base* knowledge = nullptr;
+
+        const handler_t& get(const state& state, uint64_t address);
+
+        // Decode and classify all addresses up front, split over threads
+        //
+        void prefetch(const state& state, const std::vector<uint64_t>& addresses, unsigned threads);
+
+        size_t size() const
+        {
+            std::shared_lock guard(lock);
+            return handlers.size();
+        }
+    };
+
+    // Handler starts found by scanning executable sections for dispatch tails.
+    // Handlers are laid out back to back, so the address after every tail
+    // is a candidate for the next one. Any fetch register, either dispatch, and the
+    // context restore that ends Exit handlers.
+    //
+    /*
+    *   mov     reg, [r8]
+    *   add     r8, 8
+    *   xor     reg, r10
+    *   ror     reg, ??
+    *   xor     r10, reg
+    *   jmp     reg         or  push reg; ret
+    */
+    std::vector<uint64_t> find_handlers(const pe::image& image);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+// Non-cryptographic 64-bit hash for content keys. Four independent lanes consume
+// 32 bytes per round so large images hash at memory speed, the tail is folded in
+// word by word and everything is finished with the murmur3 avalanche.
+//
+namespace hash
+{
+    static constexpr uint64_t prime_1 = 0x9E3779B185EBCA87ull;
+    static constexpr uint64_t prime_2 = 0xC2B2AE3D27D4EB4Full;
+    static constexpr uint64_t prime_3 = 0x165667B19E3779F9ull;
+
+    static inline uint64_t load64(const uint8_t* p)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static inline uint64_t step(uint64_t acc, uint64_t v)
+    {
+        acc += v * prime_2;
+        acc = std::rotl(acc, 31);
+        return acc * prime_1;
+    }
+
+    static inline uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static inline uint64_t hash64(const void* data, size_t size, uint64_t seed = 0)
+    {
+        const auto* p = static_cast<const uint8_t*>(data);
+        const auto* end = p + size;
+
+        uint64_t h = seed + prime_3 + size;
+        if (size >= 32)
+        {
+            uint64_t lanes[4] = { seed + prime_1 + prime_2, seed + prime_2, seed, seed - prime_1 };
+            for (; end - p >= 32; p += 32)
+            {
+                lanes[0] = step(lanes[0], load64(p));
+                lanes[1] = step(lanes[1], load64(p + 8));
+                lanes[2] = step(lanes[2], load64(p + 16));
+                lanes[3] = step(lanes[3], load64(p + 24));
+            }
+            h += std::rotl(lanes[0], 1) + std::rotl(lanes[1], 7) +
+                std::rotl(lanes[2], 12) + std::rotl(lanes[3], 18);
+            for (auto lane : lanes)
+                h = (h ^ step(0, lane)) * prime_1 + prime_3;
+        }
+
+        for (; end - p >= 8; p += 8)
+            h = std::rotl(h ^ step(0, load64(p)), 27) * prime_1 + prime_3;
+
+        // Remaining 0..7 bytes as one zero padded word
+        //
+        if (p != end)
+        {
+            uint64_t tail = 0;
+            std::memcpy(&tail, p, end - p);
+            h = std::rotl(h ^ (tail * prime_1), 23) * prime_2;
+        }
+        return mix(h);
+    }
+
+    static inline uint64_t combine(uint64_t h, uint64_t v)
+    {
+        return mix(h ^ (v + prime_3 + (h << 6) + (h >> 2)));
+    }
+}
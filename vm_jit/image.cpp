@@ -0,0 +1,336 @@
+#include "image.h"
+
+#include <algorithm>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace pe
+{
+    static size_t page_size()
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+        return size;
+#endif
+    }
+
+    bool section_t::is_executable() const
+    {
+        return characteristics & section_mem_execute;
+    }
+
+    image::image(image&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    image& image::operator=(image&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            image_base = other.image_base;
+            size_of_image = other.size_of_image;
+            entry_point = other.entry_point;
+            size_of_headers = other.size_of_headers;
+            sections = std::move(other.sections);
+            view = std::exchange(other.view, nullptr);
+            file = std::exchange(other.file, nullptr);
+            file_length = std::exchange(other.file_length, 0);
+            view_length = std::exchange(other.view_length, 0);
+#ifndef _WIN32
+            descriptor = std::exchange(other.descriptor, -1);
+#endif
+        }
+        return *this;
+    }
+
+    image::~image()
+    {
+        release();
+    }
+
+    void image::release()
+    {
+#ifdef _WIN32
+        if (view) VirtualFree(view, 0, MEM_RELEASE);
+        if (file) UnmapViewOfFile(file);
+#else
+        if (view) munmap(view, view_length);
+        if (file) munmap(const_cast<uint8_t*>(file), file_length);
+#endif
+        view = nullptr;
+        file = nullptr;
+        view_length = 0;
+        file_length = 0;
+    }
+
+    std::optional<image> image::load(const std::string& path)
+    {
+        image out;
+        bool ok = out.map_file(path) &&
+            out.parse_headers() &&
+            out.map_sections();
+
+#ifndef _WIN32
+        if (out.descriptor != -1)
+            close(std::exchange(out.descriptor, -1));
+#endif
+        if (!ok)
+            return std::nullopt;
+
+        return out;
+    }
+
+    bool image::map_file(const std::string& path)
+    {
+#ifdef _WIN32
+        auto handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+        {
+            CloseHandle(handle);
+            return false;
+        }
+
+        auto mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(handle);
+        if (!mapping)
+            return false;
+
+        file = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        CloseHandle(mapping);
+        file_length = (size_t)size.QuadPart;
+        return file != nullptr;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        auto* ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+
+        // Keep the descriptor around until sections are mapped
+        //
+        descriptor = fd;
+        file = static_cast<const uint8_t*>(ptr);
+        file_length = (size_t)st.st_size;
+        return true;
+#endif
+    }
+
+    bool image::parse_headers()
+    {
+        if (file_length < sizeof(dos_header_t))
+            return false;
+
+        const auto* dos = reinterpret_cast<const dos_header_t*>(file);
+        if (dos->e_magic != dos_signature || dos->e_lfanew < 0 ||
+            (size_t)dos->e_lfanew + sizeof(nt_headers64_t) > file_length)
+            return false;
+
+        const auto* nt = reinterpret_cast<const nt_headers64_t*>(file + dos->e_lfanew);
+        if (nt->signature != nt_signature ||
+            nt->optional_header.magic != optional_header64_magic)
+            return false;
+
+        image_base = nt->optional_header.image_base;
+        size_of_image = nt->optional_header.size_of_image;
+        size_of_headers = std::min<uint32_t>(nt->optional_header.size_of_headers, size_of_image);
+        entry_point = nt->optional_header.address_of_entry_point;
+
+        // Section table follows the optional header
+        //
+        size_t table = (size_t)dos->e_lfanew + offsetof(nt_headers64_t, optional_header) +
+            nt->file_header.size_of_optional_header;
+        size_t count = nt->file_header.number_of_sections;
+        if (table + count * sizeof(section_header_t) > file_length)
+            return false;
+
+        const auto* headers = reinterpret_cast<const section_header_t*>(file + table);
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto& h = headers[i];
+            section_t s;
+            s.name = std::string(h.name, strnlen(h.name, sizeof(h.name)));
+            s.rva = h.virtual_address;
+            s.virtual_size = h.virtual_size ? h.virtual_size : h.size_of_raw_data;
+            s.raw_offset = h.pointer_to_raw_data;
+            s.raw_size = h.size_of_raw_data;
+            s.characteristics = h.characteristics;
+
+            if ((uint64_t)s.rva + s.virtual_size > size_of_image)
+                return false;
+
+            sections.push_back(std::move(s));
+        }
+        return true;
+    }
+
+    bool image::map_sections()
+    {
+        view_length = (size_of_image + page_size() - 1) & ~(page_size() - 1);
+        if (!view_length)
+            return false;
+
+        // Bytes of every section that are actually backed by the file
+        //
+        auto backed = [&](const section_t& s) -> size_t
+        {
+            if (s.raw_offset >= file_length)
+                return 0;
+            return std::min<size_t>({ s.raw_size, s.virtual_size, file_length - s.raw_offset });
+        };
+
+#ifdef _WIN32
+        view = static_cast<uint8_t*>(VirtualAlloc(nullptr, view_length, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+        if (!view)
+            return false;
+
+        std::memcpy(view, file, std::min<size_t>(size_of_headers, file_length));
+        for (const auto& s : sections)
+            std::memcpy(view + s.rva, file + s.raw_offset, backed(s));
+
+        DWORD old;
+        VirtualProtect(view, view_length, PAGE_READONLY, &old);
+        return true;
+#else
+        // Reserve the whole image as zero pages first, uninitialized data stays untouched
+        //
+        auto* base = mmap(nullptr, view_length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            return false;
+        view = static_cast<uint8_t*>(base);
+
+        auto copy = [&](uint64_t rva, const uint8_t* src, size_t size) -> bool
+        {
+            if (!size)
+                return true;
+
+            auto begin = rva & ~(page_size() - 1);
+            auto end = (rva + size + page_size() - 1) & ~(page_size() - 1);
+            if (mprotect(view + begin, end - begin, PROT_READ | PROT_WRITE) == -1)
+                return false;
+            std::memcpy(view + rva, src, size);
+            return mprotect(view + begin, end - begin, PROT_READ) != -1;
+        };
+
+        if (!copy(0, file, std::min<size_t>(size_of_headers, file_length)))
+            return false;
+
+        for (const auto& s : sections)
+        {
+            size_t size = backed(s);
+            size_t whole = size & ~(page_size() - 1);
+
+            // Zero-copy path: both the RVA and the file offset are page aligned, so the pages
+            // are mapped straight from the file over the placeholder. Only the trailing
+            // partial page is copied, the rest of it must stay zeroed.
+            //
+            if (whole && descriptor != -1 && !(s.rva & (page_size() - 1)) && !(s.raw_offset & (page_size() - 1)))
+            {
+                auto* ptr = mmap(view + s.rva, whole, PROT_READ, MAP_PRIVATE | MAP_FIXED, descriptor, s.raw_offset);
+                if (ptr == MAP_FAILED)
+                    return false;
+
+                if (!copy(s.rva + whole, file + s.raw_offset + whole, size - whole))
+                    return false;
+            }
+            else if (!copy(s.rva, file + s.raw_offset, size))
+            {
+                return false;
+            }
+        }
+        return true;
+#endif
+    }
+
+    const uint8_t* image::translate(uint64_t va, size_t size) const
+    {
+        if (va < image_base)
+            return nullptr;
+
+        uint64_t rva = va - image_base;
+        if (rva >= size_of_image || size > size_of_image - rva)
+            return nullptr;
+
+        return view + rva;
+    }
+
+    size_t image::available(uint64_t va) const
+    {
+        if (va < image_base || va - image_base >= size_of_image)
+            return 0;
+        return size_of_image - (size_t)(va - image_base);
+    }
+
+    const section_t* image::section(uint64_t va) const
+    {
+        if (va < image_base)
+            return nullptr;
+
+        uint64_t rva = va - image_base;
+        for (const auto& s : sections)
+        {
+            if (rva >= s.rva && rva < (uint64_t)s.rva + s.virtual_size)
+                return &s;
+        }
+        return nullptr;
+    }
+
+    std::optional<uint64_t> image::va_to_offset(uint64_t va) const
+    {
+        if (va < image_base)
+            return std::nullopt;
+
+        uint64_t rva = va - image_base;
+        if (rva < size_of_headers)
+            return rva;
+
+        const auto* s = section(va);
+        if (!s || rva - s->rva >= s->raw_size)
+            return std::nullopt;
+
+        return s->raw_offset + (rva - s->rva);
+    }
+
+    std::optional<uint64_t> image::offset_to_va(uint64_t offset) const
+    {
+        if (offset < size_of_headers)
+            return image_base + offset;
+
+        for (const auto& s : sections)
+        {
+            if (offset >= s.raw_offset && offset - s.raw_offset < std::min(s.raw_size, s.virtual_size))
+                return image_base + s.rva + (offset - s.raw_offset);
+        }
+        return std::nullopt;
+    }
+}
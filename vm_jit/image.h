@@ -0,0 +1,173 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace pe
+{
+#pragma pack(push, 1)
+    struct dos_header_t
+    {
+        uint16_t e_magic;
+        uint8_t  e_unused[58];
+        int32_t  e_lfanew;
+    };
+
+    struct file_header_t
+    {
+        uint16_t machine;
+        uint16_t number_of_sections;
+        uint32_t time_date_stamp;
+        uint32_t pointer_to_symbol_table;
+        uint32_t number_of_symbols;
+        uint16_t size_of_optional_header;
+        uint16_t characteristics;
+    };
+
+    struct data_directory_t
+    {
+        uint32_t rva;
+        uint32_t size;
+    };
+
+    struct optional_header64_t
+    {
+        uint16_t magic;
+        uint8_t  major_linker_version;
+        uint8_t  minor_linker_version;
+        uint32_t size_of_code;
+        uint32_t size_of_initialized_data;
+        uint32_t size_of_uninitialized_data;
+        uint32_t address_of_entry_point;
+        uint32_t base_of_code;
+        uint64_t image_base;
+        uint32_t section_alignment;
+        uint32_t file_alignment;
+        uint16_t major_os_version;
+        uint16_t minor_os_version;
+        uint16_t major_image_version;
+        uint16_t minor_image_version;
+        uint16_t major_subsystem_version;
+        uint16_t minor_subsystem_version;
+        uint32_t win32_version_value;
+        uint32_t size_of_image;
+        uint32_t size_of_headers;
+        uint32_t checksum;
+        uint16_t subsystem;
+        uint16_t dll_characteristics;
+        uint64_t size_of_stack_reserve;
+        uint64_t size_of_stack_commit;
+        uint64_t size_of_heap_reserve;
+        uint64_t size_of_heap_commit;
+        uint32_t loader_flags;
+        uint32_t number_of_rva_and_sizes;
+        data_directory_t data_directory[16];
+    };
+
+    struct nt_headers64_t
+    {
+        uint32_t signature;
+        file_header_t file_header;
+        optional_header64_t optional_header;
+    };
+
+    struct section_header_t
+    {
+        char     name[8];
+        uint32_t virtual_size;
+        uint32_t virtual_address;
+        uint32_t size_of_raw_data;
+        uint32_t pointer_to_raw_data;
+        uint32_t pointer_to_relocations;
+        uint32_t pointer_to_linenumbers;
+        uint16_t number_of_relocations;
+        uint16_t number_of_linenumbers;
+        uint32_t characteristics;
+    };
+#pragma pack(pop)
+
+    static constexpr uint16_t dos_signature = 0x5A4D;
+    static constexpr uint32_t nt_signature = 0x00004550;
+    static constexpr uint16_t optional_header64_magic = 0x20B;
+    static constexpr uint32_t section_mem_execute = 0x20000000;
+    static constexpr uint32_t section_mem_read = 0x40000000;
+    static constexpr uint32_t section_mem_write = 0x80000000;
+
+    struct section_t
+    {
+        std::string name;
+        uint32_t rva;
+        uint32_t virtual_size;
+        uint32_t raw_offset;
+        uint32_t raw_size;
+        uint32_t characteristics;
+
+        bool is_executable() const;
+    };
+
+    // Read-only view of a PE32+ file laid out the way the Windows loader would place it.
+    // Sections are mapped at their RVAs (directly from the file when alignment allows it),
+    // so any VA inside the image translates to a host pointer with a single subtraction.
+    //
+    struct image
+    {
+        uint64_t image_base = 0;
+        uint32_t size_of_image = 0;
+        uint32_t entry_point = 0;
+        uint32_t size_of_headers = 0;
+        std::vector<section_t> sections;
+
+        static std::optional<image> load(const std::string& path);
+
+        image() = default;
+        image(image&& other) noexcept;
+        image& operator=(image&& other) noexcept;
+        image(const image&) = delete;
+        image& operator=(const image&) = delete;
+        ~image();
+
+        // Host pointer for [va, va + size) or nullptr if the range leaves the image.
+        //
+        const uint8_t* translate(uint64_t va, size_t size = 1) const;
+        // Number of bytes that can be read starting at va.
+        //
+        size_t available(uint64_t va) const;
+        bool contains(uint64_t va, size_t size = 1) const { return translate(va, size) != nullptr; }
+
+        const section_t* section(uint64_t va) const;
+        std::optional<uint64_t> va_to_offset(uint64_t va) const;
+        std::optional<uint64_t> offset_to_va(uint64_t offset) const;
+
+        // Raw file contents as they are on disk.
+        //
+        const uint8_t* file_data() const { return file; }
+        size_t file_size() const { return file_length; }
+
+        template<typename T>
+        T read(uint64_t va) const
+        {
+            T value{};
+            const auto* ptr = translate(va, sizeof(T));
+            assert(ptr);
+            if (ptr) std::memcpy(&value, ptr, sizeof(T));
+            return value;
+        }
+
+    private:
+        uint8_t* view = nullptr;
+        const uint8_t* file = nullptr;
+        size_t file_length = 0;
+        size_t view_length = 0;
+#ifndef _WIN32
+        int descriptor = -1;
+#endif
+
+        bool map_file(const std::string& path);
+        bool parse_headers();
+        bool map_sections();
+        void release();
+    };
+}
@@ -0,0 +1,452 @@
+#include "interp.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+
+namespace vm
+{
+    enum code_t : uint8_t
+    {
+        PushVreg,
+        PopVreg,
+        PushConst,
+        Read8,
+        Read64,
+        Add,
+        Nand,
+        Mul,
+        Jnz,
+        Exit,
+        // Block end that continues at y
+        //
+        Jump,
+        Trap,
+        // Superinstructions, y holds the destination vreg, packed above b when there is one
+        //
+        VregAddImm,
+        VregAdd,
+        VregNand,
+        NotTop,
+        AddImm,
+        Count,
+    };
+
+    static code_t code_of(opcodes op)
+    {
+        switch (op)
+        {
+        case opcodes::PopVreg:   return PopVreg;
+        case opcodes::PushVreg:  return PushVreg;
+        case opcodes::PushConst: return PushConst;
+        case opcodes::Read8:     return Read8;
+        case opcodes::Read64:    return Read64;
+        case opcodes::Add:       return Add;
+        case opcodes::Nand:      return Nand;
+        case opcodes::Mul:       return Mul;
+        case opcodes::Jnz:       return Jnz;
+        case opcodes::Exit:      return Exit;
+        default:                 return Trap;
+        }
+    }
+
+    // Values an op needs on the stack and how it changes the depth
+    //
+    static std::pair<int32_t, int32_t> stack_effect(uint8_t code)
+    {
+        switch (code)
+        {
+        case PushVreg:
+        case PushConst: return { 0, 1 };
+        case PopVreg:   return { 1, -1 };
+        case Read8:
+        case Read64:    return { 1, 0 };
+        case Add:
+        case Nand:
+        case Mul:       return { 2, -1 };
+        case Jnz:       return { 5, -5 };
+        case Exit:      return { 15, -15 };
+        default:        return { 0, 0 };
+        }
+    }
+
+    bool interpreter::load(const trace_t& trace)
+    {
+        code.clear();
+        vips.clear();
+        entry = 0;
+        max_depth = 0;
+        vreg_count = 0;
+
+        // Flatten in trace order, every block that doesn't exit ends in a Jump or a Trap
+        //
+        std::vector<op_t> flat;
+        std::vector<vip_t> flat_vips;
+        std::unordered_map<vip_t, uint32_t> index;
+        std::vector<std::pair<uint32_t, vip_t>> targets;
+        for (const auto& block : trace.blocks)
+        {
+            if (block.instructions.empty())
+                continue;
+
+            for (const auto& instr : block.instructions)
+            {
+                op_t op;
+                op.code = code_of(instr.op);
+                switch (op.code)
+                {
+                case PushVreg:
+                case PopVreg:
+                    if (instr.operand > UINT16_MAX)
+                    {
+                        std::printf("Vreg 0x%llx at 0x%llx is out of range\n", (unsigned long long)instr.operand, (unsigned long long)instr.vip);
+                        return false;
+                    }
+                    op.x = (uint16_t)instr.operand;
+                    vreg_count = std::max<size_t>(vreg_count, instr.operand + 1);
+                    break;
+                case PushConst:
+                    op.imm = instr.operand;
+                    break;
+                case Jnz:
+                    targets.emplace_back((uint32_t)flat.size(), instr.operand);
+                    break;
+                default:
+                    break;
+                }
+                index.emplace(instr.vip, (uint32_t)flat.size());
+                flat.push_back(op);
+                flat_vips.push_back(instr.vip);
+            }
+
+            const auto& last = block.instructions.back();
+            if (last.op == opcodes::Exit)
+                continue;
+
+            op_t end;
+            end.code = Trap;
+            if (block.next != ~0ull)
+            {
+                end.code = Jump;
+                targets.emplace_back((uint32_t)flat.size(), block.next);
+            }
+            flat.push_back(end);
+            flat_vips.push_back(last.vip);
+        }
+        if (flat.empty())
+            return false;
+
+        // Branches the trace never followed get a Trap of their own that reports the target
+        //
+        for (auto [at, vip] : targets)
+        {
+            auto it = index.find(vip);
+            if (it == index.end())
+            {
+                op_t trap;
+                trap.code = Trap;
+                it = index.emplace(vip, (uint32_t)flat.size()).first;
+                flat.push_back(trap);
+                flat_vips.push_back(vip);
+            }
+            flat[at].y = it->second;
+        }
+        entry = index.at(trace.blocks.front().instructions.front().vip);
+
+        // Depth is fixed per instruction on every path, so the stack is sized once here
+        // and ops never check it
+        //
+        std::vector<int32_t> depths(flat.size(), -1);
+        std::vector<uint32_t> work{ entry };
+        depths[entry] = 15;
+        max_depth = 15;
+        auto reach = [&](uint32_t to, int32_t depth)
+        {
+            // Traps are shared by every branch to the same untraced vip and touch no stack
+            //
+            if (flat[to].code == Trap)
+                return true;
+            if (depths[to] == -1)
+            {
+                depths[to] = depth;
+                work.push_back(to);
+            }
+            return depths[to] == depth;
+        };
+        while (!work.empty())
+        {
+            auto i = work.back();
+            work.pop_back();
+
+            auto depth = depths[i];
+            auto [needs, delta] = stack_effect(flat[i].code);
+            if (depth < needs)
+            {
+                std::printf("Stack underflow at 0x%llx\n", (unsigned long long)flat_vips[i]);
+                return false;
+            }
+            max_depth = std::max<size_t>(max_depth, depth + std::max(delta, 0));
+
+            bool ok = true;
+            switch (flat[i].code)
+            {
+            case Exit:
+            case Trap:
+                break;
+            case Jump:
+                ok = reach(flat[i].y, depth);
+                break;
+            case Jnz:
+                ok = reach(flat[i].y, depth + delta) && reach(i + 1, depth + delta);
+                break;
+            default:
+                ok = reach(i + 1, depth + delta);
+                break;
+            }
+            if (!ok)
+            {
+                std::printf("Stack depth differs between paths at 0x%llx\n", (unsigned long long)flat_vips[i]);
+                return false;
+            }
+        }
+
+        // Fuse, only the first op of a sequence may be a branch target
+        //
+        std::vector<bool> leaders(flat.size());
+        leaders[entry] = true;
+        for (const auto& op : flat)
+        {
+            if (op.code == Jnz || op.code == Jump)
+                leaders[op.y] = true;
+        }
+
+        auto is = [&](size_t i, size_t k, uint8_t op)
+        {
+            return i + k < flat.size() && (!k || !leaders[i + k]) && flat[i + k].code == op;
+        };
+
+        std::vector<uint32_t> remap(flat.size());
+        for (size_t i = 0; i < flat.size();)
+        {
+            auto op = flat[i];
+            size_t length = 1;
+            if (is(i, 0, PushVreg) && is(i, 1, PushConst) && is(i, 2, Add) && is(i, 3, PopVreg))
+            {
+                op = { VregAddImm, 0, flat[i].x, flat[i + 3].x, flat[i + 1].imm };
+                length = 4;
+            }
+            else if (is(i, 0, PushVreg) && is(i, 1, PushVreg) && (is(i, 2, Add) || is(i, 2, Nand)) && is(i, 3, PopVreg))
+            {
+                auto fused = flat[i + 2].code == Add ? VregAdd : VregNand;
+                op = { fused, 0, flat[i].x, (uint32_t)flat[i + 1].x | (uint32_t)flat[i + 3].x << 16, 0 };
+                length = 4;
+            }
+            else if (is(i, 0, PopVreg) && is(i, 1, PushVreg) && is(i, 2, PushVreg) && is(i, 3, Nand) &&
+                flat[i + 1].x == flat[i].x && flat[i + 2].x == flat[i].x)
+            {
+                op = { NotTop, 0, flat[i].x, 0, 0 };
+                length = 4;
+            }
+            else if (is(i, 0, PushConst) && is(i, 1, Add))
+            {
+                op = { AddImm, 0, 0, 0, flat[i].imm };
+                length = 2;
+            }
+
+            remap[i] = (uint32_t)code.size();
+            code.push_back(op);
+            vips.push_back(flat_vips[i]);
+            i += length;
+        }
+
+        for (auto& op : code)
+        {
+            if (op.code == Jnz || op.code == Jump)
+                op.y = remap[op.y];
+        }
+        entry = remap[entry];
+        return true;
+    }
+
+    void interpreter::map(uint64_t address, std::vector<uint8_t> bytes)
+    {
+        regions.push_back({ address, std::move(bytes) });
+    }
+
+    interpreter::result_t interpreter::run(const context_t& regs, std::vector<uint64_t>& vregs, uint64_t budget) const
+    {
+        result_t result;
+        result.regs = regs;
+        if (code.empty())
+            return result;
+
+        if (vregs.size() < vreg_count)
+            vregs.resize(vreg_count);
+        auto* v = vregs.data();
+
+        uint64_t local[256];
+        std::vector<uint64_t> heap;
+        auto* stack = local;
+        if (max_depth > std::size(local))
+        {
+            heap.resize(max_depth);
+            stack = heap.data();
+        }
+        std::copy(regs.begin(), regs.end(), stack);
+        auto* sp = stack + 14;
+
+        const auto* view = image.translate(image.image_base, image.size_of_image);
+        const auto base = image.image_base;
+        const uint64_t size = view ? image.size_of_image : 0;
+        auto read = [&](uint64_t address, size_t width, uint64_t& out)
+        {
+            out = 0;
+            for (const auto& region : regions)
+            {
+                auto offset = address - region.address;
+                if (address >= region.address && offset < region.bytes.size() && region.bytes.size() - offset >= width)
+                {
+                    std::memcpy(&out, region.bytes.data() + offset, width);
+                    return true;
+                }
+            }
+            if (address - base < size && size - (address - base) >= width)
+            {
+                std::memcpy(&out, view + (address - base), width);
+                return true;
+            }
+            return false;
+        };
+
+        const auto* ops = code.data();
+        const auto* pc = ops + entry;
+        auto stop = [&](status_t status)
+        {
+            result.status = status;
+            result.vip = vips[pc - ops];
+            return result;
+        };
+
+        uint64_t value;
+#if defined(__GNUC__)
+        static const void* const table[] =
+        {
+            &&op_PushVreg, &&op_PopVreg, &&op_PushConst, &&op_Read8, &&op_Read64, &&op_Add, &&op_Nand, &&op_Mul,
+            &&op_Jnz, &&op_Exit, &&op_Jump, &&op_Trap, &&op_VregAddImm, &&op_VregAdd, &&op_VregNand, &&op_NotTop,
+            &&op_AddImm,
+        };
+        static_assert(std::size(table) == Count);
+#define VM_OP(name) op_##name:
+#define VM_NEXT() goto *table[pc->code]
+        VM_NEXT();
+#else
+#define VM_OP(name) case name:
+#define VM_NEXT() continue
+        for (;;)
+        {
+            switch (pc->code)
+            {
+#endif
+        VM_OP(PushVreg)
+            *++sp = v[pc->x];
+            pc++;
+            VM_NEXT();
+        VM_OP(PopVreg)
+            v[pc->x] = *sp--;
+            pc++;
+            VM_NEXT();
+        VM_OP(PushConst)
+            *++sp = pc->imm;
+            pc++;
+            VM_NEXT();
+        VM_OP(Read8)
+            if (!read(*sp, 1, value))
+            {
+                result.address = *sp;
+                return stop(status_t::Fault);
+            }
+            *sp = value;
+            pc++;
+            VM_NEXT();
+        VM_OP(Read64)
+            if (!read(*sp, 8, value))
+            {
+                result.address = *sp;
+                return stop(status_t::Fault);
+            }
+            *sp = value;
+            pc++;
+            VM_NEXT();
+        VM_OP(Add)
+            sp[-1] = sp[0] + sp[-1];
+            sp--;
+            pc++;
+            VM_NEXT();
+        VM_OP(Nand)
+            sp[-1] = ~(sp[0] & sp[-1]);
+            sp--;
+            pc++;
+            VM_NEXT();
+        VM_OP(Mul)
+            sp[-1] = sp[0] * sp[-1];
+            sp--;
+            pc++;
+            VM_NEXT();
+        VM_OP(Jnz)
+            // Falls through when equal, the three values below only fed the dispatcher
+            //
+            value = sp[0] ^ sp[-1];
+            sp -= 5;
+            if (!value)
+            {
+                pc++;
+                VM_NEXT();
+            }
+            if (!budget--)
+                return stop(status_t::Limit);
+            pc = ops + pc->y;
+            VM_NEXT();
+        VM_OP(Exit)
+            for (size_t i = 0; i < 15; i++)
+                result.regs[i] = sp[(ptrdiff_t)i - 14];
+            return stop(status_t::Exit);
+        VM_OP(Jump)
+            if (!budget--)
+                return stop(status_t::Limit);
+            pc = ops + pc->y;
+            VM_NEXT();
+        VM_OP(Trap)
+            return stop(status_t::Trap);
+        VM_OP(VregAddImm)
+            v[pc->y] = v[pc->x] + pc->imm;
+            pc++;
+            VM_NEXT();
+        VM_OP(VregAdd)
+            v[pc->y >> 16] = v[pc->x] + v[pc->y & 0xFFFF];
+            pc++;
+            VM_NEXT();
+        VM_OP(VregNand)
+            v[pc->y >> 16] = ~(v[pc->x] & v[pc->y & 0xFFFF]);
+            pc++;
+            VM_NEXT();
+        VM_OP(NotTop)
+            v[pc->x] = *sp;
+            *sp = ~*sp;
+            pc++;
+            VM_NEXT();
+        VM_OP(AddImm)
+            *sp += pc->imm;
+            pc++;
+            VM_NEXT();
+#if !defined(__GNUC__)
+            default:
+                return stop(status_t::Trap);
+            }
+        }
+#endif
+#undef VM_OP
+#undef VM_NEXT
+    }
+}
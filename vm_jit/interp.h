@@ -0,0 +1,92 @@
+#pragma once
+#include "explorer.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace vm
+{
+    // Runs a decoded trace directly, without the original handlers. The trace is flattened
+    // once into a dense array of 16 byte ops with branch targets resolved to indices,
+    // common sequences fused into single ops, and the stack depth checked statically so
+    // no op tests for overflow. Dispatch is threaded with computed goto where the
+    // compiler has it and a switch elsewhere.
+    //
+    // Fused sequences never span a branch target:
+    //
+    //   PushVreg a, PushConst c, Add, PopVreg d    vreg[d] = vreg[a] + c
+    //   PushVreg a, PushVreg b, Add, PopVreg d     vreg[d] = vreg[a] + vreg[b]
+    //   PushVreg a, PushVreg b, Nand, PopVreg d    vreg[d] = ~(vreg[a] & vreg[b])
+    //   PopVreg t, PushVreg t, PushVreg t, Nand    vreg[t] = top, top = ~top
+    //   PushConst c, Add                           top += c
+    //
+    struct interpreter
+    {
+        using context_t = std::array<uint64_t, 15>;
+
+        enum class status_t : uint8_t
+        {
+            Exit,
+            // Reached bytecode the trace does not cover
+            //
+            Trap,
+            // Read outside the image and every mapped region
+            //
+            Fault,
+            // Ran out of branches
+            //
+            Limit,
+        };
+
+        struct result_t
+        {
+            status_t status = status_t::Trap;
+            // Registers the VM exited with, the input registers otherwise
+            //
+            context_t regs{};
+            // Instruction the run stopped at, fault address for faults
+            //
+            vip_t vip = 0;
+            uint64_t address = 0;
+        };
+
+        struct op_t
+        {
+            uint8_t code = 0;
+            uint8_t unused = 0;
+            uint16_t x = 0;
+            uint32_t y = 0;
+            uint64_t imm = 0;
+        };
+
+        struct region_t
+        {
+            uint64_t address = 0;
+            std::vector<uint8_t> bytes;
+        };
+
+        const pe::image& image;
+        std::vector<op_t> code;
+        // Vip of every op, only read when a run stops
+        //
+        std::vector<vip_t> vips;
+        std::vector<region_t> regions;
+        uint32_t entry = 0;
+        size_t max_depth = 0;
+        size_t vreg_count = 0;
+
+        explicit interpreter(const pe::image& image) : image(image) {}
+
+        bool load(const trace_t& trace);
+
+        // Memory the host program would have set up, looked up before the image
+        //
+        void map(uint64_t address, std::vector<uint8_t> bytes);
+
+        // Vregs persist between runs like the VM's own file, they are grown to the
+        // highest index the trace uses. Budget counts taken branches and jumps.
+        //
+        result_t run(const context_t& regs, std::vector<uint64_t>& vregs, uint64_t budget = 1ull << 32) const;
+    };
+}
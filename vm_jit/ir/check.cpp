@@ -0,0 +1,178 @@
+#include "passes.h"
+
+#include <cstdio>
+#include <functional>
+#include <random>
+
+namespace ir
+{
+    namespace
+    {
+        struct chain_t
+        {
+            function_t fn;
+            value_t x = none;
+            value_t y = none;
+
+            chain_t()
+            {
+                fn.blocks.emplace_back();
+                x = add(op_t::Arg, 0);
+                y = add(op_t::Arg, 1);
+            }
+
+            value_t add(op_t op, uint64_t imm = 0, value_t a = none, value_t b = none)
+            {
+                auto v = fn.add(op, imm, a, b);
+                fn.blocks.front().body.push_back(v);
+                return v;
+            }
+
+            value_t c(uint64_t imm) { return add(op_t::Const, imm); }
+            value_t op(op_t op, value_t a, value_t b = none) { return add(op, 0, a, b); }
+            value_t not_(value_t a) { return op(op_t::Nand, a, a); }
+        };
+
+        struct rule_t
+        {
+            const char* name;
+            // Native op the root has to end up as, Arg when it collapses into an operand
+            //
+            op_t expected;
+            std::function<value_t(chain_t&)> build;
+        };
+
+        uint64_t run(const function_t& fn, value_t v, uint64_t x, uint64_t y)
+        {
+            const auto& inst = fn.insts[v];
+            switch (inst.op)
+            {
+            case op_t::Arg:   return inst.imm ? y : x;
+            case op_t::Const: return inst.imm;
+            default:
+            {
+                auto a = run(fn, inst.args[0], x, y);
+                auto b = inst.args[1] != none ? run(fn, inst.args[1], x, y) : 0;
+                return evaluate(inst.op, a, b);
+            }
+            }
+        }
+    }
+
+    bool check_idioms(size_t samples)
+    {
+        using c = chain_t;
+        const rule_t rules[] =
+        {
+            { "nand(x, x)", op_t::Not, [](c& f) { return f.not_(f.x); } },
+            { "nand(x, -1)", op_t::Not, [](c& f) { return f.op(op_t::Nand, f.x, f.c(~0ull)); } },
+            { "nand(not x, not y)", op_t::Or, [](c& f) { return f.op(op_t::Nand, f.not_(f.x), f.not_(f.y)); } },
+            { "four nand xor", op_t::Xor, [](c& f)
+                {
+                    auto n = f.op(op_t::Nand, f.x, f.y);
+                    return f.op(op_t::Nand, f.op(op_t::Nand, f.x, n), f.op(op_t::Nand, f.y, n));
+                } },
+            { "not not x", op_t::Arg, [](c& f) { return f.op(op_t::Not, f.op(op_t::Not, f.x)); } },
+            { "not nand(x, y)", op_t::And, [](c& f) { return f.op(op_t::Not, f.op(op_t::Nand, f.x, f.y)); } },
+            { "not (not x + y)", op_t::Sub, [](c& f) { return f.op(op_t::Not, f.op(op_t::Add, f.not_(f.x), f.y)); } },
+            { "not (x + -1)", op_t::Neg, [](c& f) { return f.op(op_t::Not, f.op(op_t::Add, f.x, f.c(~0ull))); } },
+            { "(x | y) & nand(x, y)", op_t::Xor, [](c& f)
+                {
+                    return f.op(op_t::And, f.op(op_t::Or, f.x, f.y), f.op(op_t::Nand, f.x, f.y));
+                } },
+            { "not x & y", op_t::Andn, [](c& f) { return f.op(op_t::And, f.op(op_t::Not, f.x), f.y); } },
+            { "andn(x & y, x | y)", op_t::Xor, [](c& f)
+                {
+                    return f.op(op_t::Andn, f.op(op_t::And, f.x, f.y), f.op(op_t::Or, f.x, f.y));
+                } },
+            { "andn(y, x) | andn(x, y)", op_t::Xor, [](c& f)
+                {
+                    return f.op(op_t::Or, f.op(op_t::Andn, f.y, f.x), f.op(op_t::Andn, f.x, f.y));
+                } },
+            { "x ^ -1", op_t::Not, [](c& f) { return f.op(op_t::Xor, f.x, f.c(~0ull)); } },
+            { "not x + 1", op_t::Neg, [](c& f) { return f.op(op_t::Add, f.op(op_t::Not, f.x), f.c(1)); } },
+            { "x + -y", op_t::Sub, [](c& f) { return f.op(op_t::Add, f.x, f.op(op_t::Neg, f.y)); } },
+            { "(x + not y) + 1", op_t::Sub, [](c& f)
+                {
+                    return f.op(op_t::Add, f.op(op_t::Add, f.x, f.op(op_t::Not, f.y)), f.c(1));
+                } },
+            { "(x ^ y) + 2 * (x & y)", op_t::Add, [](c& f)
+                {
+                    return f.op(op_t::Add, f.op(op_t::Xor, f.x, f.y), f.op(op_t::Mul, f.op(op_t::And, f.x, f.y), f.c(2)));
+                } },
+            { "(x ^ y) + -2 * andn(x, y)", op_t::Sub, [](c& f)
+                {
+                    return f.op(op_t::Add, f.op(op_t::Xor, f.x, f.y), f.op(op_t::Mul, f.c((uint64_t)-2), f.op(op_t::Andn, f.x, f.y)));
+                } },
+            { "(x | y) + (x & y)", op_t::Add, [](c& f)
+                {
+                    return f.op(op_t::Add, f.op(op_t::Or, f.x, f.y), f.op(op_t::And, f.x, f.y));
+                } },
+            { "x * -1", op_t::Neg, [](c& f) { return f.op(op_t::Mul, f.x, f.c(~0ull)); } },
+            { "andn(y, x) - andn(x, y)", op_t::Sub, [](c& f)
+                {
+                    return f.op(op_t::Sub, f.op(op_t::Andn, f.y, f.x), f.op(op_t::Andn, f.x, f.y));
+                } },
+            { "(x | y) - (x & y)", op_t::Xor, [](c& f)
+                {
+                    return f.op(op_t::Sub, f.op(op_t::Or, f.x, f.y), f.op(op_t::And, f.x, f.y));
+                } },
+        };
+
+        // Fixed seed, a failure reproduces with the same inputs
+        //
+        std::mt19937_64 rng(0x1d10);
+        bool ok = true;
+        for (const auto& rule : rules)
+        {
+            chain_t chain;
+            auto root = rule.build(chain);
+            auto& block = chain.fn.blocks.front();
+            block.exit = exit_t::Return;
+            block.values = { root };
+
+            const auto original = chain.fn;
+            recover_idioms(chain.fn);
+            auto rewritten = block.values.front();
+
+            // Rewrites only reference leaves of the pattern
+            //
+            const auto& inst = chain.fn.insts[rewritten];
+            bool fired = inst.op == rule.expected;
+            for (auto a : inst.args)
+                fired &= a == none || chain.fn.insts[a].op == op_t::Arg;
+            if (!fired)
+            {
+                std::printf("idiom %s: not rewritten\n", rule.name);
+                ok = false;
+                continue;
+            }
+
+            for (size_t i = 0; i < samples; i++)
+            {
+                uint64_t x = rng(), y = rng();
+                // Edges first, then random values
+                //
+                if (i < 9)
+                {
+                    const uint64_t edges[3] = { 0, 1, ~0ull };
+                    x = edges[i % 3];
+                    y = edges[i / 3];
+                }
+
+                auto want = run(original, root, x, y);
+                auto got = run(chain.fn, rewritten, x, y);
+                if (want != got)
+                {
+                    std::printf("idiom %s: x 0x%llx y 0x%llx gives 0x%llx, expected 0x%llx\n", rule.name,
+                        (unsigned long long)x, (unsigned long long)y, (unsigned long long)got, (unsigned long long)want);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        std::printf("%zu idiom rules %s\n", std::size(rules), ok ? "ok" : "failed");
+        return ok;
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "ir.h"
+
+#include <algorithm>
+
+namespace ir
+{
+    // Replacements collected by a pass, applied in one sweep over every operand
+    //
+    struct forward_t
+    {
+        std::vector<value_t> to;
+
+        explicit forward_t(const function_t& fn) : to(fn.insts.size())
+        {
+            for (size_t i = 0; i < to.size(); i++)
+                to[i] = (value_t)i;
+        }
+
+        value_t resolve(value_t v)
+        {
+            if (v == none)
+                return v;
+            while (to[v] != v)
+                v = to[v] = to[to[v]];
+            return v;
+        }
+
+        void replace(value_t v, value_t with) { to[v] = resolve(with); }
+
+        bool apply(function_t& fn)
+        {
+            bool changed = false;
+            auto update = [&](value_t& v)
+            {
+                auto r = resolve(v);
+                changed |= r != v;
+                v = r;
+            };
+
+            for (auto& block : fn.blocks)
+            {
+                if (!block.live)
+                    continue;
+
+                changed |= std::erase_if(block.body, [&](value_t v) { return resolve(v) != v; }) != 0;
+                for (auto v : block.body)
+                {
+                    for (auto& arg : fn.insts[v].args)
+                        update(arg);
+                }
+                update(block.lhs);
+                update(block.rhs);
+                for (auto& edge : block.edges)
+                {
+                    for (auto& arg : edge.args)
+                        update(arg);
+                }
+                for (auto& v : block.values)
+                    update(v);
+            }
+            return changed;
+        }
+    };
+}
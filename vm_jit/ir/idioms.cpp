@@ -0,0 +1,313 @@
+#include "passes.h"
+#include "forward.h"
+
+namespace ir
+{
+    // Operands are matched through replacements made earlier in the same sweep. Every
+    // rewrite turns the matched root into the native op in place and only references
+    // leaves of the pattern, which dominate the root, the inner nodes are left to DCE.
+    //
+    struct idioms_t
+    {
+        function_t& fn;
+        forward_t& forward;
+
+        value_t arg(value_t v, size_t i) { return forward.resolve(fn.insts[v].args[i]); }
+
+        bool is(value_t v, op_t op) const { return v != none && fn.insts[v].op == op; }
+
+        bool is_const(value_t v, uint64_t imm) const { return is(v, op_t::Const) && fn.insts[v].imm == imm; }
+
+        // Not x, also in its Nand(x, x) form
+        //
+        bool match_not(value_t v, value_t& x)
+        {
+            if (is(v, op_t::Not) || (is(v, op_t::Nand) && arg(v, 0) == arg(v, 1)))
+            {
+                x = arg(v, 0);
+                return true;
+            }
+            return false;
+        }
+
+        bool match(value_t v, op_t op, value_t& a, value_t& b)
+        {
+            if (!is(v, op))
+                return false;
+            a = arg(v, 0);
+            b = arg(v, 1);
+            return true;
+        }
+
+        // Both binary ops over the same two operands, in any order
+        //
+        bool match_pair(value_t v, op_t op, value_t x, value_t y)
+        {
+            value_t a, b;
+            return match(v, op, a, b) && ((a == x && b == y) || (a == y && b == x));
+        }
+
+        void set(value_t v, op_t op, value_t a, value_t b = none)
+        {
+            auto& inst = fn.insts[v];
+            inst.op = op;
+            inst.imm = 0;
+            inst.args[0] = a;
+            inst.args[1] = b;
+        }
+
+        // Commutative rules are written for one operand order and tried with both
+        //
+        template<typename Rule>
+        bool both(value_t a, value_t b, Rule&& rule)
+        {
+            return rule(a, b) || rule(b, a);
+        }
+
+        bool rewrite(value_t v)
+        {
+            auto op = fn.insts[v].op;
+            if (!is_arithmetic(op))
+                return false;
+
+            auto a = arg(v, 0);
+            auto b = is_unary(op) ? none : arg(v, 1);
+            value_t x, y, p, q;
+
+            switch (op)
+            {
+            case op_t::Nand:
+                /*
+                *   nand(x, x)                                  -> not x
+                *   nand(not x, not y)                          -> x | y
+                *   nand(nand(x, nand(x, y)), nand(y, nand(x, y))) -> x ^ y
+                */
+                if (a == b)
+                {
+                    set(v, op_t::Not, a);
+                    return true;
+                }
+                if (both(a, b, [&](value_t l, value_t r) { return is_const(r, ~0ull) && (set(v, op_t::Not, l), true); }))
+                    return true;
+                if (match_not(a, x) && match_not(b, y))
+                {
+                    set(v, op_t::Or, x, y);
+                    return true;
+                }
+                if (match(a, op_t::Nand, p, q) && is(b, op_t::Nand))
+                {
+                    for (auto n : { p, q })
+                    {
+                        x = n == p ? q : p;
+                        for (auto m : { arg(b, 0), arg(b, 1) })
+                        {
+                            y = m == arg(b, 0) ? arg(b, 1) : arg(b, 0);
+                            if (n == m && match_pair(n, op_t::Nand, x, y))
+                            {
+                                set(v, op_t::Xor, x, y);
+                                return true;
+                            }
+                        }
+                    }
+                }
+                return false;
+
+            case op_t::Not:
+                /*
+                *   not not x           -> x
+                *   not nand(x, y)      -> x & y
+                *   not (not x + y)     -> x - y
+                *   not (x + -1)        -> -x
+                */
+                if (match_not(a, x))
+                {
+                    forward.replace(v, x);
+                    return false;
+                }
+                if (match(a, op_t::Nand, x, y))
+                {
+                    set(v, op_t::And, x, y);
+                    return true;
+                }
+                if (match(a, op_t::Add, p, q))
+                {
+                    return both(p, q, [&](value_t l, value_t r)
+                        {
+                            if (match_not(l, x))
+                            {
+                                set(v, op_t::Sub, x, r);
+                                return true;
+                            }
+                            if (is_const(r, ~0ull))
+                            {
+                                set(v, op_t::Neg, l);
+                                return true;
+                            }
+                            return false;
+                        });
+                }
+                return false;
+
+            case op_t::And:
+                /*
+                *   not x & y           -> andn(x, y)
+                *   (x | y) & nand(x, y) -> x ^ y
+                */
+                return both(a, b, [&](value_t l, value_t r)
+                    {
+                        if (match(l, op_t::Or, x, y) && match_pair(r, op_t::Nand, x, y))
+                        {
+                            set(v, op_t::Xor, x, y);
+                            return true;
+                        }
+                        if (match_not(l, x))
+                        {
+                            set(v, op_t::Andn, x, r);
+                            return true;
+                        }
+                        return false;
+                    });
+
+            case op_t::Andn:
+                /*
+                *   andn(x & y, x | y)  -> x ^ y
+                */
+                if (match(a, op_t::And, x, y) && match_pair(b, op_t::Or, x, y))
+                {
+                    set(v, op_t::Xor, x, y);
+                    return true;
+                }
+                return false;
+
+            case op_t::Or:
+                /*
+                *   andn(y, x) | andn(x, y) -> x ^ y
+                */
+                if (match(a, op_t::Andn, p, q) && match(b, op_t::Andn, x, y) && p == y && q == x)
+                {
+                    set(v, op_t::Xor, q, p);
+                    return true;
+                }
+                return false;
+
+            case op_t::Xor:
+                /*
+                *   x ^ -1              -> not x
+                */
+                return both(a, b, [&](value_t l, value_t r) { return is_const(r, ~0ull) && (set(v, op_t::Not, l), true); });
+
+            case op_t::Add:
+                /*
+                *   not x + 1           -> -x
+                *   x + -y              -> x - y
+                *   (x + not y) + 1     -> x - y
+                *   (x ^ y) + 2 * (x & y)     -> x + y
+                *   (x ^ y) + -2 * andn(x, y) -> x - y
+                *   (x | y) + (x & y)   -> x + y
+                */
+                return both(a, b, [&](value_t l, value_t r)
+                    {
+                        if (is_const(r, 1) && match_not(l, x))
+                        {
+                            set(v, op_t::Neg, x);
+                            return true;
+                        }
+                        if (is(r, op_t::Neg))
+                        {
+                            set(v, op_t::Sub, l, arg(r, 0));
+                            return true;
+                        }
+                        if (is_const(r, 1) && match(l, op_t::Add, p, q))
+                        {
+                            if (match_not(q, y) || (match_not(p, y) && (std::swap(p, q), true)))
+                            {
+                                set(v, op_t::Sub, p, y);
+                                return true;
+                            }
+                        }
+                        if (match(l, op_t::Xor, x, y) && match(r, op_t::Mul, p, q))
+                        {
+                            if (is(p, op_t::Const))
+                                std::swap(p, q);
+                            if (is_const(q, 2) && match_pair(p, op_t::And, x, y))
+                            {
+                                set(v, op_t::Add, x, y);
+                                return true;
+                            }
+                            if (is_const(q, (uint64_t)-2) && is(p, op_t::Andn))
+                            {
+                                // The complemented operand of the andn is the minuend:
+                                // (x ^ y) - 2 * (y - (x & y)) = x - y
+                                //
+                                auto nx = arg(p, 0);
+                                auto py = arg(p, 1);
+                                if ((nx == x && py == y) || (nx == y && py == x))
+                                {
+                                    set(v, op_t::Sub, nx, py);
+                                    return true;
+                                }
+                            }
+                        }
+                        if (match(l, op_t::Or, x, y) && match_pair(r, op_t::And, x, y))
+                        {
+                            set(v, op_t::Add, x, y);
+                            return true;
+                        }
+                        return false;
+                    });
+
+            case op_t::Mul:
+                /*
+                *   x * -1              -> -x
+                */
+                return both(a, b, [&](value_t l, value_t r) { return is_const(r, ~0ull) && (set(v, op_t::Neg, l), true); });
+
+            case op_t::Sub:
+                /*
+                *   andn(y, x) - andn(x, y) -> x - y
+                *   (x | y) - (x & y)   -> x ^ y
+                */
+                if (match(a, op_t::Andn, p, q) && match(b, op_t::Andn, x, y) && p == y && q == x)
+                {
+                    set(v, op_t::Sub, q, p);
+                    return true;
+                }
+                if (match(a, op_t::Or, x, y) && match_pair(b, op_t::And, x, y))
+                {
+                    set(v, op_t::Xor, x, y);
+                    return true;
+                }
+                return false;
+
+            default:
+                return false;
+            }
+        }
+    };
+
+    bool recover_idioms(function_t& fn)
+    {
+        bool changed = false;
+        forward_t forward(fn);
+        idioms_t idioms{ fn, forward };
+
+        for (auto& block : fn.blocks)
+        {
+            if (!block.live)
+                continue;
+
+            // Uses come after defs in a block and params are never rewritten, so
+            // operands are already in their final form when a root is visited. A
+            // root may match again once rewritten, xor over and/or for instance.
+            //
+            for (auto v : block.body)
+            {
+                for (int round = 0; round < 4 && idioms.rewrite(v); round++)
+                    changed = true;
+            }
+        }
+
+        changed |= forward.apply(fn);
+        return changed;
+    }
+}
@@ -0,0 +1,411 @@
+#include "ir.h"
+#include "../stats.h"
+
+#include <cassert>
+#include <cstdio>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace ir
+{
+    value_t function_t::add(op_t op, uint64_t imm, value_t a, value_t b)
+    {
+        inst_t inst;
+        inst.op = op;
+        inst.imm = imm;
+        inst.args[0] = a;
+        inst.args[1] = b;
+        insts.push_back(inst);
+        return (value_t)(insts.size() - 1);
+    }
+
+    size_t function_t::size() const
+    {
+        size_t out = 0;
+        for (const auto& block : blocks)
+        {
+            if (block.live)
+                out += block.body.size();
+        }
+        return out;
+    }
+
+    bool is_arithmetic(op_t op)
+    {
+        return op >= op_t::Add;
+    }
+
+    bool is_unary(op_t op)
+    {
+        return op == op_t::Not || op == op_t::Neg;
+    }
+
+    bool is_commutative(op_t op)
+    {
+        return is_arithmetic(op) && !is_unary(op) && op != op_t::Andn && op != op_t::Sub;
+    }
+
+    uint64_t evaluate(op_t op, uint64_t a, uint64_t b)
+    {
+        switch (op)
+        {
+        case op_t::Add:  return a + b;
+        case op_t::Nand: return ~(a & b);
+        case op_t::Mul:  return a * b;
+        case op_t::Not:  return ~a;
+        case op_t::And:  return a & b;
+        case op_t::Or:   return a | b;
+        case op_t::Xor:  return a ^ b;
+        case op_t::Andn: return ~a & b;
+        case op_t::Sub:  return a - b;
+        case op_t::Neg:  return 0 - a;
+        default:         return 0;
+        }
+    }
+
+    static const char* op_name(op_t op)
+    {
+        switch (op)
+        {
+        case op_t::Arg:       return "arg";
+        case op_t::Param:     return "param";
+        case op_t::Const:     return "const";
+        case op_t::LoadVreg:  return "load_vreg";
+        case op_t::StoreVreg: return "store_vreg";
+        case op_t::Read8:     return "read8";
+        case op_t::Read64:    return "read64";
+        case op_t::Add:       return "add";
+        case op_t::Nand:      return "nand";
+        case op_t::Mul:       return "mul";
+        case op_t::Not:       return "not";
+        case op_t::And:       return "and";
+        case op_t::Or:        return "or";
+        case op_t::Xor:       return "xor";
+        case op_t::Andn:      return "andn";
+        case op_t::Sub:       return "sub";
+        case op_t::Neg:       return "neg";
+        default:              return "?";
+        }
+    }
+
+    void function_t::dump() const
+    {
+        auto print_edge = [&](const char* name, const edge_t& edge)
+        {
+            if (edge.block == none)
+            {
+                std::printf("  %s unreached\n", name);
+                return;
+            }
+            std::printf("  %s bb%u(", name, edge.block);
+            for (size_t i = 0; i < edge.args.size(); i++)
+                std::printf(i ? ", %%%u" : "%%%u", edge.args[i]);
+            std::printf(")\n");
+        };
+
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            const auto& block = blocks[b];
+            if (!block.live)
+                continue;
+
+            std::printf("bb%zu 0x%llx(", b, (unsigned long long)block.vip);
+            for (size_t i = 0; i < block.params.size(); i++)
+                std::printf(i ? ", %%%u" : "%%%u", block.params[i]);
+            std::printf(")\n");
+
+            for (auto v : block.body)
+            {
+                const auto& inst = insts[v];
+                std::printf("  %%%u = %s", v, op_name(inst.op));
+                if (inst.op == op_t::Arg || inst.op == op_t::Const || inst.op == op_t::LoadVreg || inst.op == op_t::StoreVreg)
+                    std::printf(" 0x%llx", (unsigned long long)inst.imm);
+                for (auto arg : inst.args)
+                {
+                    if (arg != none)
+                        std::printf(" %%%u", arg);
+                }
+                std::printf("\n");
+            }
+
+            switch (block.exit)
+            {
+            case exit_t::Jump:
+                print_edge("jmp", block.edges[0]);
+                break;
+            case exit_t::Branch:
+                std::printf("  cmp %%%u, %%%u\n", block.lhs, block.rhs);
+                print_edge("jz", block.edges[0]);
+                print_edge("jnz", block.edges[1]);
+                break;
+            case exit_t::Return:
+                std::printf("  ret");
+                for (auto v : block.values)
+                    std::printf(" %%%u", v);
+                std::printf("\n");
+                break;
+            case exit_t::Trap:
+                std::printf("  trap\n");
+                break;
+            }
+        }
+    }
+
+    std::optional<function_t> build(const vm::trace_t& trace)
+    {
+        stats::scope_t scope(stats::phase_t::IrBuild);
+        function_t fn;
+
+        // Every branch target, join target and Jnz fall-through starts a block. Targets
+        // that are in no block never get one and edges to them trap, whatever the
+        // explorer left pointing there.
+        //
+        std::unordered_set<vm::vip_t> leaders;
+        std::unordered_set<vm::vip_t> lifted;
+        for (const auto& block : trace.blocks)
+        {
+            for (const auto& instr : block.instructions)
+                lifted.insert(instr.vip);
+        }
+        for (const auto& block : trace.blocks)
+        {
+            if (block.instructions.empty())
+                continue;
+
+            leaders.insert(block.instructions.front().vip);
+            if (lifted.contains(block.next))
+                leaders.insert(block.next);
+
+            for (size_t i = 0; i < block.instructions.size(); i++)
+            {
+                const auto& instr = block.instructions[i];
+                if (instr.op == vm::opcodes::Jnz)
+                {
+                    leaders.insert(instr.operand);
+                    if (i + 1 < block.instructions.size())
+                        leaders.insert(block.instructions[i + 1].vip);
+                }
+            }
+        }
+
+        // First pass assigns block ids and stack depths. Taken blocks follow their
+        // branch in trace order, so the depth of every block start is known by the
+        // time it is reached. Every path into a block has to agree on its depth,
+        // anything else is a misclassified handler and the trace is rejected.
+        //
+        std::unordered_map<vm::vip_t, uint32_t> ids;
+        std::unordered_map<vm::vip_t, size_t> depths;
+        std::vector<std::pair<vm::vip_t, size_t>> joins;
+        fn.blocks.emplace_back();
+
+        auto enter = [&](vm::vip_t vip, int64_t depth)
+        {
+            auto [slot, inserted] = depths.emplace(vip, (size_t)depth);
+            if (inserted || slot->second == (size_t)depth)
+                return true;
+            std::printf("Stack depth at %llx is %llu on one path and %lld on another\n",
+                (unsigned long long)vip, (unsigned long long)slot->second, (long long)depth);
+            return false;
+        };
+
+        if (!trace.blocks.empty() && !trace.blocks.front().instructions.empty())
+            depths.emplace(trace.blocks.front().instructions.front().vip, 15);
+        for (const auto& block : trace.blocks)
+        {
+            if (block.instructions.empty())
+                continue;
+
+            auto it = depths.find(block.instructions.front().vip);
+            if (it == depths.end())
+            {
+                std::printf("Block at %llx is reached before its stack depth is known\n",
+                    (unsigned long long)block.instructions.front().vip);
+                return std::nullopt;
+            }
+            auto depth = (int64_t)it->second;
+
+            for (const auto& instr : block.instructions)
+            {
+                if (leaders.contains(instr.vip))
+                {
+                    ids.emplace(instr.vip, (uint32_t)fn.blocks.size());
+                    fn.blocks.emplace_back().vip = instr.vip;
+                    if (!enter(instr.vip, depth))
+                        return std::nullopt;
+                }
+
+                depth += vm::stack_delta(instr.op);
+                if (depth < 0)
+                {
+                    std::printf("Stack underflow at %llx\n", (unsigned long long)instr.vip);
+                    return std::nullopt;
+                }
+
+                if (instr.op == vm::opcodes::Jnz && lifted.contains(instr.operand) && !enter(instr.operand, depth))
+                    return std::nullopt;
+            }
+
+            if (block.next != ~0ull && lifted.contains(block.next))
+                joins.emplace_back(block.next, (size_t)depth);
+        }
+
+        // Joins go to code lifted earlier, their target depth is known by now
+        //
+        for (const auto& [vip, depth] : joins)
+        {
+            if (!enter(vip, (int64_t)depth))
+                return std::nullopt;
+        }
+
+        auto target = [&](vm::vip_t vip)
+        {
+            auto it = ids.find(vip);
+            return it != ids.end() ? it->second : none;
+        };
+
+        // Block params stand for the whole incoming stack, passes drop the unused ones
+        //
+        for (auto& block : fn.blocks)
+        {
+            if (&block == &fn.blocks.front())
+                continue;
+            for (size_t i = 0; i < depths.at(block.vip); i++)
+                block.params.push_back(fn.add(op_t::Param, i));
+        }
+
+        // Entry pushes every physical register, rax first
+        //
+        {
+            auto& entry = fn.blocks.front();
+            std::vector<value_t> stack;
+            for (size_t i = 0; i < 15; i++)
+                stack.push_back(fn.add(op_t::Arg, i));
+            entry.body = stack;
+            entry.exit = exit_t::Jump;
+            entry.edges[0] = { fn.blocks.size() > 1 ? 1u : none, stack };
+        }
+
+        std::vector<value_t> stack;
+        auto pop = [&]()
+        {
+            assert(!stack.empty());
+            auto v = stack.back();
+            stack.pop_back();
+            return v;
+        };
+
+        for (const auto& trace_block : trace.blocks)
+        {
+            block_t* current = nullptr;
+            for (const auto& instr : trace_block.instructions)
+            {
+                if (auto id = target(instr.vip); id != none)
+                {
+                    // Fall into the next block with whatever is on the stack
+                    //
+                    if (current && current->exit == exit_t::Trap && current->edges[0].block == none)
+                    {
+                        current->exit = exit_t::Jump;
+                        current->edges[0] = { id, stack };
+                    }
+                    current = &fn.blocks[id];
+                    stack = current->params;
+                }
+                assert(current);
+                auto& body = current->body;
+
+                switch (instr.op)
+                {
+                case vm::opcodes::PopVreg:
+                    body.push_back(fn.add(op_t::StoreVreg, instr.operand, pop()));
+                    break;
+                case vm::opcodes::PushVreg:
+                    stack.push_back(fn.add(op_t::LoadVreg, instr.operand));
+                    body.push_back(stack.back());
+                    break;
+                case vm::opcodes::PushConst:
+                    stack.push_back(fn.add(op_t::Const, instr.operand));
+                    body.push_back(stack.back());
+                    break;
+                case vm::opcodes::Read8:
+                case vm::opcodes::Read64:
+                    stack.push_back(fn.add(instr.op == vm::opcodes::Read8 ? op_t::Read8 : op_t::Read64, 0, pop()));
+                    body.push_back(stack.back());
+                    break;
+                case vm::opcodes::Add:
+                case vm::opcodes::Nand:
+                case vm::opcodes::Mul:
+                {
+                    auto a = pop();
+                    auto b = pop();
+                    auto op = instr.op == vm::opcodes::Add ? op_t::Add : instr.op == vm::opcodes::Nand ? op_t::Nand : op_t::Mul;
+                    stack.push_back(fn.add(op, 0, a, b));
+                    body.push_back(stack.back());
+                    break;
+                }
+                case vm::opcodes::Jnz:
+                {
+                    current->lhs = pop();
+                    current->rhs = pop();
+                    // Branch rkey, bytecode and ror key only drive the dispatcher
+                    //
+                    pop();
+                    pop();
+                    pop();
+                    current->exit = exit_t::Branch;
+                    current->edges[1] = { target(instr.operand), stack };
+                    // Fall-through is the next instruction of this trace block or its join
+                    //
+                    current->edges[0] = { none, stack };
+                    break;
+                }
+                case vm::opcodes::Exit:
+                    current->exit = exit_t::Return;
+                    current->values.resize(15);
+                    for (int i = 14; i >= 0; i--)
+                        current->values[i] = pop();
+                    break;
+                default:
+                    break;
+                }
+
+                // Fall-through leader of a Jnz is resolved when its instruction is reached
+                //
+                if (instr.op == vm::opcodes::Jnz)
+                {
+                    auto* branch = current;
+                    current = nullptr;
+                    if (&instr != &trace_block.instructions.back())
+                        branch->edges[0].block = target((&instr + 1)->vip);
+                    else if (trace_block.next != ~0ull)
+                        branch->edges[0].block = target(trace_block.next);
+                }
+            }
+
+            if (current && current->exit == exit_t::Trap && trace_block.next != ~0ull)
+            {
+                current->exit = exit_t::Jump;
+                current->edges[0] = { target(trace_block.next), stack };
+            }
+        }
+        return fn;
+    }
+
+    std::vector<bool> loop_headers(const function_t& fn)
+    {
+        std::vector<bool> headers(fn.blocks.size());
+        for (size_t b = 0; b < fn.blocks.size(); b++)
+        {
+            const auto& block = fn.blocks[b];
+            if (!block.live)
+                continue;
+
+            for (const auto& edge : block.edges)
+            {
+                if (edge.block != none && edge.block <= b)
+                    headers[edge.block] = true;
+            }
+        }
+        return headers;
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+#include "../explorer.h"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace ir
+{
+    // Values are indices into function_t::insts, the VM stack is gone once a trace is
+    // built: pushes and pops become def-use edges and slots that are live across a block
+    // boundary become block parameters.
+    //
+    using value_t = uint32_t;
+    static constexpr uint32_t none = ~0u;
+
+    enum class op_t : uint8_t
+    {
+        // Physical register imm (rax = 0 ... r15 = 14) on VM entry, only in the entry block
+        //
+        Arg,
+        // Incoming stack slot of a block, one per value passed along every edge into it.
+        // Vregs promoted by promote_vregs come after the stack, imm is the vreg index.
+        //
+        Param,
+        Const,
+        LoadVreg,
+        // No result, imm is the vreg index and args[0] the stored value
+        //
+        StoreVreg,
+        Read8,
+        Read64,
+        Add,
+        Nand,
+        Mul,
+
+        // Native operations recovered from Nand/Add chains, Andn is ~args[0] & args[1]
+        //
+        Not,
+        And,
+        Or,
+        Xor,
+        Andn,
+        Sub,
+        Neg,
+    };
+
+    // Pure arithmetic, the ops constant folding and CSE may look through
+    //
+    bool is_arithmetic(op_t op);
+    bool is_unary(op_t op);
+    bool is_commutative(op_t op);
+    uint64_t evaluate(op_t op, uint64_t a, uint64_t b = 0);
+
+    struct inst_t
+    {
+        op_t op = op_t::Const;
+        uint64_t imm = 0;
+        value_t args[2] = { none, none };
+    };
+
+    // Stack values handed to the target's params, target is none for paths the
+    // trace never reached
+    //
+    struct edge_t
+    {
+        uint32_t block = none;
+        std::vector<value_t> args;
+    };
+
+    enum class exit_t : uint8_t
+    {
+        // edges[0]
+        //
+        Jump,
+        // Falls through to edges[0] if lhs == rhs, takes edges[1] otherwise
+        //
+        Branch,
+        // VM exit, values are the physical registers by index
+        //
+        Return,
+        // Path ended on a handler that could not be decoded
+        //
+        Trap,
+    };
+
+    struct block_t
+    {
+        vm::vip_t vip = 0;
+        std::vector<value_t> params;
+        std::vector<value_t> body;
+
+        exit_t exit = exit_t::Trap;
+        value_t lhs = none;
+        value_t rhs = none;
+        edge_t edges[2];
+        std::vector<value_t> values;
+
+        // Cleared by passes that prove the block unreachable, backends skip it
+        //
+        bool live = true;
+    };
+
+    // Block 0 is a synthetic entry holding the Arg values, it jumps to the first
+    // bytecode block with the 15 registers the VM entry pushed.
+    //
+    struct function_t
+    {
+        std::vector<inst_t> insts;
+        std::vector<block_t> blocks;
+
+        value_t add(op_t op, uint64_t imm = 0, value_t a = none, value_t b = none);
+
+        // Number of values every live instruction in the function defines or stores
+        //
+        size_t size() const;
+
+        void dump() const;
+    };
+
+    // Blocks are split at every join and branch target, the trace must come from a
+    // single explorer run so every vip is lifted exactly once. Fails on traces whose
+    // paths disagree on the stack depth, which only misclassified handlers produce.
+    //
+    std::optional<function_t> build(const vm::trace_t& trace);
+
+    // Blocks some live block at or after them jumps back to, backends emit blocks in
+    // index order so these are exactly the targets of backward jumps
+    //
+    std::vector<bool> loop_headers(const function_t& fn);
+}
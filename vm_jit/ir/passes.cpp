@@ -0,0 +1,680 @@
+#include "passes.h"
+#include "forward.h"
+#include "../hash.h"
+#include "../stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <unordered_map>
+
+namespace ir
+{
+    // Successor edges a block actually leaves through
+    //
+    static size_t edge_count(const block_t& block)
+    {
+        switch (block.exit)
+        {
+        case exit_t::Jump:   return 1;
+        case exit_t::Branch: return 2;
+        default:             return 0;
+        }
+    }
+
+    static bool is_const(const function_t& fn, value_t v)
+    {
+        return fn.insts[v].op == op_t::Const;
+    }
+
+    bool fold_constants(function_t& fn)
+    {
+        bool changed = false;
+        forward_t forward(fn);
+
+        for (auto& block : fn.blocks)
+        {
+            if (!block.live)
+                continue;
+
+            for (auto v : block.body)
+            {
+                auto& inst = fn.insts[v];
+                if (!is_arithmetic(inst.op))
+                    continue;
+
+                auto a = forward.resolve(inst.args[0]);
+                auto b = forward.resolve(inst.args[1]);
+                auto to_const = [&](uint64_t imm)
+                {
+                    inst.op = op_t::Const;
+                    inst.imm = imm;
+                    inst.args[0] = inst.args[1] = none;
+                    changed = true;
+                };
+
+                if (is_unary(inst.op))
+                {
+                    inst.args[0] = a;
+                    if (is_const(fn, a))
+                        to_const(evaluate(inst.op, fn.insts[a].imm));
+                    continue;
+                }
+
+                // Constant goes right, identities only need to look at one side
+                //
+                if (is_commutative(inst.op) && is_const(fn, a) && !is_const(fn, b))
+                    std::swap(a, b);
+                inst.args[0] = a;
+                inst.args[1] = b;
+
+                if (is_const(fn, a) && is_const(fn, b))
+                {
+                    to_const(evaluate(inst.op, fn.insts[a].imm, fn.insts[b].imm));
+                    continue;
+                }
+
+                if (a == b)
+                {
+                    switch (inst.op)
+                    {
+                    case op_t::And:
+                    case op_t::Or:   forward.replace(v, a); changed = true; break;
+                    case op_t::Xor:
+                    case op_t::Andn:
+                    case op_t::Sub:  to_const(0); break;
+                    default: break;
+                    }
+                    continue;
+                }
+
+                if (!is_const(fn, b))
+                    continue;
+
+                auto y = fn.insts[b].imm;
+                switch (inst.op)
+                {
+                case op_t::Add:
+                case op_t::Or:
+                case op_t::Xor:
+                case op_t::Sub:
+                    if (y == 0)
+                    {
+                        forward.replace(v, a);
+                        changed = true;
+                    }
+                    break;
+                case op_t::Mul:
+                    if (y == 1)
+                    {
+                        forward.replace(v, a);
+                        changed = true;
+                    }
+                    else if (y == 0)
+                    {
+                        to_const(0);
+                    }
+                    break;
+                case op_t::And:
+                    if (y == ~0ull)
+                    {
+                        forward.replace(v, a);
+                        changed = true;
+                    }
+                    else if (y == 0)
+                    {
+                        to_const(0);
+                    }
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            if (block.exit != exit_t::Branch)
+                continue;
+
+            // Both sides known, the branch always goes one way
+            //
+            auto lhs = forward.resolve(block.lhs);
+            auto rhs = forward.resolve(block.rhs);
+            bool equal = lhs == rhs;
+            bool known = equal || (is_const(fn, lhs) && is_const(fn, rhs));
+            if (!known)
+                continue;
+
+            equal |= is_const(fn, lhs) && is_const(fn, rhs) && fn.insts[lhs].imm == fn.insts[rhs].imm;
+            auto edge = std::move(block.edges[equal ? 0 : 1]);
+            block.edges[0] = std::move(edge);
+            block.edges[1] = {};
+            block.exit = block.edges[0].block != none ? exit_t::Jump : exit_t::Trap;
+            block.lhs = block.rhs = none;
+            changed = true;
+        }
+
+        changed |= forward.apply(fn);
+        return changed;
+    }
+
+    bool propagate_copies(function_t& fn)
+    {
+        bool changed = false;
+        forward_t forward(fn);
+
+        // Vreg contents are only tracked within a block, params carry them across
+        //
+        for (auto& block : fn.blocks)
+        {
+            if (!block.live)
+                continue;
+
+            std::unordered_map<uint64_t, value_t> known;
+            for (auto v : block.body)
+            {
+                auto& inst = fn.insts[v];
+                if (inst.op == op_t::StoreVreg)
+                {
+                    known[inst.imm] = forward.resolve(inst.args[0]);
+                }
+                else if (inst.op == op_t::LoadVreg)
+                {
+                    if (auto it = known.find(inst.imm); it != known.end())
+                    {
+                        forward.replace(v, it->second);
+                        changed = true;
+                    }
+                    else
+                    {
+                        known.emplace(inst.imm, v);
+                    }
+                }
+            }
+        }
+
+        // A param that gets the same value on every edge, or itself around a loop, is that value
+        //
+        for (bool again = true; again;)
+        {
+            again = false;
+            std::vector<std::vector<edge_t*>> incoming(fn.blocks.size());
+            for (auto& block : fn.blocks)
+            {
+                if (!block.live)
+                    continue;
+                for (size_t e = 0; e < edge_count(block); e++)
+                {
+                    if (block.edges[e].block != none)
+                        incoming[block.edges[e].block].push_back(&block.edges[e]);
+                }
+            }
+
+            for (size_t b = 0; b < fn.blocks.size(); b++)
+            {
+                auto& block = fn.blocks[b];
+                if (!block.live || incoming[b].empty())
+                    continue;
+
+                for (size_t i = 0; i < block.params.size();)
+                {
+                    auto param = block.params[i];
+                    auto same = none;
+                    bool trivial = true;
+                    for (auto* edge : incoming[b])
+                    {
+                        auto arg = forward.resolve(edge->args[i]);
+                        if (arg == param || arg == same)
+                            continue;
+                        if (same != none)
+                        {
+                            trivial = false;
+                            break;
+                        }
+                        same = arg;
+                    }
+
+                    if (!trivial || same == none)
+                    {
+                        i++;
+                        continue;
+                    }
+
+                    forward.replace(param, same);
+                    block.params.erase(block.params.begin() + i);
+                    for (auto* edge : incoming[b])
+                        edge->args.erase(edge->args.begin() + i);
+                    again = changed = true;
+                }
+            }
+        }
+
+        changed |= forward.apply(fn);
+        return changed;
+    }
+
+    // Vregs as bits, indices past 63 never come out of a real trace and are left alone
+    //
+    static uint64_t vreg_bit(uint64_t idx)
+    {
+        return idx < 64 ? 1ull << idx : 0ull;
+    }
+
+    // Vregs each block reads before writing them and vregs it writes
+    //
+    static void vreg_usage(const function_t& fn, std::vector<uint64_t>& gen, std::vector<uint64_t>& kill)
+    {
+        gen.assign(fn.blocks.size(), 0);
+        kill.assign(fn.blocks.size(), 0);
+        for (size_t b = 0; b < fn.blocks.size(); b++)
+        {
+            const auto& block = fn.blocks[b];
+            if (!block.live)
+                continue;
+            for (auto v : block.body)
+            {
+                const auto& inst = fn.insts[v];
+                if (inst.op == op_t::LoadVreg && !(kill[b] & vreg_bit(inst.imm)))
+                    gen[b] |= vreg_bit(inst.imm);
+                else if (inst.op == op_t::StoreVreg)
+                    kill[b] |= vreg_bit(inst.imm);
+            }
+        }
+    }
+
+    bool promote_vregs(function_t& fn)
+    {
+        std::vector<uint64_t> gen, kill;
+        vreg_usage(fn, gen, kill);
+
+        // Only loads need a value, traps and untraced edges read nothing here. Their
+        // stores are kept by eliminate_dead_stores.
+        //
+        std::vector<uint64_t> live_in(fn.blocks.size());
+        for (bool again = true; again;)
+        {
+            again = false;
+            for (size_t b = fn.blocks.size(); b-- > 0;)
+            {
+                const auto& block = fn.blocks[b];
+                if (!block.live)
+                    continue;
+                uint64_t out = 0;
+                for (size_t e = 0; e < edge_count(block); e++)
+                {
+                    if (block.edges[e].block != none)
+                        out |= live_in[block.edges[e].block];
+                }
+                auto in = gen[b] | (out & ~kill[b]);
+                if (in != live_in[b])
+                {
+                    live_in[b] = in;
+                    again = true;
+                }
+            }
+        }
+
+        // One param per vreg live into a block, in vreg order so edges can append theirs
+        // the same way
+        //
+        bool changed = false;
+        std::vector<std::vector<value_t>> incoming(fn.blocks.size(), std::vector<value_t>(64, none));
+        for (size_t b = 1; b < fn.blocks.size(); b++)
+        {
+            auto& block = fn.blocks[b];
+            if (!block.live)
+                continue;
+            for (uint64_t k = 0; k < 64; k++)
+            {
+                if (!(live_in[b] & vreg_bit(k)))
+                    continue;
+                incoming[b][k] = fn.add(op_t::Param, k);
+                block.params.push_back(incoming[b][k]);
+                changed = true;
+            }
+        }
+
+        // The entry has no params, it loads whatever the VM context holds
+        //
+        {
+            auto& entry = fn.blocks.front();
+            uint64_t needed = 0;
+            for (size_t e = 0; e < edge_count(entry); e++)
+            {
+                if (entry.edges[e].block != none)
+                    needed |= live_in[entry.edges[e].block];
+            }
+            needed &= ~(gen[0] | kill[0]);
+            for (uint64_t k = 0; k < 64; k++)
+            {
+                if (needed & vreg_bit(k))
+                    entry.body.push_back(fn.add(op_t::LoadVreg, k));
+            }
+        }
+
+        forward_t forward(fn);
+        for (size_t b = 0; b < fn.blocks.size(); b++)
+        {
+            auto& block = fn.blocks[b];
+            if (!block.live)
+                continue;
+
+            auto current = incoming[b];
+            for (auto v : block.body)
+            {
+                const auto& inst = fn.insts[v];
+                if (inst.op == op_t::StoreVreg && inst.imm < 64)
+                {
+                    current[inst.imm] = forward.resolve(inst.args[0]);
+                }
+                else if (inst.op == op_t::LoadVreg && inst.imm < 64)
+                {
+                    // Only the entry reads a vreg nothing defined yet
+                    //
+                    if (current[inst.imm] == none)
+                    {
+                        current[inst.imm] = v;
+                        continue;
+                    }
+                    forward.replace(v, current[inst.imm]);
+                    changed = true;
+                }
+            }
+
+            for (size_t e = 0; e < edge_count(block); e++)
+            {
+                auto& edge = block.edges[e];
+                if (edge.block == none)
+                    continue;
+                for (uint64_t k = 0; k < 64; k++)
+                {
+                    if (!(live_in[edge.block] & vreg_bit(k)))
+                        continue;
+                    assert(current[k] != none);
+                    edge.args.push_back(current[k]);
+                }
+            }
+        }
+
+        changed |= forward.apply(fn);
+        return changed;
+    }
+
+    bool eliminate_dead_stores(function_t& fn)
+    {
+        constexpr uint64_t all = ~0ull;
+
+        std::vector<uint64_t> gen, kill;
+        vreg_usage(fn, gen, kill);
+
+        // Nothing is read after the VM exits, paths that were never traced may read anything
+        //
+        auto live_out = [&](const std::vector<uint64_t>& live_in, const block_t& block)
+        {
+            if (block.exit == exit_t::Trap)
+                return all;
+
+            uint64_t out = 0;
+            for (size_t e = 0; e < edge_count(block); e++)
+                out |= block.edges[e].block != none ? live_in[block.edges[e].block] : all;
+            return out;
+        };
+
+        std::vector<uint64_t> live_in(fn.blocks.size());
+        for (bool again = true; again;)
+        {
+            again = false;
+            for (size_t b = fn.blocks.size(); b-- > 0;)
+            {
+                const auto& block = fn.blocks[b];
+                if (!block.live)
+                    continue;
+                auto in = gen[b] | (live_out(live_in, block) & ~kill[b]);
+                if (in != live_in[b])
+                {
+                    live_in[b] = in;
+                    again = true;
+                }
+            }
+        }
+
+        bool changed = false;
+        for (auto& block : fn.blocks)
+        {
+            if (!block.live)
+                continue;
+
+            auto live = live_out(live_in, block);
+            std::vector<value_t> dead;
+            for (size_t i = block.body.size(); i-- > 0;)
+            {
+                const auto& inst = fn.insts[block.body[i]];
+                if (inst.op == op_t::LoadVreg)
+                {
+                    live |= vreg_bit(inst.imm);
+                }
+                else if (inst.op == op_t::StoreVreg && inst.imm < 64)
+                {
+                    if (!(live & vreg_bit(inst.imm)))
+                        dead.push_back(block.body[i]);
+                    live &= ~vreg_bit(inst.imm);
+                }
+            }
+
+            if (!dead.empty())
+            {
+                std::erase_if(block.body, [&](value_t v) { return std::find(dead.begin(), dead.end(), v) != dead.end(); });
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    struct cse_key_t
+    {
+        op_t op;
+        uint64_t imm;
+        value_t a;
+        value_t b;
+
+        bool operator==(const cse_key_t&) const = default;
+    };
+
+    struct cse_hash_t
+    {
+        size_t operator()(const cse_key_t& k) const
+        {
+            auto h = hash::combine((uint64_t)k.op, k.imm);
+            h = hash::combine(h, ((uint64_t)k.a << 32) | k.b);
+            return (size_t)h;
+        }
+    };
+
+    bool eliminate_common_subexpressions(function_t& fn)
+    {
+        bool changed = false;
+        forward_t forward(fn);
+
+        for (auto& block : fn.blocks)
+        {
+            if (!block.live)
+                continue;
+
+            std::unordered_map<cse_key_t, value_t, cse_hash_t> seen;
+            for (auto v : block.body)
+            {
+                const auto& inst = fn.insts[v];
+                if (!is_arithmetic(inst.op) && inst.op != op_t::Const && inst.op != op_t::Read8 && inst.op != op_t::Read64)
+                    continue;
+
+                cse_key_t key{ inst.op, inst.imm, forward.resolve(inst.args[0]), forward.resolve(inst.args[1]) };
+                if (is_commutative(inst.op) && key.a > key.b)
+                    std::swap(key.a, key.b);
+
+                auto [it, inserted] = seen.emplace(key, v);
+                if (!inserted)
+                {
+                    forward.replace(v, it->second);
+                    changed = true;
+                }
+            }
+        }
+
+        changed |= forward.apply(fn);
+        return changed;
+    }
+
+    bool eliminate_dead_code(function_t& fn)
+    {
+        bool changed = false;
+
+        // Reachability from the entry
+        //
+        std::vector<bool> reached(fn.blocks.size());
+        std::vector<uint32_t> work{ 0 };
+        reached[0] = true;
+        while (!work.empty())
+        {
+            auto b = work.back();
+            work.pop_back();
+            const auto& block = fn.blocks[b];
+            for (size_t e = 0; e < edge_count(block); e++)
+            {
+                auto next = block.edges[e].block;
+                if (next != none && !reached[next])
+                {
+                    reached[next] = true;
+                    work.push_back(next);
+                }
+            }
+        }
+        for (size_t b = 0; b < fn.blocks.size(); b++)
+        {
+            if (fn.blocks[b].live && !reached[b])
+            {
+                fn.blocks[b].live = false;
+                changed = true;
+            }
+        }
+
+        // Where every param sits and which edges feed it
+        //
+        std::vector<std::pair<uint32_t, uint32_t>> slots(fn.insts.size(), { none, none });
+        std::vector<std::vector<edge_t*>> incoming(fn.blocks.size());
+        for (uint32_t b = 0; b < fn.blocks.size(); b++)
+        {
+            auto& block = fn.blocks[b];
+            if (!block.live)
+                continue;
+            for (uint32_t i = 0; i < block.params.size(); i++)
+                slots[block.params[i]] = { b, i };
+            for (size_t e = 0; e < edge_count(block); e++)
+            {
+                if (block.edges[e].block != none)
+                    incoming[block.edges[e].block].push_back(&block.edges[e]);
+            }
+        }
+
+        // Mark from side effects and exits, params pull in what every edge passes them
+        //
+        std::vector<bool> used(fn.insts.size());
+        std::vector<value_t> pending;
+        auto use = [&](value_t v)
+        {
+            if (v != none && !used[v])
+            {
+                used[v] = true;
+                pending.push_back(v);
+            }
+        };
+
+        for (const auto& block : fn.blocks)
+        {
+            if (!block.live)
+                continue;
+            for (auto v : block.body)
+            {
+                if (fn.insts[v].op == op_t::StoreVreg)
+                    use(v);
+            }
+            if (block.exit == exit_t::Branch)
+            {
+                use(block.lhs);
+                use(block.rhs);
+            }
+            if (block.exit == exit_t::Return)
+            {
+                for (auto v : block.values)
+                    use(v);
+            }
+        }
+
+        while (!pending.empty())
+        {
+            auto v = pending.back();
+            pending.pop_back();
+            for (auto arg : fn.insts[v].args)
+                use(arg);
+
+            if (auto [b, i] = slots[v]; b != none)
+            {
+                for (auto* edge : incoming[b])
+                    use(edge->args[i]);
+            }
+        }
+
+        for (uint32_t b = 0; b < fn.blocks.size(); b++)
+        {
+            auto& block = fn.blocks[b];
+            if (!block.live)
+                continue;
+
+            auto size = block.body.size();
+            std::erase_if(block.body, [&](value_t v) { return !used[v]; });
+            changed |= size != block.body.size();
+
+            for (size_t i = block.params.size(); i-- > 0;)
+            {
+                if (used[block.params[i]])
+                    continue;
+                block.params.erase(block.params.begin() + i);
+                for (auto* edge : incoming[b])
+                    edge->args.erase(edge->args.begin() + i);
+                changed = true;
+            }
+        }
+
+        // Edges out of a block that is never taken keep stale args, they are never lowered
+        //
+        for (auto& block : fn.blocks)
+        {
+            for (size_t e = edge_count(block); e < 2; e++)
+                block.edges[e] = {};
+        }
+        return changed;
+    }
+
+    void optimize(function_t& fn)
+    {
+        stats::scope_t scope(stats::phase_t::IrOptimize);
+        stats::count(stats::counter_t::IrValues, fn.size());
+
+        // Once up front, later passes never add a vreg load outside the entry
+        //
+        promote_vregs(fn);
+
+        // Every pass is cheap and linear, a handful of rounds reach the fixed point
+        //
+        for (int round = 0; round < 16; round++)
+        {
+            bool changed = false;
+            changed |= fold_constants(fn);
+            changed |= propagate_copies(fn);
+            changed |= recover_idioms(fn);
+            changed |= eliminate_common_subexpressions(fn);
+            changed |= eliminate_dead_stores(fn);
+            changed |= eliminate_dead_code(fn);
+            if (!changed)
+                break;
+        }
+
+        stats::count(stats::counter_t::IrOptimized, fn.size());
+    }
+}
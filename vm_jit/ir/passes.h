@@ -0,0 +1,51 @@
+#pragma once
+#include "ir.h"
+
+namespace ir
+{
+    // Every pass returns whether it changed anything
+    //
+
+    // Arithmetic over constants, algebraic identities and Branch on values known equal
+    //
+    bool fold_constants(function_t& fn);
+
+    // Native not/and/or/xor/andn/sub/neg out of the Nand and Add chains the VM builds
+    // them from, mixed boolean-arithmetic forms of add and sub included
+    //
+    bool recover_idioms(function_t& fn);
+
+    // Loads of a vreg stored or loaded earlier in the same block and block params that
+    // receive the same value on every edge
+    //
+    bool propagate_copies(function_t& fn);
+
+    // Vregs become SSA values: every vreg live into a block is a block param and loads
+    // read whatever the last store or param holds. Only the entry still loads vregs,
+    // stores stay for eliminate_dead_stores to clean up.
+    //
+    bool promote_vregs(function_t& fn);
+
+    // Vreg stores no path reads before the next store or the VM exit
+    //
+    bool eliminate_dead_stores(function_t& fn);
+
+    // Identical pure instructions within a block. Reads count as pure, the VM has no
+    // way to write memory.
+    //
+    bool eliminate_common_subexpressions(function_t& fn);
+
+    // Unreachable blocks, unused values and block params nothing reads
+    //
+    bool eliminate_dead_code(function_t& fn);
+
+    // All of the above until nothing changes
+    //
+    void optimize(function_t& fn);
+
+    // Builds every chain recover_idioms rewrites, runs the pass and compares the native
+    // op it produced against the original chain on random inputs. Prints each rule
+    // that did not fire or computes something else.
+    //
+    bool check_idioms(size_t samples = 10000);
+}
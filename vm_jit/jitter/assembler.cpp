@@ -0,0 +1,734 @@
+#include "assembler.h"
+#include "../stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <vector>
+
+namespace jitter
+{
+    // Physical registers by hardware id
+    //
+    static const asmjit::x86::Gp gpq[16] =
+    {
+        asmjit::x86::rax, asmjit::x86::rcx, asmjit::x86::rdx, asmjit::x86::rbx,
+        asmjit::x86::rsp, asmjit::x86::rbp, asmjit::x86::rsi, asmjit::x86::rdi,
+        asmjit::x86::r8,  asmjit::x86::r9,  asmjit::x86::r10, asmjit::x86::r11,
+        asmjit::x86::r12, asmjit::x86::r13, asmjit::x86::r14, asmjit::x86::r15,
+    };
+
+    // Arg and Return order, the order the VM entry pushes them in
+    //
+    static const asmjit::x86::Gp entry_regs[15] =
+    {
+        asmjit::x86::rax, asmjit::x86::rbx, asmjit::x86::rcx, asmjit::x86::rdx,
+        asmjit::x86::rdi, asmjit::x86::rsi, asmjit::x86::rbp, asmjit::x86::r8,
+        asmjit::x86::r9,  asmjit::x86::r10, asmjit::x86::r11, asmjit::x86::r12,
+        asmjit::x86::r13, asmjit::x86::r14, asmjit::x86::r15,
+    };
+
+    // rax holds spilled results and breaks move cycles, rdx holds 64-bit immediates and
+    // memory to memory moves. Everything else but rsp is handed out.
+    //
+    static constexpr int32_t scratch = 0;
+    static constexpr int32_t scratch_imm = 2;
+    static constexpr int32_t allocatable[] = { 3, 1, 6, 7, 5, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+    static constexpr int32_t vreg_base = 15 * 8;
+    static constexpr int32_t spill_base = 30 * 8;
+
+    static bool fits_imm32(uint64_t imm)
+    {
+        return (int64_t)imm == (int32_t)imm;
+    }
+
+    // A register by hardware id or an rsp relative frame offset
+    //
+    struct place_t
+    {
+        int32_t reg = -1;
+        int32_t disp = -1;
+
+        bool operator==(const place_t&) const = default;
+    };
+
+    struct interval_t
+    {
+        ir::value_t value = ir::none;
+        uint32_t start = 0;
+        uint32_t end = 0;
+    };
+
+    struct move_t
+    {
+        place_t dst;
+        place_t src;
+        // Constants have no place, they never block another move
+        //
+        bool is_const = false;
+        uint64_t imm = 0;
+    };
+
+    struct assembler_t
+    {
+        const ir::function_t& fn;
+        asmjit::x86::Assembler as;
+
+        // Positions are numbered over live blocks in order. A block's params are defined
+        // at its start and everything its exit reads is used at its end.
+        //
+        std::vector<uint32_t> starts;
+        std::vector<uint32_t> ends;
+        std::vector<uint32_t> defs;
+
+        std::vector<place_t> places;
+        std::vector<asmjit::Label> labels;
+        int32_t frame_size = 0;
+
+        assembler_t(const ir::function_t& fn, asmjit::CodeHolder& code) : fn(fn), as(&code) {}
+
+        // Constants are folded into their uses and Args are read from the entry area
+        //
+        bool is_allocated(ir::value_t v) const
+        {
+            auto op = fn.insts[v].op;
+            return op != ir::op_t::Const && op != ir::op_t::Arg && op != ir::op_t::StoreVreg;
+        }
+
+        template<typename F>
+        void for_each_use(const ir::block_t& block, uint32_t b, F&& f) const
+        {
+            for (auto v : block.body)
+            {
+                for (auto arg : fn.insts[v].args)
+                {
+                    if (arg != ir::none)
+                        f(arg, defs[v]);
+                }
+            }
+
+            auto edge = [&](const ir::edge_t& e)
+            {
+                for (auto arg : e.args)
+                    f(arg, ends[b]);
+            };
+            switch (block.exit)
+            {
+            case ir::exit_t::Jump:
+                edge(block.edges[0]);
+                break;
+            case ir::exit_t::Branch:
+                f(block.lhs, ends[b]);
+                f(block.rhs, ends[b]);
+                edge(block.edges[0]);
+                edge(block.edges[1]);
+                break;
+            case ir::exit_t::Return:
+                for (auto v : block.values)
+                    f(v, ends[b]);
+                break;
+            case ir::exit_t::Trap:
+                break;
+            }
+        }
+
+        void number()
+        {
+            uint32_t pos = 0;
+            starts.assign(fn.blocks.size(), 0);
+            ends.assign(fn.blocks.size(), 0);
+            defs.assign(fn.insts.size(), 0);
+            for (size_t b = 0; b < fn.blocks.size(); b++)
+            {
+                const auto& block = fn.blocks[b];
+                if (!block.live)
+                    continue;
+                starts[b] = pos++;
+                for (auto param : block.params)
+                    defs[param] = starts[b];
+                for (auto v : block.body)
+                    defs[v] = pos++;
+                ends[b] = pos++;
+            }
+        }
+
+        // One range per value from its first to its last live position. Values read in
+        // the block that defines them need nothing else, the rest get block liveness.
+        //
+        std::vector<interval_t> build_intervals() const
+        {
+            const auto count = fn.insts.size();
+            std::vector<uint32_t> first(defs);
+            std::vector<uint32_t> last(defs);
+            std::vector<uint32_t> owner(count, ir::none);
+            std::vector<uint32_t> global(count, ir::none);
+            std::vector<ir::value_t> globals;
+
+            for (size_t b = 0; b < fn.blocks.size(); b++)
+            {
+                const auto& block = fn.blocks[b];
+                if (!block.live)
+                    continue;
+                for (auto param : block.params)
+                    owner[param] = (uint32_t)b;
+                for (auto v : block.body)
+                    owner[v] = (uint32_t)b;
+            }
+
+            for (size_t b = 0; b < fn.blocks.size(); b++)
+            {
+                const auto& block = fn.blocks[b];
+                if (!block.live)
+                    continue;
+                for_each_use(block, (uint32_t)b, [&](ir::value_t v, uint32_t pos)
+                    {
+                        if (!is_allocated(v))
+                            return;
+                        last[v] = std::max(last[v], pos);
+                        if (owner[v] != b && global[v] == ir::none)
+                        {
+                            global[v] = (uint32_t)globals.size();
+                            globals.push_back(v);
+                        }
+                    });
+            }
+
+            if (!globals.empty())
+            {
+                using bits_t = std::vector<uint64_t>;
+                const auto words = (globals.size() + 63) / 64;
+                auto set = [](bits_t& bits, uint32_t i) { bits[i / 64] |= 1ull << (i % 64); };
+
+                std::vector<bits_t> gen(fn.blocks.size(), bits_t(words));
+                std::vector<bits_t> kill(fn.blocks.size(), bits_t(words));
+                std::vector<bits_t> live_in(fn.blocks.size(), bits_t(words));
+                std::vector<bits_t> live_out(fn.blocks.size(), bits_t(words));
+
+                for (size_t b = 0; b < fn.blocks.size(); b++)
+                {
+                    const auto& block = fn.blocks[b];
+                    if (!block.live)
+                        continue;
+                    for (auto param : block.params)
+                    {
+                        if (global[param] != ir::none)
+                            set(kill[b], global[param]);
+                    }
+                    for (auto v : block.body)
+                    {
+                        if (global[v] != ir::none)
+                            set(kill[b], global[v]);
+                    }
+                    for_each_use(block, (uint32_t)b, [&](ir::value_t v, uint32_t)
+                        {
+                            if (global[v] != ir::none && owner[v] != b)
+                                set(gen[b], global[v]);
+                        });
+                }
+
+                // Backwards over the blocks until nothing changes
+                //
+                for (bool changed = true; changed;)
+                {
+                    changed = false;
+                    for (size_t b = fn.blocks.size(); b-- > 0;)
+                    {
+                        const auto& block = fn.blocks[b];
+                        if (!block.live)
+                            continue;
+
+                        auto& out = live_out[b];
+                        for (int e = 0; e < 2; e++)
+                        {
+                            if (e == 1 && block.exit != ir::exit_t::Branch)
+                                break;
+                            if (block.exit != ir::exit_t::Jump && block.exit != ir::exit_t::Branch)
+                                break;
+                            auto succ = block.edges[e].block;
+                            if (succ == ir::none)
+                                continue;
+                            for (size_t w = 0; w < words; w++)
+                                out[w] |= live_in[succ][w];
+                        }
+
+                        for (size_t w = 0; w < words; w++)
+                        {
+                            auto in = gen[b][w] | (out[w] & ~kill[b][w]);
+                            if (in != live_in[b][w])
+                            {
+                                live_in[b][w] = in;
+                                changed = true;
+                            }
+                        }
+                    }
+                }
+
+                for (size_t b = 0; b < fn.blocks.size(); b++)
+                {
+                    if (!fn.blocks[b].live)
+                        continue;
+                    for (size_t w = 0; w < words; w++)
+                    {
+                        for (auto bits = live_in[b][w] | live_out[b][w]; bits; bits &= bits - 1)
+                        {
+                            auto i = w * 64 + std::countr_zero(bits);
+                            auto v = globals[i];
+                            if (live_in[b][w] & (1ull << (i % 64)))
+                                first[v] = std::min(first[v], starts[b]);
+                            if (live_out[b][w] & (1ull << (i % 64)))
+                                last[v] = std::max(last[v], ends[b]);
+                        }
+                    }
+                }
+            }
+
+            std::vector<interval_t> out;
+            for (const auto& block : fn.blocks)
+            {
+                if (!block.live)
+                    continue;
+                for (auto param : block.params)
+                    out.push_back({ param, first[param], last[param] });
+                for (auto v : block.body)
+                {
+                    if (is_allocated(v))
+                        out.push_back({ v, first[v], last[v] });
+                }
+            }
+            std::stable_sort(out.begin(), out.end(), [](const auto& a, const auto& b) { return a.start < b.start; });
+            return out;
+        }
+
+        // Linear scan. A range is only expired once its end is behind the next start, so a
+        // result never shares a register with an operand of its own instruction. With no
+        // register free the range that ends last goes to the stack.
+        //
+        void allocate()
+        {
+            places.assign(fn.insts.size(), place_t{});
+
+            std::vector<int32_t> free_regs(std::rbegin(allocatable), std::rend(allocatable));
+            std::vector<interval_t> active;
+            std::vector<uint32_t> slot_ends;
+
+            auto spill = [&](const interval_t& it)
+            {
+                // A slot is reused once its last owner ended before this range started
+                //
+                size_t slot = 0;
+                while (slot < slot_ends.size() && slot_ends[slot] >= it.start)
+                    slot++;
+                if (slot == slot_ends.size())
+                    slot_ends.push_back(0);
+                slot_ends[slot] = it.end;
+                places[it.value] = { -1, spill_base + (int32_t)slot * 8 };
+            };
+
+            auto activate = [&](const interval_t& it)
+            {
+                auto pos = std::upper_bound(active.begin(), active.end(), it,
+                    [](const auto& a, const auto& b) { return a.end < b.end; });
+                active.insert(pos, it);
+            };
+
+            for (const auto& it : build_intervals())
+            {
+                while (!active.empty() && active.front().end < it.start)
+                {
+                    free_regs.push_back(places[active.front().value].reg);
+                    active.erase(active.begin());
+                }
+
+                if (!free_regs.empty())
+                {
+                    places[it.value] = { free_regs.back(), -1 };
+                    free_regs.pop_back();
+                    activate(it);
+                    continue;
+                }
+
+                auto victim = active.back();
+                if (victim.end > it.end)
+                {
+                    places[it.value] = places[victim.value];
+                    spill(victim);
+                    active.pop_back();
+                    activate(it);
+                }
+                else
+                {
+                    spill(it);
+                }
+            }
+
+            frame_size = spill_base + (int32_t)slot_ends.size() * 8;
+        }
+
+        asmjit::x86::Mem frame(int32_t disp) const
+        {
+            return asmjit::x86::qword_ptr(asmjit::x86::rsp, disp);
+        }
+
+        place_t place(ir::value_t v) const
+        {
+            const auto& inst = fn.insts[v];
+            if (inst.op == ir::op_t::Arg)
+                return { -1, (int32_t)inst.imm * 8 };
+            return places[v];
+        }
+
+        move_t source(ir::value_t v) const
+        {
+            const auto& inst = fn.insts[v];
+            move_t move;
+            if (inst.op == ir::op_t::Const)
+            {
+                move.is_const = true;
+                move.imm = inst.imm;
+            }
+            else
+            {
+                move.src = place(v);
+            }
+            return move;
+        }
+
+        void emit_move(const move_t& move)
+        {
+            if (move.dst.reg >= 0)
+            {
+                const auto& dst = gpq[move.dst.reg];
+                if (move.is_const)
+                    as.mov(dst, asmjit::Imm(move.imm));
+                else if (move.src.reg >= 0)
+                    as.mov(dst, gpq[move.src.reg]);
+                else
+                    as.mov(dst, frame(move.src.disp));
+                return;
+            }
+
+            const auto dst = frame(move.dst.disp);
+            if (move.is_const && fits_imm32(move.imm))
+            {
+                as.mov(dst, asmjit::Imm(move.imm));
+            }
+            else if (!move.is_const && move.src.reg >= 0)
+            {
+                as.mov(dst, gpq[move.src.reg]);
+            }
+            else
+            {
+                emit_move({ { scratch_imm, -1 }, move.src, move.is_const, move.imm });
+                as.mov(dst, gpq[scratch_imm]);
+            }
+        }
+
+        void load(int32_t reg, ir::value_t v)
+        {
+            auto move = source(v);
+            move.dst = { reg, -1 };
+            if (move.is_const || move.src != move.dst)
+                emit_move(move);
+        }
+
+        // Moves into a set of distinct places as if all happened at once. Moves whose
+        // destination nobody reads go first, a cycle is broken by parking one destination
+        // in rax.
+        //
+        void parallel_move(std::vector<move_t> moves)
+        {
+            std::erase_if(moves, [](const auto& m) { return !m.is_const && m.src == m.dst; });
+
+            auto is_read = [&](const place_t& dst)
+            {
+                return std::any_of(moves.begin(), moves.end(), [&](const auto& m) { return !m.is_const && m.src == dst; });
+            };
+
+            while (!moves.empty())
+            {
+                bool progress = false;
+                for (size_t i = 0; i < moves.size();)
+                {
+                    if (is_read(moves[i].dst))
+                    {
+                        i++;
+                        continue;
+                    }
+                    emit_move(moves[i]);
+                    moves.erase(moves.begin() + i);
+                    progress = true;
+                }
+                if (progress)
+                    continue;
+
+                auto parked = moves.front().dst;
+                emit_move({ { scratch, -1 }, parked });
+                for (auto& m : moves)
+                {
+                    if (!m.is_const && m.src == parked)
+                        m.src = { scratch, -1 };
+                }
+            }
+        }
+
+        // Register a result is computed in, rax when it was spilled
+        //
+        int32_t result(ir::value_t v) const
+        {
+            return places[v].reg >= 0 ? places[v].reg : scratch;
+        }
+
+        void commit(ir::value_t v, int32_t reg)
+        {
+            if (places[v].reg < 0)
+                as.mov(frame(places[v].disp), gpq[reg]);
+        }
+
+        template<typename F>
+        void with_source(ir::value_t v, F&& f)
+        {
+            const auto& inst = fn.insts[v];
+            if (inst.op == ir::op_t::Const)
+            {
+                if (fits_imm32(inst.imm))
+                {
+                    f(asmjit::Imm(inst.imm));
+                    return;
+                }
+                as.mov(gpq[scratch_imm], asmjit::Imm(inst.imm));
+                f(gpq[scratch_imm]);
+                return;
+            }
+
+            auto p = place(v);
+            if (p.reg >= 0)
+                f(gpq[p.reg]);
+            else
+                f(frame(p.disp));
+        }
+
+        // out = op(args[0], args[1]) with a two operand instruction
+        //
+        template<typename F>
+        void binary(ir::value_t v, F&& f)
+        {
+            const auto& inst = fn.insts[v];
+            auto reg = result(v);
+            load(reg, inst.args[0]);
+            with_source(inst.args[1], [&](const auto& src) { f(gpq[reg], src); });
+            commit(v, reg);
+        }
+
+        template<typename F>
+        void unary(ir::value_t v, F&& f)
+        {
+            auto reg = result(v);
+            load(reg, fn.insts[v].args[0]);
+            f(gpq[reg]);
+            commit(v, reg);
+        }
+
+        // Address operands need a register, rdx if the value has none
+        //
+        asmjit::x86::Gp address(ir::value_t v)
+        {
+            auto p = place(v);
+            if (p.reg >= 0)
+                return gpq[p.reg];
+            load(scratch_imm, v);
+            return gpq[scratch_imm];
+        }
+
+        void add_instruction(ir::value_t v)
+        {
+            const auto& inst = fn.insts[v];
+            switch (inst.op)
+            {
+            case ir::op_t::Arg:
+            case ir::op_t::Param:
+            case ir::op_t::Const:
+                break;
+            case ir::op_t::LoadVreg:
+            {
+                auto reg = result(v);
+                as.mov(gpq[reg], frame(vreg_base + (int32_t)inst.imm * 8));
+                commit(v, reg);
+                break;
+            }
+            case ir::op_t::StoreVreg:
+            {
+                auto move = source(inst.args[0]);
+                move.dst = { -1, vreg_base + (int32_t)inst.imm * 8 };
+                emit_move(move);
+                break;
+            }
+            case ir::op_t::Read8:
+            {
+                auto addr = address(inst.args[0]);
+                auto reg = result(v);
+                as.movzx(gpq[reg], asmjit::x86::byte_ptr(addr));
+                commit(v, reg);
+                break;
+            }
+            case ir::op_t::Read64:
+            {
+                auto addr = address(inst.args[0]);
+                auto reg = result(v);
+                as.mov(gpq[reg], asmjit::x86::qword_ptr(addr));
+                commit(v, reg);
+                break;
+            }
+            case ir::op_t::Add:
+                binary(v, [&](const auto& dst, const auto& src) { as.add(dst, src); });
+                break;
+            case ir::op_t::Nand:
+                binary(v, [&](const auto& dst, const auto& src) { as.and_(dst, src); as.not_(dst); });
+                break;
+            case ir::op_t::Mul:
+                // Low 64 bits are the same signed or not, imul needs neither rax nor rdx
+                //
+                binary(v, [&](const auto& dst, const auto& src) { as.imul(dst, src); });
+                break;
+            case ir::op_t::Not:
+                unary(v, [&](const auto& dst) { as.not_(dst); });
+                break;
+            case ir::op_t::And:
+                binary(v, [&](const auto& dst, const auto& src) { as.and_(dst, src); });
+                break;
+            case ir::op_t::Or:
+                binary(v, [&](const auto& dst, const auto& src) { as.or_(dst, src); });
+                break;
+            case ir::op_t::Xor:
+                binary(v, [&](const auto& dst, const auto& src) { as.xor_(dst, src); });
+                break;
+            case ir::op_t::Andn:
+                binary(v, [&](const auto& dst, const auto& src) { as.not_(dst); as.and_(dst, src); });
+                break;
+            case ir::op_t::Sub:
+                binary(v, [&](const auto& dst, const auto& src) { as.sub(dst, src); });
+                break;
+            case ir::op_t::Neg:
+                unary(v, [&](const auto& dst) { as.neg(dst); });
+                break;
+            }
+        }
+
+        // Falls through when the target is emitted next
+        //
+        void jump_to(const ir::edge_t& edge, uint32_t next)
+        {
+            if (edge.block == ir::none)
+            {
+                as.int3();
+                return;
+            }
+
+            const auto& params = fn.blocks[edge.block].params;
+            assert(params.size() == edge.args.size());
+            std::vector<move_t> moves;
+            for (size_t i = 0; i < params.size(); i++)
+            {
+                auto move = source(edge.args[i]);
+                move.dst = places[params[i]];
+                moves.push_back(move);
+            }
+            parallel_move(std::move(moves));
+
+            if (edge.block != next)
+                as.jmp(labels[edge.block]);
+        }
+
+        void run()
+        {
+            {
+                stats::scope_t scope(stats::phase_t::RegAlloc);
+                number();
+                allocate();
+            }
+            stats::scope_t scope(stats::phase_t::Encode);
+
+            labels.clear();
+            for (size_t b = 0; b < fn.blocks.size(); b++)
+                labels.push_back(as.newLabel());
+
+            as.sub(asmjit::x86::rsp, asmjit::Imm(frame_size));
+            for (int i = 0; i < 15; i++)
+                as.mov(frame(i * 8), entry_regs[i]);
+
+            auto headers = ir::loop_headers(fn);
+            for (size_t b = 0; b < fn.blocks.size(); b++)
+            {
+                const auto& block = fn.blocks[b];
+                if (!block.live)
+                    continue;
+
+                auto next = ir::none;
+                for (auto n = b + 1; n < fn.blocks.size(); n++)
+                {
+                    if (fn.blocks[n].live)
+                    {
+                        next = (uint32_t)n;
+                        break;
+                    }
+                }
+
+                if (headers[b])
+                    as.align(asmjit::kAlignCode, 64);
+                as.bind(labels[b]);
+                for (auto v : block.body)
+                    add_instruction(v);
+
+                switch (block.exit)
+                {
+                case ir::exit_t::Jump:
+                    jump_to(block.edges[0], next);
+                    break;
+                case ir::exit_t::Branch:
+                {
+                    auto taken = as.newLabel();
+                    auto lhs = place(block.lhs);
+                    if (lhs.reg < 0)
+                    {
+                        load(scratch, block.lhs);
+                        lhs.reg = scratch;
+                    }
+                    with_source(block.rhs, [&](const auto& src) { as.cmp(gpq[lhs.reg], src); });
+                    as.jnz(taken);
+                    jump_to(block.edges[0], ir::none);
+                    as.bind(taken);
+                    jump_to(block.edges[1], next);
+                    break;
+                }
+                case ir::exit_t::Return:
+                {
+                    // Stage in the entry area first, values may sit in the registers
+                    // being written
+                    //
+                    std::vector<move_t> moves;
+                    for (int i = 0; i < 15; i++)
+                    {
+                        auto move = source(block.values[i]);
+                        move.dst = { -1, i * 8 };
+                        moves.push_back(move);
+                    }
+                    parallel_move(std::move(moves));
+                    for (int i = 0; i < 15; i++)
+                        as.mov(entry_regs[i], frame(i * 8));
+                    as.add(asmjit::x86::rsp, asmjit::Imm(frame_size));
+                    as.ret();
+                    break;
+                }
+                case ir::exit_t::Trap:
+                    as.int3();
+                    break;
+                }
+            }
+        }
+    };
+
+    void assemble(const ir::function_t& fn, asmjit::CodeHolder& code)
+    {
+        assembler_t(fn, code).run();
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "../ir/ir.h"
+
+#include <asmjit/asmjit.h>
+
+namespace jitter
+{
+    // Lowers an optimized function in a single pass with asmjit's Assembler. Values get
+    // a register or a stack slot from a linear scan over block-level liveness, constants
+    // are folded into their uses and vregs live in the frame.
+    //
+    // The frame is [entry registers | vregs | spill slots]. Entry stores every physical
+    // register there and Arg values are read from it, Return stages the result there
+    // before reloading the registers.
+    //
+    void assemble(const ir::function_t& fn, asmjit::CodeHolder& code);
+}
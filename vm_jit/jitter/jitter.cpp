@@ -1,166 +1,197 @@
 #include "jitter.h"
+#include "assembler.h"
+#include "../ir/passes.h"
+#include "../stats.h"
+
+#include <algorithm>
 
 namespace jitter
 {
-    using vm_instruction_lifter = std::function<void(const vm::instruction_t&, jitter&)>;
-    static std::unordered_map<vm::opcodes, vm_instruction_lifter> handlers =
+    using ir_instruction_lifter = std::function<void(const ir::inst_t&, asmjit::x86::Gp&, jitter&)>;
+    static std::unordered_map<ir::op_t, ir_instruction_lifter> handlers =
     {
         {
-            vm::opcodes::PopVreg,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::Arg,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                jit.cc->mov(jit.get_vreg(instr.operand), jit.virtual_pop());
-
+                static const asmjit::x86::Gp regs[] =
+                {
+                    asmjit::x86::rax, asmjit::x86::rbx, asmjit::x86::rcx, asmjit::x86::rdx,
+                    asmjit::x86::rdi, asmjit::x86::rsi, asmjit::x86::rbp, asmjit::x86::r8,
+                    asmjit::x86::r9,  asmjit::x86::r10, asmjit::x86::r11, asmjit::x86::r12,
+                    asmjit::x86::r13, asmjit::x86::r14, asmjit::x86::r15,
+                };
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, regs[inst.imm]);
             }
         },
         {
-            vm::opcodes::PushVreg,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::Const,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                auto temp_r = jit.cc->newGpq();
-                jit.cc->mov(temp_r, jit.get_vreg(instr.operand));
-                jit.virtual_push(temp_r);
+                out = jit.cc->newUInt64();
+                jit.cc->mov(out, inst.imm);
             }
         },
         {
-            vm::opcodes::PushConst,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::LoadVreg,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                auto temp_r = jit.cc->newUInt64();
-                jit.cc->mov(temp_r, instr.operand);
-                jit.virtual_push(temp_r);
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.get_vreg(inst.imm));
             }
         },
         {
-            vm::opcodes::Read8,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::StoreVreg,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                auto temp_r = jit.virtual_pop();
-                jit.cc->movzx(temp_r, asmjit::x86::byte_ptr(temp_r));
-                jit.virtual_push(temp_r);
+                jit.cc->mov(jit.get_vreg(inst.imm), jit.values[inst.args[0]]);
             }
         },
         {
-            vm::opcodes::Read64,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::Read8,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                auto temp_r = jit.virtual_pop();
-                jit.cc->mov(temp_r, asmjit::x86::ptr(temp_r));
-                jit.virtual_push(temp_r);
+                out = jit.cc->newGpq();
+                jit.cc->movzx(out, asmjit::x86::byte_ptr(jit.values[inst.args[0]]));
             }
         },
         {
-            vm::opcodes::Add,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::Read64,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                auto temp_r1 = jit.virtual_pop();
-                auto temp_r2 = jit.virtual_pop();
-                jit.cc->add(temp_r1, temp_r2);
-                jit.virtual_push(temp_r1);
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, asmjit::x86::ptr(jit.values[inst.args[0]]));
             }
         },
         {
-            vm::opcodes::Nand,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::Add,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                asmjit::DebugUtils::unused(instr);
-                auto temp_r1 = jit.virtual_pop();
-                auto temp_r2 = jit.virtual_pop();
-                jit.cc->and_(temp_r1, temp_r2);
-                jit.cc->not_(temp_r1);
-                jit.virtual_push(temp_r1);
+                // Values may have more than one use, never clobber an operand
+                //
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->add(out, jit.values[inst.args[1]]);
             }
         },
         {
-            vm::opcodes::Mul,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::Nand,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                // Why all this?
-                // Well, for some reason this is the only way to make Mul work.
-                // Preserve rax, rdx -> mul -> restore rax, rdx
-                auto t1 = jit.cc->newGpq();
-                auto t2 = jit.cc->newGpq();
-                auto t3 = jit.cc->newGpq();
-                jit.cc->mov(t1, asmjit::x86::rax);
-                jit.cc->mov(t2, asmjit::x86::rdx);
-
-                auto arg_1 = jit.virtual_pop();
-                auto arg_2 = jit.virtual_pop();
-
-                jit.cc->mul(t3, arg_1, arg_2);
-                jit.cc->mov(arg_1, asmjit::x86::rax);
-                jit.virtual_push(arg_1);
-
-                jit.cc->mov(asmjit::x86::rax, t1);
-                jit.cc->mov(asmjit::x86::rdx, t2);
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->and_(out, jit.values[inst.args[1]]);
+                jit.cc->not_(out);
             }
         },
         {
-            vm::opcodes::Jnz,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::Not,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                auto cmp_r1 = jit.virtual_pop();
-                auto cmp_r2 = jit.virtual_pop();
-                auto new_rkey = jit.virtual_pop();
-                auto new_bytecode = jit.virtual_pop();
-                auto new_ror_key = jit.virtual_pop();
-
-                jit.cc->cmp(cmp_r1, cmp_r2);
-                if (jit.labels.count(instr.operand))
-                {
-                    jit.cc->jnz(jit.get_label(instr.operand));
-                }
-                else
-                {
-                    auto lbl = jit.create_label(instr.operand);
-                    jit.cc->jnz(lbl);
-                    jit.dead_branches.push_back(lbl);
-                }
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->not_(out);
             }
         },
         {
-            vm::opcodes::Exit,
-            [](const vm::instruction_t& instr, jitter& jit)
+            ir::op_t::And,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
             {
-                jit.cc->mov(asmjit::x86::r15, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::r14, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::r13, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::r12, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::r11, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::r10, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::r9,  jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::r8,  jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::rbp, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::rsi, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::rdi, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::rdx, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::rcx, jit.virtual_pop());
-                jit.cc->mov(asmjit::x86::rbx, jit.virtual_pop());
-                jit.cc->ret(jit.virtual_pop());
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->and_(out, jit.values[inst.args[1]]);
             }
-        }
+        },
+        {
+            ir::op_t::Or,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
+            {
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->or_(out, jit.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Xor,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
+            {
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->xor_(out, jit.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Andn,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
+            {
+                // No BMI1 requirement on the host, not + and
+                //
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->not_(out);
+                jit.cc->and_(out, jit.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Sub,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
+            {
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->sub(out, jit.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Neg,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
+            {
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->neg(out);
+            }
+        },
+        {
+            ir::op_t::Mul,
+            [](const ir::inst_t& inst, asmjit::x86::Gp& out, jitter& jit)
+            {
+                // Only the low 64 bits are kept, two operand imul leaves rax and rdx
+                // to the register allocator
+                //
+                out = jit.cc->newGpq();
+                jit.cc->mov(out, jit.values[inst.args[0]]);
+                jit.cc->imul(out, jit.values[inst.args[1]]);
+            }
+        },
     };
 
-    jitter::jitter()
+    jitter::jitter(backend_t backend) : backend(backend)
     {
         // Initialize CodeHolder from our environment
         //
         code.init(rt.environment());
-        // Create logger and set maximum verbose level
+        // Full asmjit dump only on request, it easily outweighs compilation itself
+        //
+        if (stats::verbosity >= 2)
+        {
+            logger = std::make_unique<asmjit::FileLogger>(stdout);
+            logger->setFlags(
+                asmjit::FormatOptions::Flags::kFlagAnnotations |
+                asmjit::FormatOptions::Flags::kFlagDebugPasses |
+                asmjit::FormatOptions::Flags::kFlagDebugRA |
+                asmjit::FormatOptions::Flags::kFlagExplainImms |
+                asmjit::FormatOptions::Flags::kFlagHexImms |
+                asmjit::FormatOptions::Flags::kFlagHexOffsets |
+                asmjit::FormatOptions::Flags::kFlagMachineCode |
+                asmjit::FormatOptions::Flags::kFlagPositions |
+                asmjit::FormatOptions::Flags::kFlagRegCasts
+            );
+            code.setLogger(&*logger);
+        }
+        // The assembler backend builds its own emitter at compile time
         //
-        logger = std::make_unique<asmjit::FileLogger>(stdout);
-        logger->setFlags(
-            asmjit::FormatOptions::Flags::kFlagAnnotations |
-            asmjit::FormatOptions::Flags::kFlagDebugPasses |
-            asmjit::FormatOptions::Flags::kFlagDebugRA |
-            asmjit::FormatOptions::Flags::kFlagExplainImms |
-            asmjit::FormatOptions::Flags::kFlagHexImms |
-            asmjit::FormatOptions::Flags::kFlagHexOffsets |
-            asmjit::FormatOptions::Flags::kFlagMachineCode |
-            asmjit::FormatOptions::Flags::kFlagPositions |
-            asmjit::FormatOptions::Flags::kFlagRegCasts
-        );
-        code.setLogger(&*logger);
+        if (backend == backend_t::Assembler)
+            return;
         // Create compiler
         //
         cc = std::make_unique<asmjit::x86::Compiler>(&code);
@@ -172,44 +203,6 @@ namespace jitter
         // Create devirtualized function
         //
         cc->addFunc(asmjit::FuncSignatureT<int>());
-
-        // Create virtual registers
-        //
-        for (int i = 0; i < 15; i++)
-            create_vreg(i);
-
-        // Create VM entry
-        //
-        virtual_push(asmjit::x86::rax);
-        virtual_push(asmjit::x86::rbx);
-        virtual_push(asmjit::x86::rcx);
-        virtual_push(asmjit::x86::rdx);
-        virtual_push(asmjit::x86::rdi);
-        virtual_push(asmjit::x86::rsi);
-        virtual_push(asmjit::x86::rbp);
-        virtual_push(asmjit::x86::r8);
-        virtual_push(asmjit::x86::r9);
-        virtual_push(asmjit::x86::r10);
-        virtual_push(asmjit::x86::r11);
-        virtual_push(asmjit::x86::r12);
-        virtual_push(asmjit::x86::r13);
-        virtual_push(asmjit::x86::r14);
-        virtual_push(asmjit::x86::r15);
-    }
-
-    asmjit::Label jitter::get_label(vm::vip_t vip)
-    {
-        return labels.at(vip);
-    }
-
-    asmjit::Label jitter::create_label(vm::vip_t vip)
-    {
-        // Make sure label is free
-        //
-        assert(!labels.count(vip));
-        auto label = cc->newLabel();
-        labels.insert({ vip, label });
-        return label;
     }
 
     asmjit::x86::Gp jitter::create_vreg(uint64_t idx)
@@ -221,49 +214,184 @@ namespace jitter
 
     asmjit::x86::Gp jitter::get_vreg(uint64_t idx)
     {
-        // Make sure the register is present
+        // Vregs are promoted to SSA values by the IR, only the ones still read at entry
+        // or stored before a trap ever get a register
         //
-        assert(reg_map.count(idx));
-        return reg_map.at(idx);
-    }
-
-    asmjit::x86::Gp jitter::virtual_pop()
-    {
-        auto v = stack.back();
-        stack.pop_back();
-        return v;
+        if (auto it = reg_map.find(idx); it != reg_map.end())
+            return it->second;
+        return create_vreg(idx);
     }
 
-    void jitter::virtual_push(asmjit::x86::Gp v)
+    void jitter::add_block(const vm::block_t& block)
     {
-        stack.push_back(v);
+        trace.blocks.push_back(block);
     }
 
-    void jitter::add_instruction(const vm::instruction_t& instr)
+    void jitter::add_instruction(const ir::function_t& fn, ir::value_t v)
     {
-        cc->bind(create_label(instr.vip));
-
+        const auto& inst = fn.insts[v];
         // Ensure Opcode is present
         //
-        assert(handlers.count(instr.op));
+        assert(handlers.count(inst.op));
         // Compile instruction
         //
-        handlers.at(instr.op)(instr, *this);
+        handlers.at(inst.op)(inst, values[v], *this);
     }
 
-    asmjit::CodeBuffer& jitter::compile()
+    void jitter::jump_to(const ir::function_t& fn, const ir::edge_t& edge)
     {
-        // Terminate all dead branches
+        // Path the trace never reached
         //
-        for (auto& lbl : dead_branches)
+        if (edge.block == ir::none)
         {
-            cc->bind(lbl);
             cc->int3();
+            return;
+        }
+
+        const auto& params = fn.blocks[edge.block].params;
+        assert(params.size() == edge.args.size());
+
+        // Params only need temporaries when an arg is itself a param of the target,
+        // a loop rotating its own values. Otherwise every move is independent and the
+        // allocator can coalesce param and arg.
+        //
+        bool shuffled = false;
+        for (size_t i = 0; i < params.size() && !shuffled; i++)
+        {
+            shuffled = edge.args[i] != params[i] &&
+                std::find(params.begin(), params.end(), edge.args[i]) != params.end();
+        }
+
+        if (!shuffled)
+        {
+            for (size_t i = 0; i < params.size(); i++)
+            {
+                if (params[i] != edge.args[i])
+                    cc->mov(values[params[i]], values[edge.args[i]]);
+            }
+            cc->jmp(labels[edge.block]);
+            return;
+        }
+
+        std::vector<asmjit::x86::Gp> temps;
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            if (params[i] == edge.args[i])
+                continue;
+            auto t = cc->newGpq();
+            cc->mov(t, values[edge.args[i]]);
+            temps.push_back(t);
+        }
+        for (size_t i = 0, j = 0; i < params.size(); i++)
+        {
+            if (params[i] != edge.args[i])
+                cc->mov(values[params[i]], temps[j++]);
+        }
+        cc->jmp(labels[edge.block]);
+    }
+
+    asmjit::CodeBuffer* jitter::compile()
+    {
+        auto built = ir::build(trace);
+        if (!built)
+            return nullptr;
+        auto& fn = *built;
+        ir::optimize(fn);
+
+        if (backend == backend_t::Assembler)
+        {
+            assemble(fn, code);
+            stats::count(stats::counter_t::CodeBytes, code.sectionById(0)->buffer().size());
+            return &code.sectionById(0)->buffer();
+        }
+
+        labels.clear();
+        values.assign(fn.insts.size(), asmjit::x86::Gp());
+        for (size_t b = 0; b < fn.blocks.size(); b++)
+        {
+            labels.push_back(cc->newLabel());
+            // Params are written by every edge into the block, they need a register up front
+            //
+            for (auto param : fn.blocks[b].params)
+                values[param] = cc->newGpq();
+        }
+
+        // Loop heads start on a cache line so the whole body is fetched together
+        //
+        auto headers = ir::loop_headers(fn);
+        for (size_t b = 0; b < fn.blocks.size(); b++)
+        {
+            const auto& block = fn.blocks[b];
+            if (!block.live)
+                continue;
+
+            if (headers[b])
+                cc->align(asmjit::kAlignCode, 64);
+            cc->bind(labels[b]);
+            for (auto v : block.body)
+                add_instruction(fn, v);
+
+            switch (block.exit)
+            {
+            case ir::exit_t::Jump:
+                jump_to(fn, block.edges[0]);
+                break;
+            case ir::exit_t::Branch:
+            {
+                // Taken edge goes through a stub, both edges may need moves
+                //
+                auto taken = cc->newLabel();
+                cc->cmp(values[block.lhs], values[block.rhs]);
+                cc->jnz(taken);
+                jump_to(fn, block.edges[0]);
+                cc->bind(taken);
+                jump_to(fn, block.edges[1]);
+                break;
+            }
+            case ir::exit_t::Return:
+            {
+                const auto& v = block.values;
+                cc->mov(asmjit::x86::r15, values[v[14]]);
+                cc->mov(asmjit::x86::r14, values[v[13]]);
+                cc->mov(asmjit::x86::r13, values[v[12]]);
+                cc->mov(asmjit::x86::r12, values[v[11]]);
+                cc->mov(asmjit::x86::r11, values[v[10]]);
+                cc->mov(asmjit::x86::r10, values[v[9]]);
+                cc->mov(asmjit::x86::r9,  values[v[8]]);
+                cc->mov(asmjit::x86::r8,  values[v[7]]);
+                cc->mov(asmjit::x86::rbp, values[v[6]]);
+                cc->mov(asmjit::x86::rsi, values[v[5]]);
+                cc->mov(asmjit::x86::rdi, values[v[4]]);
+                cc->mov(asmjit::x86::rdx, values[v[3]]);
+                cc->mov(asmjit::x86::rcx, values[v[2]]);
+                cc->mov(asmjit::x86::rbx, values[v[1]]);
+                cc->ret(values[v[0]]);
+                break;
+            }
+            case ir::exit_t::Trap:
+                // Path ended on something we could not decode
+                //
+                cc->int3();
+                break;
+            }
         }
 
         cc->endFunc();
-        cc->finalize();
 
-        return code.sectionById(0)->buffer();
+        // What finalize() does, split so register allocation and encoding are timed apart
+        //
+        {
+            stats::scope_t scope(stats::phase_t::RegAlloc);
+            cc->runPasses();
+        }
+        {
+            stats::scope_t scope(stats::phase_t::Encode);
+            asmjit::x86::Assembler assembler(&code);
+            assembler.addEncodingOptions(cc->encodingOptions());
+            cc->serializeTo(&assembler);
+        }
+        stats::count(stats::counter_t::CodeBytes, code.sectionById(0)->buffer().size());
+
+        return &code.sectionById(0)->buffer();
     }
 }
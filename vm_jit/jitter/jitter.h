@@ -1,5 +1,7 @@
 #pragma once
 #include "../matcher.h"
+#include "../explorer.h"
+#include "../ir/ir.h"
 
 #include <asmjit/asmjit.h>
 #include <unordered_map>
@@ -8,10 +10,19 @@
 
 namespace jitter
 {
+    // Compiler runs asmjit's register allocator over a node graph, Assembler emits in one
+    // pass with the linear scan in assembler.cpp and is much faster on large traces
+    //
+    enum class backend_t
+    {
+        Compiler,
+        Assembler,
+    };
 
     struct jitter
     {
-        std::unordered_map<uint64_t, asmjit::Label> labels;
+        backend_t backend;
+
         std::unordered_map<uint64_t, asmjit::x86::Gp> reg_map;
 
         asmjit::JitRuntime rt;
@@ -20,22 +31,28 @@ namespace jitter
         std::unique_ptr<asmjit::x86::Compiler> cc;
         std::unique_ptr<asmjit::FileLogger> logger;
 
-        std::vector<asmjit::x86::Gp> stack;
-        std::vector<asmjit::Label> dead_branches;
+        // Blocks are collected as they are traced and compiled at once,
+        // joins and loops need the whole trace to build the IR
+        //
+        vm::trace_t trace;
 
-        explicit jitter();
+        // One label per IR block and one virtual register per IR value
+        //
+        std::vector<asmjit::Label> labels;
+        std::vector<asmjit::x86::Gp> values;
 
-        asmjit::Label get_label(vm::vip_t vip);
-        asmjit::Label create_label(vm::vip_t vip);
+        explicit jitter(backend_t backend = backend_t::Compiler);
 
         asmjit::x86::Gp create_vreg(uint64_t idx);
         asmjit::x86::Gp get_vreg(uint64_t idx);
 
-        asmjit::x86::Gp virtual_pop();
-        void virtual_push(asmjit::x86::Gp v);
+        void add_block(const vm::block_t& block);
 
-        void add_instruction(const vm::instruction_t& instr);
+        void add_instruction(const ir::function_t& fn, ir::value_t v);
+        void jump_to(const ir::function_t& fn, const ir::edge_t& edge);
 
-        asmjit::CodeBuffer& compile();
+        // Null if the trace does not build into IR
+        //
+        asmjit::CodeBuffer* compile();
     };
 }
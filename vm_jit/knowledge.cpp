@@ -0,0 +1,147 @@
+#include "knowledge.h"
+#include "handlers.h"
+#include "hash.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+
+namespace vm
+{
+    static constexpr uint32_t knowledge_magic = 0x424B4D56; // "VMKB"
+    // Bump whenever the normalization or the meaning of stored positions changes
+    //
+    static constexpr uint32_t knowledge_version = 3;
+
+    uint64_t knowledge_base::key(const state& state, const x86::routine_t& routine)
+    {
+        auto raw = routine.to_normalized();
+        auto h = hash::hash64(raw.data(), raw.size());
+        // Same bytes mean something else under other register roles
+        //
+        h = hash::combine(h, state.vip_r);
+        h = hash::combine(h, state.vreg_r);
+        h = hash::combine(h, state.rkey_r);
+        return h;
+    }
+
+    std::optional<knowledge_t> knowledge_base::find(uint64_t key) const
+    {
+        std::shared_lock guard(lock);
+        if (auto it = entries.find(key); it != entries.end())
+            return it->second;
+        return std::nullopt;
+    }
+
+    void knowledge_base::insert(uint64_t key, const knowledge_t& entry)
+    {
+        std::unique_lock guard(lock);
+        if (entries.emplace(key, entry).second)
+            generation++;
+    }
+
+    bool knowledge_base::load(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return true;
+
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        size_t pos = 0;
+        auto read = [&](auto& v)
+        {
+            if (pos + sizeof(v) > data.size())
+                return false;
+            std::memcpy(&v, data.data() + pos, sizeof(v));
+            pos += sizeof(v);
+            return true;
+        };
+
+        uint64_t header = 0;
+        uint32_t classifier = 0;
+        uint64_t stored_generation = 0;
+        uint64_t count = 0;
+        if (!read(header) || header != (((uint64_t)knowledge_version << 32) | knowledge_magic) || !read(classifier) ||
+            !read(stored_generation) || !read(count))
+        {
+            std::printf("%s is not a handler database\n", path.c_str());
+            return false;
+        }
+
+        // Entries hold what an older classifier concluded, relearn them
+        //
+        if (classifier != classifier_version)
+        {
+            std::printf("%s was written by another classifier version, starting over\n", path.c_str());
+            return true;
+        }
+
+        // A file cut short or damaged part way through loads as an empty database, like
+        // one from another classifier version
+        //
+        std::unique_lock guard(lock);
+        auto corrupt = [&](uint64_t i)
+        {
+            std::printf("%s: entry %llu is truncated or corrupt, starting over\n", path.c_str(), (unsigned long long)i);
+            entries.clear();
+            generation = 0;
+            return true;
+        };
+
+        for (uint64_t i = 0; i < count; i++)
+        {
+            uint64_t key = 0;
+            uint8_t op = 0;
+            uint8_t keys = 0;
+            knowledge_t entry;
+            if (!read(key) || !read(op) || !read(keys) || op > (uint8_t)opcodes::Invalid)
+                return corrupt(i);
+
+            entry.op = (opcodes)op;
+            entry.ror_keys.resize(keys);
+            for (auto& position : entry.ror_keys)
+            {
+                if (!read(position))
+                    return corrupt(i);
+            }
+            if (!read(entry.jcc_key))
+                return corrupt(i);
+
+            entries.emplace(key, std::move(entry));
+        }
+        generation = stored_generation;
+        return true;
+    }
+
+    bool knowledge_base::save(const std::string& path) const
+    {
+        std::vector<uint8_t> out;
+        auto write = [&](const auto& v)
+        {
+            auto* p = reinterpret_cast<const uint8_t*>(&v);
+            out.insert(out.end(), p, p + sizeof(v));
+        };
+
+        std::shared_lock guard(lock);
+        write(((uint64_t)knowledge_version << 32) | knowledge_magic);
+        write(classifier_version);
+        write(generation);
+        write((uint64_t)entries.size());
+        for (const auto& [key, entry] : entries)
+        {
+            write(key);
+            write((uint8_t)entry.op);
+            write((uint8_t)entry.ror_keys.size());
+            for (auto position : entry.ror_keys)
+                write(position);
+            write(entry.jcc_key);
+        }
+        guard.unlock();
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(out.data()), out.size());
+        return file.good();
+    }
+}
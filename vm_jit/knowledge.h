@@ -0,0 +1,58 @@
+#pragma once
+#include "vm.h"
+
+#include <unordered_map>
+#include <shared_mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace vm
+{
+    // Handler classification that carries over between binaries protected by the same
+    // VM build. Handlers are keyed by their normalized bytes (displacements, immediates
+    // and with them addresses, jump targets and keys masked out) and the register roles,
+    // entries store where the keys sit rather than the keys themselves so every sample
+    // reads its own values back from the routine.
+    //
+    struct knowledge_t
+    {
+        opcodes op = opcodes::Invalid;
+        // Instruction positions of the fetch ror's and of the Jnz rcx load, -1 if none
+        //
+        std::vector<uint16_t> ror_keys;
+        int32_t jcc_key = -1;
+    };
+
+    struct knowledge_base
+    {
+        std::unordered_map<uint64_t, knowledge_t> entries;
+        mutable std::shared_mutex lock;
+        // Bumped by every new entry and kept in the file, a cached trace records the
+        // generation it was decoded with
+        //
+        uint64_t generation = 0;
+
+        static uint64_t key(const state& state, const x86::routine_t& routine);
+
+        std::optional<knowledge_t> find(uint64_t key) const;
+        void insert(uint64_t key, const knowledge_t& entry);
+
+        size_t size() const
+        {
+            std::shared_lock guard(lock);
+            return entries.size();
+        }
+
+        // On-disk database:
+        //
+        //   header  magic, version, classifier version, generation, entry count
+        //   entry   key, op byte, ror key count, u16 positions, i32 jcc position
+        //
+        // A missing file, one written by another classifier version or one with a
+        // truncated or corrupt entry loads as an empty database.
+        //
+        bool load(const std::string& path);
+        bool save(const std::string& path) const;
+    };
+}
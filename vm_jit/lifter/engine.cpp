@@ -0,0 +1,73 @@
+#include "engine.h"
+#pragma warning( push )
+#pragma warning(disable : 4624)
+#pragma warning(disable : 4996)
+#pragma warning(disable : 4244)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4146)
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/TargetSelect.h>
+
+#pragma warning( pop )
+#include <cstdio>
+#include <mutex>
+
+namespace lifter
+{
+	bool engine::load(const llvm::Module& module)
+	{
+		static std::once_flag native;
+		std::call_once(native, []
+			{
+				llvm::InitializeNativeTarget();
+				llvm::InitializeNativeTargetAsmPrinter();
+				// The lifter's memory base is inline asm
+				//
+				llvm::InitializeNativeTargetAsmParser();
+			});
+
+		auto created = llvm::orc::LLJITBuilder().create();
+		if (!created)
+		{
+			std::printf("Failed to create JIT: %s\n", llvm::toString(created.takeError()).c_str());
+			return false;
+		}
+		jit = std::move(*created);
+
+		llvm::SmallVector<char, 0> buffer;
+		llvm::raw_svector_ostream stream(buffer);
+		llvm::WriteBitcodeToFile(module, stream);
+
+		auto ctx = std::make_unique<llvm::LLVMContext>();
+		auto copy = llvm::parseBitcodeFile(
+			llvm::MemoryBufferRef(llvm::StringRef(buffer.data(), buffer.size()), module.getName()), *ctx);
+		if (!copy)
+		{
+			std::printf("Failed to copy module: %s\n", llvm::toString(copy.takeError()).c_str());
+			return false;
+		}
+
+		if (auto error = jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(*copy), std::move(ctx))))
+		{
+			std::printf("Failed to add module: %s\n", llvm::toString(std::move(error)).c_str());
+			return false;
+		}
+		return true;
+	}
+
+	void* engine::lookup(const std::string& name)
+	{
+		if (!jit)
+			return nullptr;
+
+		auto symbol = jit->lookup(name);
+		if (!symbol)
+		{
+			std::printf("Failed to compile %s: %s\n", name.c_str(), llvm::toString(symbol.takeError()).c_str());
+			return nullptr;
+		}
+		return reinterpret_cast<void*>(symbol->getAddress());
+	}
+}
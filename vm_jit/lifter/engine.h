@@ -0,0 +1,31 @@
+#pragma once
+#pragma warning( push )
+#pragma warning(disable : 4624)
+#pragma warning(disable : 4996)
+#pragma warning(disable : 4244)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4146)
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/Module.h>
+
+#pragma warning( pop )
+#include <memory>
+#include <string>
+
+namespace lifter
+{
+	// Compiles a lifted module for the host with ORC so it can be called in process.
+	// The module is copied through bitcode into a context of its own, the original
+	// stays usable.
+	//
+	struct engine
+	{
+		std::unique_ptr<llvm::orc::LLJIT> jit;
+
+		bool load(const llvm::Module& module);
+
+		// Address of a function in the loaded module or nullptr
+		//
+		void* lookup(const std::string& name);
+	};
+}
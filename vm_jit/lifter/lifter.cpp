@@ -1,245 +1,467 @@
-#include "lifter.h"
-#include "utils.h"
-#include <fstream>
-
-namespace lifter
-{
-	static int load_reg_counter = 0;
-
-	using vm_instruction_lifter = std::function<void(const vm::instruction_t&, lifter&)>;
-	static std::unordered_map<vm::opcodes, vm_instruction_lifter> handlers =
-	{
-        {
-            vm::opcodes::PopVreg,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				cc.builder.CreateStore(cc.virtual_pop(), cc.module.getNamedGlobal("vreg_" + 
-					std::to_string(instr.operand)));
-            }
-        },
-        {
-            vm::opcodes::PushVreg,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				cc.virtual_push(cc.builder.CreateLoad(cc.module.getNamedGlobal("vreg_" + 
-					std::to_string(instr.operand))));
-            }
-        },
-        {
-            vm::opcodes::PushConst,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				cc.virtual_push(cc.builder.getInt64(instr.operand));
-            }
-        },
-        {
-            vm::opcodes::Read8,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				auto* t = cc.virtual_pop();
-				auto* t_ptr = cc.builder.CreateIntToPtr(t, cc.builder.getInt8PtrTy());
-				auto* t_deref = cc.builder.CreateLoad(t_ptr);
-				auto* rs = cc.builder.CreateIntCast(t_deref, cc.builder.getInt64Ty(), false);
-				cc.virtual_push(rs);
-            }
-        },
-        {
-            vm::opcodes::Read64,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				auto* t = cc.virtual_pop();
-				auto* t_ptr = cc.builder.CreateIntToPtr(t, cc.builder.getInt64Ty()->getPointerTo());
-				auto* t_deref = cc.builder.CreateLoad(t_ptr);
-				auto* rs = cc.builder.CreateIntCast(t_deref, cc.builder.getInt64Ty(), false);
-				cc.virtual_push(rs);
-            }
-        },
-        {
-            vm::opcodes::Add,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				auto* r1 = cc.virtual_pop();
-				auto* r2 = cc.virtual_pop();
-				auto* rs = cc.builder.CreateAdd(r1, r2);
-				cc.virtual_push(rs);
-            }
-        },
-        {
-            vm::opcodes::Nand,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				auto* r1 = cc.virtual_pop();
-				auto* r2 = cc.virtual_pop();
-				auto* rs = cc.builder.CreateAnd(r1, r2);
-				rs = cc.builder.CreateNot(rs);
-				cc.virtual_push(rs);
-            }
-        },
-        {
-            vm::opcodes::Mul,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				auto* r1 = cc.virtual_pop();
-				auto* r2 = cc.virtual_pop();
-				auto* rs = cc.builder.CreateMul(r1, r2);
-				cc.virtual_push(rs);
-            }
-        },
-        {
-            vm::opcodes::Jnz,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				auto* cmp_r1 = cc.virtual_pop();
-				auto* cmp_r2 = cc.virtual_pop();
-				auto* new_rkey = cc.virtual_pop();
-				auto* new_bytecode = cc.virtual_pop();
-				auto* new_ror_key = cc.virtual_pop();
-
-				auto* f = cc.module.getFunction("main");
-
-				auto* cond = cc.builder.CreateICmpEQ(cmp_r1, cmp_r2);
-				auto* dst_t = llvm::BasicBlock::Create(cc.module.getContext(), 
-					std::string("loc_f_") + std::to_string(instr.vip + 1), f);
-				if (!cc.instructions.contains(instr.operand))
-				{
-					auto* dst_f = llvm::BasicBlock::Create(cc.module.getContext(), 
-						std::string("loc_f_") + std::to_string(instr.vip + 1), f);
-					cc.builder.CreateCondBr(cond, dst_t, dst_f);
-					cc.dead_branches.push_back(dst_f);
-				}
-				else
-				{
-					auto* i = cc.instructions[instr.operand];
-					auto* dst_f = i->getParent()->splitBasicBlock(i, "loc_f_" + std::to_string(instr.vip + 1));
-					cc.builder.CreateCondBr(cond, dst_t, dst_f);
-				}
-				cc.builder.SetInsertPoint(dst_t);
-            }
-        },
-        {
-            vm::opcodes::Exit,
-            [](const vm::instruction_t& instr, lifter& cc)
-            {
-				for (int i = 14; i >= 0; i--)
-				{
-					cc.set_preg(i, cc.virtual_pop());
-				}
-				cc.builder.CreateRetVoid();
-            }
-        }
-	};
-
-
-
-	lifter::lifter(llvm::Module& module) : module(module), ctx(module.getContext()), builder(module.getContext())
-	{
-		std::vector<llvm::Type*> reg_ty{ builder.getInt64Ty() };
-		reg_full_t = llvm::StructType::create(ctx, reg_ty, "RegisterR");
-
-		std::vector<llvm::Type*> input_types;
-		for (size_t i = 0; i < 15; i++)
-			input_types.push_back(reg_full_t);
-		// Create physical registers context struct
-		//
-		input_t = llvm::StructType::create(ctx, input_types, "ContextTy");
-		// Create function signature
-		//
-		function_t = llvm::FunctionType::get(builder.getVoidTy(), { input_t->getPointerTo() }, false);
-		// Create function
-		//
-		function = llvm::Function::Create(function_t, llvm::Function::ExternalLinkage, "main", module);
-		// Create first basic block and set insert point
-		//
-		auto* head = llvm::BasicBlock::Create(ctx, std::string("loc_") + std::to_string(0), function);
-		builder.SetInsertPoint(head);
-		// Create virtual registers
-		//
-		for (int i = 0; i < 15; i++)
-			utils::create_global(module, "vreg_" + std::to_string(i), builder.getInt64Ty());
-		// Create vm entry
-		//
-		for (size_t i = 0; i < 15; i++)
-			virtual_push(get_preg(i));
-	}
-
-	llvm::Value* lifter::get_preg(uint64_t idx)
-	{
-		std::vector<llvm::Value*> index{
-			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 64), 0),
-			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), idx),
-			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), 0),
-		};
-
-		auto* ptr = llvm::GetElementPtrInst::CreateInBounds(input_t, function->getArg(0), 
-			index, "", builder.GetInsertBlock());
-		auto p_ptr = builder.CreateLoad(ptr);
-		return builder.CreateBitCast(p_ptr, builder.getInt64Ty());
-	}
-
-	void lifter::set_preg(uint64_t idx, llvm::Value* v)
-	{
-		std::vector<llvm::Value*> index{
-			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 64), 0),
-			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), idx),
-			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), 0),
-		};
-
-		auto* ptr = llvm::GetElementPtrInst::CreateInBounds(input_t, function->getArg(0), 
-			index, "", builder.GetInsertBlock());
-		builder.CreateStore(v, ptr);
-	}
-
-	llvm::Value* lifter::virtual_pop()
-	{
-		auto v = stack.back();
-		stack.pop_back();
-		return builder.CreateLoad(v);
-	}
-
-	void lifter::virtual_push(llvm::Value* v)
-	{
-		auto t = temp_reg();
-		builder.CreateStore(v, t);
-		stack.push_back(t);
-	}
-
-	llvm::Value* lifter::temp_reg()
-	{
-		static int temp_reg_counter;
-		auto name = "temp_" + std::to_string(temp_reg_counter++);
-		return utils::create_global(module, name, builder.getInt64Ty());
-	}
-
-	void lifter::add_instruction(const vm::instruction_t& instr)
-	{
-		// Create nop so we can easily split blocks by vip
-		//
-		builder.CreateAdd(builder.getInt32(1337), builder.getInt32(1337));
-		instructions.insert({ instr.vip, &builder.GetInsertBlock()->back() });
-		// Make sure op is present
-		//
-		assert(handlers.contains(instr.op));
-		handlers.at(instr.op)(instr, *this);
-	}
-
-	void lifter::compile()
-	{
-		for (auto* br : dead_branches)
-		{
-			builder.SetInsertPoint(br);
-			builder.CreateBr(br);
-		}
-		
-		llvm::legacy::FunctionPassManager passmgr(&module);
-		passmgr.add(llvm::createPromoteMemoryToRegisterPass());
-		passmgr.add(llvm::createNewGVNPass());
-		passmgr.add(llvm::createReassociatePass());
-		passmgr.add(llvm::createDeadCodeEliminationPass());
-		passmgr.add(llvm::createInstructionCombiningPass());
-		passmgr.add(llvm::createDeadStoreEliminationPass());
-
-		passmgr.run(*module.getFunction("main"));
-
-		utils::dump_to_file(module, "bytecode");
-	}
+#include "lifter.h"
+#include "utils.h"
+#include "../ir/passes.h"
+#include "../stats.h"
+#include <chrono>
+#include <fstream>
+#include <mutex>
+
+namespace lifter
+{
+	using ir_instruction_lifter = std::function<void(const ir::inst_t&, llvm::Value*&, lifter&)>;
+	static std::unordered_map<ir::op_t, ir_instruction_lifter> handlers =
+	{
+        {
+            ir::op_t::Arg,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.get_preg(inst.imm);
+            }
+        },
+        {
+            ir::op_t::Const,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.getInt64(inst.imm);
+            }
+        },
+        {
+            ir::op_t::LoadVreg,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateLoad(cc.builder.getInt64Ty(), cc.get_vreg(inst.imm));
+            }
+        },
+        {
+            ir::op_t::StoreVreg,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				cc.builder.CreateStore(cc.values[inst.args[0]], cc.get_vreg(inst.imm));
+            }
+        },
+        {
+            ir::op_t::Read8,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				auto* t_ptr = cc.get_address(cc.values[inst.args[0]], cc.builder.getInt8Ty());
+				auto* t_deref = cc.builder.CreateLoad(t_ptr);
+				out = cc.builder.CreateIntCast(t_deref, cc.builder.getInt64Ty(), false);
+            }
+        },
+        {
+            ir::op_t::Read64,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				auto* t_ptr = cc.get_address(cc.values[inst.args[0]], cc.builder.getInt64Ty());
+				auto* t_deref = cc.builder.CreateLoad(t_ptr);
+				out = cc.builder.CreateIntCast(t_deref, cc.builder.getInt64Ty(), false);
+            }
+        },
+        {
+            ir::op_t::Add,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateAdd(cc.values[inst.args[0]], cc.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Nand,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				auto* rs = cc.builder.CreateAnd(cc.values[inst.args[0]], cc.values[inst.args[1]]);
+				out = cc.builder.CreateNot(rs);
+            }
+        },
+        {
+            ir::op_t::Not,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateNot(cc.values[inst.args[0]]);
+            }
+        },
+        {
+            ir::op_t::And,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateAnd(cc.values[inst.args[0]], cc.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Or,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateOr(cc.values[inst.args[0]], cc.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Xor,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateXor(cc.values[inst.args[0]], cc.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Andn,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateAnd(cc.builder.CreateNot(cc.values[inst.args[0]]), cc.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Sub,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateSub(cc.values[inst.args[0]], cc.values[inst.args[1]]);
+            }
+        },
+        {
+            ir::op_t::Neg,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateNeg(cc.values[inst.args[0]]);
+            }
+        },
+        {
+            ir::op_t::Mul,
+            [](const ir::inst_t& inst, llvm::Value*& out, lifter& cc)
+            {
+				out = cc.builder.CreateMul(cc.values[inst.args[0]], cc.values[inst.args[1]]);
+            }
+        },
+	};
+
+
+
+	lifter::lifter(llvm::Module& module) : module(module), ctx(module.getContext()), builder(module.getContext())
+	{
+		std::vector<llvm::Type*> reg_ty{ builder.getInt64Ty() };
+		reg_full_t = llvm::StructType::create(ctx, reg_ty, "RegisterR");
+
+		std::vector<llvm::Type*> input_types;
+		for (size_t i = 0; i < 15; i++)
+			input_types.push_back(reg_full_t);
+		// Create physical registers context struct
+		//
+		input_t = llvm::StructType::create(ctx, input_types, "ContextTy");
+		// Create function signature
+		//
+		function_t = llvm::FunctionType::get(builder.getVoidTy(), { input_t->getPointerTo() }, false);
+		// Create function
+		//
+		function = llvm::Function::Create(function_t, llvm::Function::ExternalLinkage, "main", module);
+		// Create first basic block and set insert point
+		//
+		auto* head = llvm::BasicBlock::Create(ctx, std::string("loc_") + std::to_string(0), function);
+		builder.SetInsertPoint(head);
+	}
+
+	llvm::Value* lifter::get_preg(uint64_t idx)
+	{
+		std::vector<llvm::Value*> index{
+			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 64), 0),
+			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), idx),
+			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), 0),
+		};
+
+		auto* ptr = llvm::GetElementPtrInst::CreateInBounds(input_t, function->getArg(0), 
+			index, "", builder.GetInsertBlock());
+		auto p_ptr = builder.CreateLoad(ptr);
+		return builder.CreateBitCast(p_ptr, builder.getInt64Ty());
+	}
+
+	void lifter::set_preg(uint64_t idx, llvm::Value* v)
+	{
+		std::vector<llvm::Value*> index{
+			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 64), 0),
+			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), idx),
+			llvm::ConstantInt::get(llvm::IntegerType::get(ctx, 32), 0),
+		};
+
+		auto* ptr = llvm::GetElementPtrInst::CreateInBounds(input_t, function->getArg(0), 
+			index, "", builder.GetInsertBlock());
+		builder.CreateStore(v, ptr);
+	}
+
+	llvm::AllocaInst* lifter::get_vreg(uint64_t idx)
+	{
+		if (auto it = vregs.find(idx); it != vregs.end())
+			return it->second;
+
+		// Allocas go first in the entry block so mem2reg promotes them. They start at
+		// zero like the globals they replace, a vreg read before any store stays defined.
+		//
+		auto& head = function->getEntryBlock();
+		llvm::IRBuilder<> entry(&head, head.begin());
+		auto* slot = entry.CreateAlloca(builder.getInt64Ty(), nullptr, "vreg_" + std::to_string(idx));
+		entry.CreateStore(entry.getInt64(0), slot);
+		vregs.emplace(idx, slot);
+		return slot;
+	}
+
+	llvm::Value* lifter::get_address(llvm::Value* address, llvm::Type* type)
+	{
+		// An inttoptr per read hides the stride from SCEV, byte loops would only ever be
+		// vectorized into gathers. Reads are offsets from one base instead, zero at run
+		// time but opaque to the optimizer so nothing is assumed about what it points to.
+		//
+		if (!memory)
+		{
+			auto& head = function->getEntryBlock();
+			llvm::IRBuilder<> entry(&head, head.begin());
+			auto* zero = llvm::InlineAsm::get(llvm::FunctionType::get(entry.getInt8PtrTy(), false), "xor $0, $0", "=r", false);
+			memory = entry.CreateCall(zero, {}, "memory");
+		}
+		auto* ptr = builder.CreateGEP(builder.getInt8Ty(), memory, address);
+		return builder.CreateBitCast(ptr, type->getPointerTo());
+	}
+
+	void lifter::add_block(const vm::block_t& block)
+	{
+		trace.blocks.push_back(block);
+	}
+
+	void lifter::add_instruction(const ir::function_t& fn, ir::value_t v)
+	{
+		const auto& inst = fn.insts[v];
+		// Make sure op is present
+		//
+		assert(handlers.contains(inst.op));
+		handlers.at(inst.op)(inst, values[v], *this);
+	}
+
+	void lifter::trap()
+	{
+		builder.CreateIntrinsic(llvm::Intrinsic::trap, {}, {});
+		builder.CreateUnreachable();
+	}
+
+	void lifter::jump_to(const ir::function_t& fn, const ir::edge_t& edge)
+	{
+		// Path the trace never reached, stops like the int3 the jitter emits
+		//
+		if (edge.block == ir::none)
+		{
+			trap();
+			return;
+		}
+
+		const auto& params = fn.blocks[edge.block].params;
+		assert(params.size() == edge.args.size());
+		for (size_t i = 0; i < params.size(); i++)
+			llvm::cast<llvm::PHINode>(values[params[i]])->addIncoming(values[edge.args[i]], builder.GetInsertBlock());
+		builder.CreateBr(blocks[edge.block]);
+	}
+
+	static std::unique_ptr<llvm::TargetMachine> host_machine()
+	{
+		static std::once_flag native;
+		std::call_once(native, []
+			{
+				llvm::InitializeNativeTarget();
+				llvm::InitializeNativeTargetAsmPrinter();
+			});
+
+		std::string error;
+		auto triple = llvm::sys::getProcessTriple();
+		const auto* target = llvm::TargetRegistry::lookupTarget(triple, error);
+		if (!target)
+		{
+			std::printf("No target for %s: %s\n", triple.c_str(), error.c_str());
+			return nullptr;
+		}
+
+		llvm::SubtargetFeatures features;
+		llvm::StringMap<bool> host;
+		if (llvm::sys::getHostCPUFeatures(host))
+		{
+			for (const auto& feature : host)
+				features.AddFeature(feature.first(), feature.second);
+		}
+		return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(triple,
+			llvm::sys::getHostCPUName(), features.getString(), llvm::TargetOptions(), llvm::None));
+	}
+
+	void lifter::optimize()
+	{
+		stats::scope_t scope(stats::phase_t::LlvmPasses);
+
+		// Cost models and vector widths come from the CPU this runs on, the same one
+		// the ORC engine compiles for
+		//
+		auto machine = host_machine();
+		if (machine)
+		{
+			module.setTargetTriple(machine->getTargetTriple().str());
+			module.setDataLayout(machine->createDataLayout());
+		}
+
+		// Self time per pass, analyses are charged to the pass that asked for them and
+		// pass managers only to their own overhead
+		//
+		struct running_t
+		{
+			std::string name;
+			std::chrono::steady_clock::time_point start;
+			uint64_t nested = 0;
+		};
+		std::vector<running_t> running;
+		auto finish = [&]
+		{
+			auto pass = std::move(running.back());
+			running.pop_back();
+			auto ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - pass.start).count();
+			if (!running.empty())
+				running.back().nested += ns;
+			stats::add(pass.name, ns - pass.nested);
+		};
+
+		llvm::PassInstrumentationCallbacks callbacks;
+		if (stats::enabled())
+		{
+			callbacks.registerBeforeNonSkippedPassCallback([&](llvm::StringRef name, llvm::Any)
+				{
+					running.push_back({ name.str(), std::chrono::steady_clock::now() });
+				});
+			callbacks.registerAfterPassCallback([&](llvm::StringRef, llvm::Any, const llvm::PreservedAnalyses&)
+				{
+					finish();
+				});
+			callbacks.registerAfterPassInvalidatedCallback([&](llvm::StringRef, const llvm::PreservedAnalyses&)
+				{
+					finish();
+				});
+		}
+
+		llvm::PipelineTuningOptions tuning;
+		tuning.LoopUnrolling = opt_level >= 2;
+		tuning.LoopInterleaving = opt_level >= 2;
+		tuning.LoopVectorization = opt_level >= 2;
+		tuning.SLPVectorization = opt_level >= 2;
+
+#if LLVM_VERSION_MAJOR >= 14
+		using level_t = llvm::OptimizationLevel;
+		llvm::PassBuilder builder(machine.get(), tuning, llvm::None, &callbacks);
+#else
+		using level_t = llvm::PassBuilder::OptimizationLevel;
+		llvm::PassBuilder builder(false, machine.get(), tuning, llvm::None, &callbacks);
+#endif
+
+		// Destroyed in reverse, the module analyses go first
+		//
+		llvm::LoopAnalysisManager loops;
+		llvm::FunctionAnalysisManager functions;
+		llvm::CGSCCAnalysisManager sccs;
+		llvm::ModuleAnalysisManager modules;
+		builder.registerModuleAnalyses(modules);
+		builder.registerCGSCCAnalyses(sccs);
+		builder.registerFunctionAnalyses(functions);
+		builder.registerLoopAnalyses(loops);
+		builder.crossRegisterProxies(loops, functions, sccs, modules);
+
+		llvm::ModulePassManager passes;
+		switch (opt_level)
+		{
+		case 0:
+			// Phis and vreg allocas only, the output stays close to the trace
+			//
+			passes.addPass(llvm::createModuleToFunctionPassAdaptor(llvm::PromotePass()));
+			break;
+		case 1:
+			passes = builder.buildPerModuleDefaultPipeline(level_t::O1);
+			break;
+		case 2:
+			passes = builder.buildPerModuleDefaultPipeline(level_t::O2);
+			break;
+		default:
+			passes = builder.buildPerModuleDefaultPipeline(level_t::O3);
+			break;
+		}
+		passes.run(module, modules);
+	}
+
+	bool lifter::compile(const std::string& name)
+	{
+		auto built = ir::build(trace);
+		if (!built)
+			return false;
+		auto& fn = *built;
+		ir::optimize(fn);
+
+		stats::scope_t lift(stats::phase_t::Lift);
+
+		// Entry block lives in the head created with the function
+		//
+		blocks.assign(fn.blocks.size(), nullptr);
+		values.assign(fn.insts.size(), nullptr);
+		blocks[0] = builder.GetInsertBlock();
+		for (size_t b = 1; b < fn.blocks.size(); b++)
+		{
+			const auto& block = fn.blocks[b];
+			if (!block.live)
+				continue;
+			blocks[b] = llvm::BasicBlock::Create(ctx, "loc_" + std::to_string(block.vip), function);
+
+			// Phis exist before any edge is lifted, back edges included
+			//
+			builder.SetInsertPoint(blocks[b]);
+			for (auto param : block.params)
+				values[param] = builder.CreatePHI(builder.getInt64Ty(), 2);
+		}
+
+		for (size_t b = 0; b < fn.blocks.size(); b++)
+		{
+			const auto& block = fn.blocks[b];
+			if (!block.live)
+				continue;
+
+			builder.SetInsertPoint(blocks[b]);
+			for (auto v : block.body)
+				add_instruction(fn, v);
+
+			switch (block.exit)
+			{
+			case ir::exit_t::Jump:
+				jump_to(fn, block.edges[0]);
+				break;
+			case ir::exit_t::Branch:
+			{
+				// Both edges go through a stub block, so a target reached by both still has
+				// one predecessor per edge for its phis
+				//
+				auto* cond = builder.CreateICmpEQ(values[block.lhs], values[block.rhs]);
+				auto* dst_f = llvm::BasicBlock::Create(ctx,
+					std::string("loc_f_") + std::to_string(block.vip), function);
+				auto* dst_t = llvm::BasicBlock::Create(ctx,
+					std::string("loc_t_") + std::to_string(block.vip), function);
+				builder.CreateCondBr(cond, dst_f, dst_t);
+
+				builder.SetInsertPoint(dst_f);
+				jump_to(fn, block.edges[0]);
+				builder.SetInsertPoint(dst_t);
+				jump_to(fn, block.edges[1]);
+				break;
+			}
+			case ir::exit_t::Return:
+				for (int i = 14; i >= 0; i--)
+				{
+					set_preg(i, values[block.values[i]]);
+				}
+				builder.CreateRetVoid();
+				break;
+			case ir::exit_t::Trap:
+				// Path ended on something we could not decode
+				//
+				trap();
+				break;
+			}
+		}
+		
+		lift.stop();
+		optimize();
+
+		stats::scope_t scope(stats::phase_t::Write);
+		utils::dump_to_file(module, name);
+		return true;
+	}
 }
\ No newline at end of file
@@ -1,59 +1,100 @@
-#pragma once
-#pragma warning( push )
-#pragma warning(disable : 4624)
-#pragma warning(disable : 4996)
-#pragma warning(disable : 4244)
-#pragma warning(disable : 4267)
-#pragma warning(disable : 4146)
-#include <llvm/Support/raw_ostream.h>
-#include <llvm/IR/DerivedTypes.h>
-#include <llvm/IR/Instructions.h>
-#include <llvm/IR/InlineAsm.h>
-#include <llvm/IR/IRBuilder.h>
-#include <llvm/IR/Module.h>
-#include <llvm/IR/NoFolder.h>
-#include <llvm/IR/IRPrintingPasses.h>
-#include <llvm/IR/LegacyPassManager.h>
-#include <llvm/Pass.h>
-#include <llvm/Passes/PassBuilder.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/Transforms/Utils.h>
-
-#pragma warning( pop )
-#include <memory>
-
-#include "../vm.h"
-
-namespace lifter
-{
-	struct lifter
-	{
-		llvm::FunctionType* function_t = nullptr;
-		llvm::Function* function = nullptr;
-		llvm::Type* reg_full_t = nullptr;
-		llvm::Type* input_t = nullptr;
-		llvm::Module& module;
-		llvm::LLVMContext& ctx;
-		llvm::IRBuilder<llvm::NoFolder> builder;
-		
-		std::unordered_map<uint64_t, llvm::Instruction*> instructions;
-		std::vector<llvm::Value*> stack;
-		std::vector<llvm::BasicBlock*> dead_branches;
-
-		lifter(llvm::Module& module);
-
-		llvm::Value* get_preg(uint64_t idx);
-		void set_preg(uint64_t idx, llvm::Value* v);
-
-		llvm::Value* virtual_pop();
-		void virtual_push(llvm::Value* v);
-
-		llvm::Value* temp_reg();
-
-		void add_instruction(const vm::instruction_t& instr);
-
-		void compile();
-	};
+#pragma once
+#pragma warning( push )
+#pragma warning(disable : 4624)
+#pragma warning(disable : 4996)
+#pragma warning(disable : 4244)
+#pragma warning(disable : 4267)
+#pragma warning(disable : 4146)
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/InlineAsm.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/NoFolder.h>
+#include <llvm/IR/IRPrintingPasses.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Pass.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Utils.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Target/TargetMachine.h>
+#if LLVM_VERSION_MAJOR >= 14
+#include <llvm/MC/TargetRegistry.h>
+#else
+#include <llvm/Support/TargetRegistry.h>
+#endif
+
+#pragma warning( pop )
+#include <memory>
+#include <unordered_map>
+
+#include "../vm.h"
+#include "../explorer.h"
+#include "../ir/ir.h"
+
+namespace lifter
+{
+	struct lifter
+	{
+		llvm::FunctionType* function_t = nullptr;
+		llvm::Function* function = nullptr;
+		llvm::Type* reg_full_t = nullptr;
+		llvm::Type* input_t = nullptr;
+		llvm::Module& module;
+		llvm::LLVMContext& ctx;
+		llvm::IRBuilder<llvm::NoFolder> builder;
+
+		// 0 only promotes the vreg allocas, 1 to 3 are LLVM's default pipelines for the
+		// host CPU. Loop unrolling and both vectorizers start at 2.
+		//
+		unsigned opt_level = 2;
+
+		// One alloca per vreg in the entry block, created on first use
+		//
+		std::unordered_map<uint64_t, llvm::AllocaInst*> vregs;
+		// Base every Read8 and Read64 address is an offset from
+		//
+		llvm::Value* memory = nullptr;
+
+		// Blocks are collected as they are traced and lifted at once,
+		// joins and loops need the whole trace to build the IR
+		//
+		vm::trace_t trace;
+
+		// One basic block per IR block and one LLVM value per IR value. Block params
+		// are phis, every edge adds its args as incoming values.
+		//
+		std::vector<llvm::BasicBlock*> blocks;
+		std::vector<llvm::Value*> values;
+
+		lifter(llvm::Module& module);
+
+		llvm::Value* get_preg(uint64_t idx);
+		void set_preg(uint64_t idx, llvm::Value* v);
+
+		llvm::AllocaInst* get_vreg(uint64_t idx);
+		llvm::Value* get_address(llvm::Value* address, llvm::Type* type);
+
+		void add_block(const vm::block_t& block);
+
+		void add_instruction(const ir::function_t& fn, ir::value_t v);
+		void jump_to(const ir::function_t& fn, const ir::edge_t& edge);
+		// llvm.trap, so passes can't treat the path as dead and drop the branch into it
+		//
+		void trap();
+
+		void optimize();
+		// False if the trace does not build into IR, nothing is written then
+		//
+		bool compile(const std::string& name = "bytecode");
+	};
 }
\ No newline at end of file
@@ -1,15 +1,32 @@
 #include "vm.h"
 #include "matcher.h"
+#include "handlers.h"
+#include "explorer.h"
+#include "trace_cache.h"
+#include "batch.h"
+#include "entry.h"
+#include "knowledge.h"
 #include "jitter/jitter.h"
 #include "lifter/lifter.h"
-#include <fstream>
-
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
+#include "image.h"
+#include "rewriter.h"
+#include "bench.h"
+#include "interp.h"
+#include "lifter/engine.h"
+#include "stats.h"
+#include "ir/passes.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <thread>
 
 static constexpr uint64_t vm_entry_offset = 0x2C07C;
 static constexpr uint64_t vip = 0x140067050;
 static constexpr uint64_t rkey = 0x1337DEAD6969CAFE;
+// The host program stores the PEB here before calling the entry, the VM reads
+// BeingDebugged through it
+//
+static constexpr uint64_t peb_slot = 0x1400686E8;
 
 void print_instruction(vm::instruction_t& instr)
 {
@@ -33,94 +50,310 @@ void print_instruction(vm::instruction_t& instr)
 
 int main(int argc, const char** argv)
 {
-    if (argc != 3)
+    // Needs no binary, checks the IR rewrites against the chains they replace
+    //
+    if (argc == 2 && !std::strcmp(argv[1], "-selftest"))
+        return ir::check_idioms() ? 0 : 1;
+
+    if (argc < 3)
     {
-        std::printf("Usage: %s vm.exe -llvm or -asmjit\n", argv[0]);
+        std::printf("Usage: %s vm.exe [-llvm] [-O0|-O1|-O2|-O3] [-asmjit] [-assembler] [-bench iterations] [-db handlers.db] [-v level] [-stats out.json]\n", argv[0]);
+        std::printf("       %s -batch manifest.txt [-llvm] [-O0|-O1|-O2|-O3] [-asmjit] [-assembler] [-db handlers.db] [-v level] [-stats out.json]\n", argv[0]);
+        std::printf("       %s vm.exe -scan [-llvm] [-O0|-O1|-O2|-O3] [-asmjit] [-assembler] [-db handlers.db] [-v level] [-stats out.json]\n", argv[0]);
+        std::printf("       %s -selftest\n", argv[0]);
         return 0;
     }
 
-    bool is_llvm = !std::strcmp(argv[2], "-llvm");
-    bool is_jit = !std::strcmp(argv[2], "-asmjit");
+    bool is_llvm = false;
+    bool is_jit = false;
+    bool is_scan = false;
+    bool is_assembler = false;
+    std::string db_path = "handlers.db";
+    std::string stats_path;
+    int verbosity = 0;
+    size_t bench_iterations = 0;
+    unsigned opt_level = 2;
+    for (int i = 2; i < argc; i++)
+    {
+        if (!std::strcmp(argv[i], "-db") && i + 1 < argc)
+            db_path = argv[++i];
+        if (!std::strcmp(argv[i], "-v") && i + 1 < argc)
+            verbosity = std::atoi(argv[++i]);
+        if (!std::strcmp(argv[i], "-stats") && i + 1 < argc)
+            stats_path = argv[++i];
+        if (!std::strcmp(argv[i], "-bench") && i + 1 < argc)
+            bench_iterations = std::strtoull(argv[++i], nullptr, 10);
+        if (argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3])
+            opt_level = argv[i][2] - '0';
+        is_llvm |= !std::strcmp(argv[i], "-llvm");
+        is_jit |= !std::strcmp(argv[i], "-asmjit");
+        is_scan |= !std::strcmp(argv[i], "-scan");
+        is_assembler |= !std::strcmp(argv[i], "-assembler");
+    }
+    // Single pass asmjit backend, implies -asmjit
+    //
+    is_jit |= is_assembler;
+    auto backend = is_assembler ? jitter::backend_t::Assembler : jitter::backend_t::Compiler;
+
+    // Nothing is timed or counted below level 1, a JSON report needs at least that
+    //
+    if (!stats_path.empty())
+        verbosity = std::max(verbosity, 1);
+    stats::verbosity = verbosity;
+    auto report = [&]
+    {
+        if (!stats::enabled())
+            return;
+        stats::print();
+        if (!stats_path.empty() && !stats::save(stats_path))
+            std::printf("Failed to save %s\n", stats_path.c_str());
+    };
+
+    batch::options_t options;
+    options.llvm = is_llvm;
+    options.opt_level = opt_level;
+    options.jit = is_jit;
+    options.backend = backend;
+    options.threads = std::thread::hardware_concurrency();
+
+    // Handlers classified by earlier runs, on any binary, skip pattern matching
+    //
+    vm::knowledge_base knowledge;
+    if (!knowledge.load(db_path))
+        return 1;
+    options.knowledge = &knowledge;
+
+    auto run_batch = [&](const std::vector<batch::job_t>& jobs)
+    {
+        auto ok = batch::run(jobs, options);
+        if (!knowledge.save(db_path))
+            std::printf("Failed to save %s\n", db_path.c_str());
+        report();
+        return ok ? 0 : 1;
+    };
+
+    if (!std::strcmp(argv[1], "-batch"))
+    {
+        std::vector<batch::job_t> jobs;
+        if (!batch::parse_manifest(argv[2], jobs))
+            return 1;
+
+        return run_batch(jobs);
+    }
+
+    auto image = pe::image::load(argv[1]);
+    if (!image)
+    {
+        std::printf("Failed to load %s\n", argv[1]);
+        return 1;
+    }
 
-    LoadLibraryExA(argv[1], NULL, DONT_RESOLVE_DLL_REFERENCES);
+    if (is_scan)
+    {
+        // Devirtualize every entry found in the image, no hardcoded parameters
+        //
+        std::vector<batch::job_t> jobs;
+        for (const auto& entry : vm::find_entries(*image))
+        {
+            std::printf("entry 0x%llx offset 0x%llx vip 0x%llx rkey 0x%llx ror %llu\n",
+                (unsigned long long)entry.address, (unsigned long long)entry.offset, (unsigned long long)entry.vip,
+                (unsigned long long)entry.rkey, (unsigned long long)entry.ror_key);
+
+            batch::job_t job;
+            job.binary = argv[1];
+            job.entry_offset = entry.offset;
+            job.vip = entry.vip;
+            job.rkey = entry.rkey;
+            job.ror_key = entry.ror_key;
+            job.vip_r = entry.vip_r;
+            job.vreg_r = entry.vreg_r;
+            job.rkey_r = entry.rkey_r;
+            jobs.push_back(std::move(job));
+        }
+
+        if (jobs.empty())
+        {
+            std::printf("No VM entries found in %s\n", argv[1]);
+            return 1;
+        }
+        return run_batch(jobs);
+    }
 
     llvm::LLVMContext ctx;
     llvm::Module program("Module", ctx);
     auto lifter = lifter::lifter(program);
+    lifter.opt_level = opt_level;
 
-    auto jitter = jitter::jitter();
+    auto jitter = jitter::jitter(backend);
 
-    auto state = vm::state(vip, rkey);
+    auto state = vm::state(*image, vip, rkey);
+    auto handlers = vm::handler_cache();
+    handlers.knowledge = &knowledge;
 
     // Initial ror key
     //
     uint64_t ror_key = 5;
 
-    while (true)
+    // Reuse the trace of a previous run if nothing it depends on changed
+    //
+    auto trace_key = vm::make_trace_key(state, ror_key, vm_entry_offset, knowledge);
+    auto trace_path = std::string(argv[1]) + ".trace";
+    auto cached = vm::load_trace(trace_path, trace_key);
+
+    // The interpreter runs from the trace itself, kept only when benchmarking
+    //
+    vm::trace_t recorded;
+    auto produce = [&](const vm::block_sink_t& consumer)
     {
-        // Save instruction VIP for later use
+        auto sink = [&](const vm::block_t& block)
+        {
+            if (bench_iterations)
+                recorded.blocks.push_back(block);
+            consumer(block);
+        };
+
+        if (cached)
+        {
+            for (const auto& block : cached->blocks)
+                sink(block);
+            return;
+        }
+
+        // Populate the handler table from a scan of the image before tracing
         //
-        vm::vip_t temp_vip = state.vip;
-        auto next_handler = state.decrypt_vip(ror_key);
-        auto routine = x86::unroll(next_handler);
-        // Extract ror keys
+        handlers.prefetch(state, vm::find_handlers(*image), std::thread::hardware_concurrency());
+        const auto prefetched = handlers.size();
+
+        // Walk every reachable path on all cores, blocks come out in a fixed order
         //
-        auto ror_keys = vm::extract_ror_keys(routine);
+        vm::trace_t trace;
+        auto explorer = vm::explorer(handlers, std::thread::hardware_concurrency());
+        explorer.run(state, ror_key, [&](const vm::block_t& block)
+            {
+                trace.blocks.push_back(block);
+                sink(block);
+            });
 
-        uint64_t operand = 0;
+        // Every handler the trace reaches should have come from the scan, a miss is a
+        // dispatch form find_handlers doesn't know
+        //
+        if (handlers.size() > prefetched)
+            std::printf("%zu traced handlers were missed by the scan\n", handlers.size() - prefetched);
+
+        // Handlers learned on the way are part of what the trace was decoded with
+        //
+        trace_key.knowledge = knowledge.generation;
+        if (!vm::is_complete(trace))
+            std::printf("Trace stops at undecoded handlers, not caching it\n");
+        else if (!vm::save_trace(trace_path, trace_key, trace))
+            std::printf("Failed to save %s\n", trace_path.c_str());
+        if (!knowledge.save(db_path))
+            std::printf("Failed to save %s\n", db_path.c_str());
+    };
 
-        if (ror_keys.size() > 1)
+    produce([&](const vm::block_t& block)
         {
-            // Extract operand
-            //
-            assert(ror_keys.size() == 2);
-            operand = state.decrypt_vip(ror_keys[0]);
+            if (is_llvm) lifter.add_block(block);
+            if (is_jit) jitter.add_block(block);
+        });
+
+    // Both backends only read the shared trace and own their context, so with both
+    // requested the LLVM build runs on its own thread alongside asmjit
+    //
+    bool lifted = true;
+    std::thread llvm_thread;
+    if (is_llvm && is_jit)
+        llvm_thread = std::thread([&] { lifted = lifter.compile(); });
+    else if (is_llvm)
+        lifted = lifter.compile();
+
+    asmjit::CodeBuffer* f = nullptr;
+    if (is_jit)
+    {
+        size_t instructions = 0;
+        for (const auto& block : jitter.trace.blocks)
+            instructions += block.instructions.size();
+
+        auto start = std::chrono::steady_clock::now();
+        f = jitter.compile();
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (f && stats::enabled())
+        {
+            std::printf("asmjit: %zu vm instructions in %.3f ms, %.2f M/s\n",
+                instructions, elapsed * 1e3, instructions / elapsed / 1e6);
         }
+    }
 
-        auto instr = vm::match(state, routine, operand);
-        instr.vip = temp_vip;
+    if (llvm_thread.joinable())
+        llvm_thread.join();
 
-        // Jit instruction
-        //
-        if (is_llvm) lifter.add_instruction(instr);
-        if (is_jit) jitter.add_instruction(instr);
+    if (!lifted || (is_jit && !f))
+    {
+        std::printf("Failed to build IR for the trace\n");
+        report();
+        return 1;
+    }
 
-        // Process control flow
+    if (is_jit)
+    {
+        // Copy the file and redirect the entry to the new section
         //
-        if (instr.op == vm::opcodes::Invalid)
+        stats::scope_t scope(stats::phase_t::Write);
+        pe::rewriter rewriter(*image);
+        rewriter.add(vm_entry_offset, std::vector<uint8_t>(f->data(), f->data() + f->size()));
+        if (!rewriter.write(argv[1], "output.exe"))
         {
-            routine.dump();
-            break;
+            scope.stop();
+            report();
+            return 1;
         }
-        else if (instr.op == vm::opcodes::Jnz)
+    }
+
+    if (bench_iterations)
+    {
+        // Found again for the global its vreg file pointer is loaded from
+        //
+        vm::entry_t entry;
+        entry.address = image->offset_to_va(vm_entry_offset).value_or(0);
+        for (const auto& found : vm::find_entries(*image))
         {
-            ror_key = vm::extact_jcc_key(routine);
+            if (found.offset == vm_entry_offset)
+                entry = found;
         }
-        else if (instr.op == vm::opcodes::Exit)
+
+        // The original entry is the reference both backends are checked against
+        //
+        bench::harness harness;
+        lifter::engine engine;
+        bool ok = harness.map(*image, entry) && harness.provide(peb_slot, 0x1000) &&
+            harness.add("vm", reinterpret_cast<const void*>(entry.address), bench::abi_t::Registers);
+        if (ok && is_jit)
         {
-            break;
+            const auto& f = jitter.code.sectionById(0)->buffer();
+            ok = harness.add(is_assembler ? "assembler" : "compiler", f.data(), f.size(), bench::abi_t::Registers);
         }
-        else
+        if (ok && is_llvm)
+            ok = engine.load(program) && harness.add("llvm", engine.lookup("main"), bench::abi_t::Context);
+
+        // The interpreter reads the file as it is on disk, where the PEB pointer the host
+        // program stores is still null. A zeroed page at 0 stands in for the PEB.
+        //
+        vm::interpreter interp(*image);
+        std::vector<uint64_t> vregs;
+        interp.map(0, std::vector<uint8_t>(0x1000));
+        if (ok)
         {
-            // Last key is always next handler decryption key
-            //
-            ror_key = ror_keys.back();
+            ok = interp.load(recorded) && harness.add("interp", [&](uint64_t* context)
+                {
+                    vm::interpreter::context_t regs;
+                    std::copy_n(context, regs.size(), regs.begin());
+                    auto result = interp.run(regs, vregs);
+                    std::copy_n(result.regs.begin(), regs.size(), context);
+                });
         }
+        if (ok)
+            bench::print(harness.run(bench::make_inputs(16), bench_iterations));
     }
 
-    if (is_llvm) lifter.compile();
-    
-    if (is_jit)
-    {
-        auto& f = jitter.compile();
-        // Copy and patch file
-        //
-        std::ifstream is(argv[1], std::ios::in | std::ifstream::binary);
-        std::ofstream of("output.exe", std::ios::out | std::ios::binary);
-        of << is.rdbuf();
-        of.seekp(vm_entry_offset);
-        of.write((const char*)f.data(), f.size());
-        of.close();
-        is.close();
-    }
+    report();
 }
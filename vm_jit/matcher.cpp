@@ -1,26 +1,155 @@
 #include "matcher.h"
 #include "vm.h"
+#include "pattern.h"
+
+#include <cstring>
 
 namespace vm
 {
-    using virt_matcher_t = std::function<bool(const state&, const x86::routine_t&)>;
-    using virt_emulator_t = std::function<void(state&, instruction_t&)>;
+    namespace p = x86::pattern;
+
+    // Handler building blocks, slot 0 is seeded with the vreg base register
+    //
+    using pop_vreg_p = p::ins<ZYDIS_MNEMONIC_POP, p::mem_cap<0>>;
+    using push_vreg_p = p::ins<ZYDIS_MNEMONIC_PUSH, p::mem_cap<0>>;
+    using pop_reg_p = p::ins<ZYDIS_MNEMONIC_POP, p::any_reg>;
+    using push_const_p = p::seq<
+        p::ins<ZYDIS_MNEMONIC_XOR, p::any_reg, p::reg_cap<1>>,
+        p::ins<ZYDIS_MNEMONIC_PUSH, p::reg_cap<1>>
+    >;
+    using read8_p = p::ins<ZYDIS_MNEMONIC_MOVZX, p::any_reg, p::mem<ZYDIS_REGISTER_RAX>>;
+    using read64_p = p::ins<ZYDIS_MNEMONIC_MOV, p::reg<ZYDIS_REGISTER_RAX>, p::mem<ZYDIS_REGISTER_RAX>>;
+    using add_p = p::ins<ZYDIS_MNEMONIC_ADD, p::any_reg, p::any_reg>;
+    using and_p = p::ins<ZYDIS_MNEMONIC_AND, p::any_reg, p::any_reg>;
+    using mul_p = p::ins<ZYDIS_MNEMONIC_MUL, p::any_reg>;
+
+    features_t extract_features(const state& state, const x86::routine_t& routine)
+    {
+        features_t out;
+
+        p::captures_t vreg;
+        vreg.reg[0] = state.vreg_r;
+
+        for (size_t i = 0; i < routine.size(); i++)
+        {
+            switch (routine.mnemonics[i])
+            {
+            case ZYDIS_MNEMONIC_POP:
+                if (p::match_at<pop_reg_p>(routine, i))
+                {
+                    // Binary handlers operate right after fetching both arguments
+                    //
+                    if (++out.pop_reg == 2)
+                    {
+                        if (p::match_at<add_p>(routine, i + 1) ||
+                            p::match_at<and_p>(routine, i + 1) ||
+                            p::match_at<mul_p>(routine, i + 1))
+                            out.binary_op = routine.mnemonics[i + 1];
+                    }
+                }
+                else if (p::match_at<pop_vreg_p>(routine, i, vreg))
+                {
+                    out.pop_vreg = true;
+                }
+                break;
+            case ZYDIS_MNEMONIC_PUSH:
+                if (routine[i].is(ZYDIS_MNEMONIC_PUSH, { ZYDIS_OPERAND_TYPE_REGISTER }))
+                {
+                    // Constant is pushed straight out of the operand decryption
+                    //
+                    if (++out.push_reg == 1)
+                    {
+                        out.push_const = i > 0 &&
+                            p::match_at<push_const_p>(routine, i - 1) &&
+                            !(i + 1 < routine.size() && routine.mnemonics[i + 1] == ZYDIS_MNEMONIC_RET);
+                    }
+                }
+                else if (p::match_at<push_vreg_p>(routine, i, vreg))
+                {
+                    out.push_vreg = true;
+                }
+                break;
+            case ZYDIS_MNEMONIC_MOVZX:
+                out.read8 |= p::match_at<read8_p>(routine, i);
+                break;
+            case ZYDIS_MNEMONIC_MOV:
+                out.read64 |= p::match_at<read64_p>(routine, i);
+                break;
+            case ZYDIS_MNEMONIC_CMOVNZ:
+                out.cmovnz = true;
+                break;
+            case ZYDIS_MNEMONIC_RET:
+                out.ret = true;
+                break;
+            default:
+                break;
+            }
+        }
+        return out;
+    }
+
+    opcodes classify(const features_t& f)
+    {
+        // Fixed decision order, most specific shapes first so overlapping
+        // predicates (PushConst / Add / Nand all push a register) can't race.
+        //
+        if (f.pop_vreg)
+            return opcodes::PopVreg;
+        if (f.push_vreg)
+            return opcodes::PushVreg;
+        if (f.read8)
+            return opcodes::Read8;
+        if (f.read64)
+            return opcodes::Read64;
+        if (f.pop_reg >= 15)
+            return opcodes::Exit;
+        if (f.pop_reg >= 4 && f.cmovnz)
+            return opcodes::Jnz;
+
+        if (f.pop_reg >= 2)
+        {
+            switch (f.binary_op)
+            {
+            case ZYDIS_MNEMONIC_ADD: return opcodes::Add;
+            case ZYDIS_MNEMONIC_AND: return opcodes::Nand;
+            case ZYDIS_MNEMONIC_MUL: return opcodes::Mul;
+            default: break;
+            }
+        }
+
+        if (f.push_const)
+            return opcodes::PushConst;
+
+        return opcodes::Invalid;
+    }
 
-    static bool is_pop_reg(const x86::zydis_instruction_t& instr)
+    opcodes classify(const state& state, const x86::routine_t& routine)
     {
-        return instr.mnemonic == ZYDIS_MNEMONIC_POP &&
-            instr.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER;
+        return classify(extract_features(state, routine));
     }
 
-    static bool is_push_reg(const x86::zydis_instruction_t& instr)
+    static uint64_t pop(state& state)
     {
-        return instr.mnemonic == ZYDIS_MNEMONIC_PUSH &&
-            instr.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER;
+        auto v = state.stack.back();
+        state.stack.pop_back();
+        return v;
     }
 
-    static std::unordered_map<opcodes, std::pair<virt_matcher_t, virt_emulator_t>> instructions =
+    static uint64_t read_image(const state& state, uint64_t address, size_t size)
     {
+        // Unknown addresses read as zero, only matters for values that end up as branch keys
+        //
+        uint64_t v = 0;
+        if (const auto* ptr = state.image->translate(address, size))
+            std::memcpy(&v, ptr, size);
+        return v;
+    }
+
+    void emulate(state& state, instruction_t& instr)
+    {
+        switch (instr.op)
         {
+        case opcodes::PopVreg:
             /*
             *   mov     rcx, [r8]
             *   add     r8, 8
@@ -29,25 +158,13 @@ namespace vm
             *   xor     r10, rcx
             *   pop     qword ptr [r9+rcx*8]
             */
-            opcodes::PopVreg,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    return routine.next([&](const x86::zydis_instruction_t& instr) -> bool
-                        {
-                            return instr.mnemonic == ZYDIS_MNEMONIC_POP &&
-                                instr.operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY &&
-                                instr.operands[0].mem.base == state.vreg_r;
-                        }
-                    ) != -1;
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    state.stack.pop_back();
-                }
-            }
-        },
         {
+            auto v = pop(state);
+            if (instr.operand < state.vregs.size())
+                state.vregs[instr.operand] = v;
+            break;
+        }
+        case opcodes::PushVreg:
             /*
             *   mov     rcx, [r8]
             *   add     r8, 8
@@ -56,25 +173,9 @@ namespace vm
             *   xor     r10, rcx
             *   push    qword ptr [r9+rcx*8]
             */
-            opcodes::PushVreg,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    return routine.next([&](const x86::zydis_instruction_t& instr) -> bool
-                        {
-                            return instr.mnemonic == ZYDIS_MNEMONIC_PUSH &&
-                                instr.operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY &&
-                                instr.operands[0].mem.base == state.vreg_r;
-                        }
-                    ) != -1;
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    state.stack.push_back(instr.operand);
-                }
-            }
-        },
-        {
+            state.stack.push_back(instr.operand < state.vregs.size() ? state.vregs[instr.operand] : 0);
+            break;
+        case opcodes::PushConst:
             /*
             *   mov     rcx, [r8]
             *   add     r8, 8
@@ -83,98 +184,38 @@ namespace vm
             *   xor     r10, rcx
             *   push    rcx
             */
-            opcodes::PushConst,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    auto i_push_reg = routine.next(is_push_reg);
-                    if (i_push_reg == -1)
-                        return false;
-
-                    return routine[(size_t)i_push_reg - 1].is(ZYDIS_MNEMONIC_XOR, {ZYDIS_OPERAND_TYPE_REGISTER, ZYDIS_OPERAND_TYPE_REGISTER}) &&
-                        !routine[(size_t)i_push_reg + 1].is(ZYDIS_MNEMONIC_RET);
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    state.stack.push_back(instr.operand);
-                }
-            }
-
-        },
-        {
+            state.stack.push_back(instr.operand);
+            break;
+        case opcodes::Read8:
             /*
             *   pop     rax
             *   movzx   rax, byte ptr [rax]
             *   push    rax
             */
-            opcodes::Read8,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    return routine.next([&](const x86::zydis_instruction_t& instr) -> bool
-                        {
-                            return instr.mnemonic == ZYDIS_MNEMONIC_MOVZX &&
-                                instr.operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY &&
-                                instr.operands[1].mem.base == ZYDIS_REGISTER_RAX;
-                        }
-                    ) != -1;
-                },
-                [](state& state, instruction_t& instr)
-                {
-
-                }
-            }
-        },
-        {
+            state.stack.push_back(read_image(state, pop(state), 1));
+            break;
+        case opcodes::Read64:
             /*
             *   pop     rax
             *   mov     rax, [rax]
             *   push    rax
             */
-            opcodes::Read64,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    return routine.next([&](const x86::zydis_instruction_t& instr) -> bool
-                        {
-                            return instr.mnemonic == ZYDIS_MNEMONIC_MOV &&
-                                instr.operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY &&
-                                instr.operands[1].mem.base == ZYDIS_REGISTER_RAX &&
-                                instr.operands[0].reg.value == ZYDIS_REGISTER_RAX;
-                        }
-                    ) != -1;
-                },
-                [](state& state, instruction_t& instr)
-                {
-
-                }
-            }
-        },
-        {
+            state.stack.push_back(read_image(state, pop(state), 8));
+            break;
+        case opcodes::Add:
             /*
             *   pop     rax
             *   pop     rbx
             *   add     rax, rbx
             *   push    rax
             */
-            opcodes::Add,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    auto i_pop_r1 = routine.next(is_pop_reg);
-                    auto i_pop_r2 = routine.next(is_pop_reg, i_pop_r1 + 1);
-                    if (i_pop_r1 == -1 || i_pop_r2 == -1)
-                        return false;
-
-                    return routine[(size_t)i_pop_r2 + 1].is(ZYDIS_MNEMONIC_ADD, { ZYDIS_OPERAND_TYPE_REGISTER, ZYDIS_OPERAND_TYPE_REGISTER });
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    state.stack.pop_back();
-                }
-            }
-        },
         {
+            auto a = pop(state);
+            auto b = pop(state);
+            state.stack.push_back(a + b);
+            break;
+        }
+        case opcodes::Nand:
             /*
             *   pop     rax
             *   pop     rbx
@@ -182,89 +223,45 @@ namespace vm
             *   not     rax
             *   push    rax
             */
-            opcodes::Nand,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    auto i_pop_r1 = routine.next(is_pop_reg);
-                    auto i_pop_r2 = routine.next(is_pop_reg, i_pop_r1 + 1);
-                    if (i_pop_r1 == -1 || i_pop_r2 == -1)
-                        return false;
-
-                    return routine[(size_t)i_pop_r2 + 1].is(ZYDIS_MNEMONIC_AND, { ZYDIS_OPERAND_TYPE_REGISTER, ZYDIS_OPERAND_TYPE_REGISTER });
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    state.stack.pop_back();
-                }
-            }
-        },
         {
+            auto a = pop(state);
+            auto b = pop(state);
+            state.stack.push_back(~(a & b));
+            break;
+        }
+        case opcodes::Mul:
             /*
             *   pop     rax
             *   pop     rbx
             *   mul     rbx
             *   push    rax
             */
-            opcodes::Mul,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    auto i_pop_r1 = routine.next(is_pop_reg);
-                    auto i_pop_r2 = routine.next(is_pop_reg, i_pop_r1 + 1);
-                    if (i_pop_r1 == -1 || i_pop_r2 == -1)
-                        return false;
-
-                    return routine[(size_t)i_pop_r2 + 1].is(ZYDIS_MNEMONIC_MUL, { ZYDIS_OPERAND_TYPE_REGISTER });
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    state.stack.pop_back();
-                }
-            }
-        },
-        {
-            opcodes::Jnz,
-            {
-                /*
-                *   pop     rax
-                *   pop     rbx
-                *   pop     rdx
-                *   pop     rdi
-                *   pop     rsi
-                *   cmp     rax, rbx
-                *   mov     rcx, 13h
-                *   cmovnz  r10, rdx
-                *   cmovnz  r8, rdi
-                *   cmovnz  rcx, rsi
-                */
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    auto i_pop_r1 = routine.next(is_pop_reg);
-                    auto i_pop_r2 = routine.next(is_pop_reg, i_pop_r1 + 1);
-                    auto i_pop_r3 = routine.next(is_pop_reg, i_pop_r2 + 1);
-                    auto i_pop_r4 = routine.next(is_pop_reg, i_pop_r3 + 1);
-                    if (i_pop_r1 == -1 || i_pop_r2 == -1 || i_pop_r3 == -1 || i_pop_r4 == -1)
-                        return false;
-
-                    auto i_cmovne = routine.next([](const x86::zydis_instruction_t instr) -> bool
-                    {
-                            return instr.mnemonic == ZYDIS_MNEMONIC_CMOVNZ;
-                    });
-                    return i_cmovne != -1;
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    state.stack.pop_back();
-                    state.stack.pop_back();
-                    state.stack.pop_back();
-                    instr.operand = state.stack.back();
-                    state.stack.pop_back();
-                    state.stack.pop_back();
-                }
-            }
-        },
         {
+            auto a = pop(state);
+            auto b = pop(state);
+            state.stack.push_back(a * b);
+            break;
+        }
+        case opcodes::Jnz:
+            /*
+            *   pop     rax
+            *   pop     rbx
+            *   pop     rdx
+            *   pop     rdi
+            *   pop     rsi
+            *   cmp     rax, rbx
+            *   mov     rcx, 13h
+            *   cmovnz  r10, rdx
+            *   cmovnz  r8, rdi
+            *   cmovnz  rcx, rsi
+            */
+            pop(state);
+            pop(state);
+            instr.branch_rkey = pop(state);
+            instr.operand = pop(state);
+            instr.branch_ror_key = pop(state);
+            break;
+        case opcodes::Exit:
             /*
             *   pop     r15
             *   pop     r14
@@ -283,43 +280,20 @@ namespace vm
             *   pop     rax
             *   retn
             */
-            opcodes::Exit,
-            {
-                [](const state& state, const x86::routine_t& routine) -> bool
-                {
-                    int from = 0;
-                    for (int i = 0; i < 15; i++)
-                    {
-                        from = routine.next(is_pop_reg, from);
-                        if (from == -1)
-                            return false;
-                        from++;
-                    }
-                    return true;
-                },
-                [](state& state, instruction_t& instr)
-                {
-                    for (int i = 0; i < 15; i++)
-                        state.stack.pop_back();
-                }
-            }
+            for (int i = 0; i < 15; i++)
+                state.stack.pop_back();
+            break;
+        default:
+            break;
         }
-    };
+    }
 
     instruction_t match(state& state, const x86::routine_t& routine, uint64_t operand)
     {
         instruction_t out;
         out.operand = operand;
-
-        for (const auto& [op, matcher] : instructions)
-        {
-            if (matcher.first(state, routine))
-            {
-                out.op = op;
-                matcher.second(state, out);
-                return out;
-            }
-        }
+        out.op = classify(state, routine);
+        emulate(state, out);
         return out;
     }
-}
+}
\ No newline at end of file
@@ -4,5 +4,34 @@
 
 namespace vm
 {
+    // Handler properties collected in a single pass over the routine
+    //
+    struct features_t
+    {
+        uint32_t pop_reg = 0;
+        uint32_t push_reg = 0;
+        bool pop_vreg = false;
+        bool push_vreg = false;
+        bool push_const = false;
+        bool read8 = false;
+        bool read64 = false;
+        bool cmovnz = false;
+        bool ret = false;
+        // Operation right after the second register pop (add/and/mul) or invalid
+        //
+        ZydisMnemonic binary_op = ZYDIS_MNEMONIC_INVALID;
+    };
+
+    features_t extract_features(const state& state, const x86::routine_t& routine);
+    // Deterministic decision tree over extracted features
+    //
+    opcodes classify(const features_t& features);
+    // Recognize handler without touching VM state
+    //
+    opcodes classify(const state& state, const x86::routine_t& routine);
+    // Apply stack effect of already classified instruction
+    //
+    void emulate(state& state, instruction_t& instr);
+
     instruction_t match(state& state, const x86::routine_t& routine, uint64_t operand);
 }
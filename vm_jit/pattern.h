@@ -0,0 +1,270 @@
+#pragma once
+#include "disasm.h"
+
+#include <array>
+#include <utility>
+
+// Compile-time instruction patterns over x86::routine_t.
+//
+// A pattern is a type, e.g.
+//
+//   seq<
+//       ins<ZYDIS_MNEMONIC_XOR, reg_cap<0>, any_reg>,
+//       ins<ZYDIS_MNEMONIC_ROR, reg_cap<0>, imm_cap<0>>,
+//       ins<ZYDIS_MNEMONIC_XOR, any_reg, reg_cap<0>>
+//   >
+//
+// and every match call is instantiated into straight-line comparisons, there is no
+// interpretation or std::function in between. Register captures act as constraints once
+// bound: the same slot used twice must hold the same register. Slots can be seeded before
+// matching to pin VM register roles (vip_r, vreg_r, ...) that are only known at runtime.
+//
+namespace x86::pattern
+{
+    static constexpr size_t max_captures = 4;
+
+    struct captures_t
+    {
+        std::array<uint64_t, max_captures> imm{};
+        std::array<zydis_register_t, max_captures> reg{};
+    };
+
+    static inline bool bind(zydis_register_t& slot, zydis_register_t reg)
+    {
+        if (slot == ZYDIS_REGISTER_NONE)
+        {
+            slot = reg;
+            return true;
+        }
+        return slot == reg;
+    }
+
+    // Operands
+    //
+    struct any
+    {
+        static bool match(const operand_t&, captures_t&) { return true; }
+    };
+
+    struct any_reg
+    {
+        static bool match(const operand_t& op, captures_t&)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_REGISTER;
+        }
+    };
+
+    template<zydis_register_t R>
+    struct reg
+    {
+        static bool match(const operand_t& op, captures_t&)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_REGISTER && op.reg == R;
+        }
+    };
+
+    template<size_t N>
+    struct reg_cap
+    {
+        static_assert(N < max_captures);
+        static bool match(const operand_t& op, captures_t& c)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_REGISTER && bind(c.reg[N], op.reg);
+        }
+    };
+
+    struct any_imm
+    {
+        static bool match(const operand_t& op, captures_t&)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_IMMEDIATE;
+        }
+    };
+
+    template<uint64_t V>
+    struct imm
+    {
+        static bool match(const operand_t& op, captures_t&)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_IMMEDIATE && op.imm == V;
+        }
+    };
+
+    template<size_t N>
+    struct imm_cap
+    {
+        static_assert(N < max_captures);
+        static bool match(const operand_t& op, captures_t& c)
+        {
+            if (op.type != ZYDIS_OPERAND_TYPE_IMMEDIATE)
+                return false;
+            c.imm[N] = op.imm;
+            return true;
+        }
+    };
+
+    struct any_mem
+    {
+        static bool match(const operand_t& op, captures_t&)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_MEMORY;
+        }
+    };
+
+    template<zydis_register_t Base>
+    struct mem
+    {
+        static bool match(const operand_t& op, captures_t&)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_MEMORY && op.mem.base == Base;
+        }
+    };
+
+    // Memory operand, base register is captured
+    //
+    template<size_t N>
+    struct mem_cap
+    {
+        static_assert(N < max_captures);
+        static bool match(const operand_t& op, captures_t& c)
+        {
+            return op.type == ZYDIS_OPERAND_TYPE_MEMORY && bind(c.reg[N], op.mem.base);
+        }
+    };
+
+    // Instructions
+    //
+    template<ZydisMnemonic M, typename... Operands>
+    struct ins
+    {
+        static_assert(sizeof...(Operands) <= max_operands);
+
+        static constexpr ZydisMnemonic mnemonic = M;
+        static constexpr size_t length = 1;
+
+        static bool match(const routine_t& routine, size_t i, captures_t& c)
+        {
+            if (routine.mnemonics[i] != M)
+                return false;
+
+            auto instr = routine[i];
+            if (instr.operand_count() < sizeof...(Operands))
+                return false;
+
+            return match_operands(instr, c, std::index_sequence_for<Operands...>{});
+        }
+
+    private:
+        template<size_t... I>
+        static bool match_operands(const instruction_t& instr, captures_t& c, std::index_sequence<I...>)
+        {
+            return (Operands::match(instr.operand(I), c) && ...);
+        }
+    };
+
+    // Consecutive instructions
+    //
+    template<typename First, typename... Rest>
+    struct seq
+    {
+        static constexpr ZydisMnemonic mnemonic = First::mnemonic;
+        static constexpr size_t length = First::length + (Rest::length + ... + 0);
+
+        static bool match(const routine_t& routine, size_t i, captures_t& c)
+        {
+            size_t at = i + First::length;
+            return First::match(routine, i, c) &&
+                ((Rest::match(routine, at, c) && (at += Rest::length, true)) && ...);
+        }
+    };
+
+    // Match at a fixed position, captures are only updated on success
+    //
+    template<typename P>
+    bool match_at(const routine_t& routine, size_t i, captures_t& c)
+    {
+        if (i + P::length > routine.size())
+            return false;
+
+        captures_t temp = c;
+        if (!P::match(routine, i, temp))
+            return false;
+
+        c = temp;
+        return true;
+    }
+
+    template<typename P>
+    bool match_at(const routine_t& routine, size_t i)
+    {
+        captures_t c;
+        return match_at<P>(routine, i, c);
+    }
+
+    // First match at or after from, candidates come from the mnemonic index
+    //
+    template<typename P>
+    int find(const routine_t& routine, captures_t& c, int from = 0)
+    {
+        auto list = routine.positions(P::mnemonic);
+        auto it = std::lower_bound(list.begin(), list.end(), (uint32_t)std::max(from, 0));
+        for (; it != list.end(); ++it)
+        {
+            if (match_at<P>(routine, *it, c))
+                return (int)*it;
+        }
+        return -1;
+    }
+
+    template<typename P>
+    int find(const routine_t& routine, int from = 0)
+    {
+        captures_t c;
+        return find<P>(routine, c, from);
+    }
+
+    // Last match starting at or before from
+    //
+    template<typename P>
+    int rfind(const routine_t& routine, captures_t& c, int from = -1)
+    {
+        if (from == -1) from = (int)routine.size() - 1;
+        if (from < 0) return -1;
+
+        auto list = routine.positions(P::mnemonic);
+        auto it = std::upper_bound(list.begin(), list.end(), (uint32_t)from);
+        while (it != list.begin())
+        {
+            --it;
+            if (match_at<P>(routine, *it, c))
+                return (int)*it;
+        }
+        return -1;
+    }
+
+    template<typename P>
+    int rfind(const routine_t& routine, int from = -1)
+    {
+        captures_t c;
+        return rfind<P>(routine, c, from);
+    }
+
+    // Every match in order, each one starts from the seed captures
+    //
+    template<typename P, typename F>
+    void for_each(const routine_t& routine, const captures_t& seed, F&& f)
+    {
+        for (auto i : routine.positions(P::mnemonic))
+        {
+            captures_t c = seed;
+            if (match_at<P>(routine, i, c))
+                f((int)i, c);
+        }
+    }
+
+    template<typename P, typename F>
+    void for_each(const routine_t& routine, F&& f)
+    {
+        for_each<P>(routine, captures_t{}, std::forward<F>(f));
+    }
+}
@@ -0,0 +1,169 @@
+#include "rewriter.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+namespace pe
+{
+    static constexpr uint32_t function_alignment = 64;
+    static constexpr uint32_t section_cnt_code = 0x00000020;
+    static constexpr size_t security_directory = 4;
+    static constexpr size_t bound_import_directory = 11;
+
+    static uint64_t align_up(uint64_t value, uint64_t alignment)
+    {
+        return alignment ? (value + alignment - 1) / alignment * alignment : value;
+    }
+
+    void rewriter::add(uint64_t entry_offset, std::vector<uint8_t> code)
+    {
+        functions.push_back({ entry_offset, std::move(code) });
+    }
+
+    bool rewriter::write(const std::string& source, const std::string& path) const
+    {
+        const auto* file = input.file_data();
+        const auto file_size = input.file_size();
+
+        // Headers were validated when the image was loaded
+        //
+        const auto* dos = reinterpret_cast<const dos_header_t*>(file);
+        auto nt = *reinterpret_cast<const nt_headers64_t*>(file + dos->e_lfanew);
+        auto& opt = nt.optional_header;
+
+        const size_t table = (size_t)dos->e_lfanew + offsetof(nt_headers64_t, optional_header) +
+            nt.file_header.size_of_optional_header;
+        const size_t count = nt.file_header.number_of_sections;
+        const auto* headers = reinterpret_cast<const section_header_t*>(file + table);
+
+        // The new header goes right after the table, it must not run into section data
+        //
+        size_t limit = std::min<size_t>(opt.size_of_headers, file_size);
+        uint64_t virtual_end = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto& h = headers[i];
+            if (h.size_of_raw_data)
+                limit = std::min<size_t>(limit, h.pointer_to_raw_data);
+            virtual_end = std::max<uint64_t>(virtual_end, (uint64_t)h.virtual_address + std::max(h.virtual_size, h.size_of_raw_data));
+        }
+        if (table + (count + 1) * sizeof(section_header_t) > limit)
+        {
+            std::printf("No room for another section header in %s\n", source.c_str());
+            return false;
+        }
+
+        // Linkers put bound imports right after the section table, where the new header
+        // goes. They are only a load time shortcut, so the directory is dropped and the
+        // loader resolves imports the normal way. Anything else in the slot stays.
+        //
+        const size_t slot = table + count * sizeof(section_header_t);
+        bool unbind = false;
+        if (opt.number_of_rva_and_sizes > bound_import_directory)
+        {
+            const auto& bound = opt.data_directory[bound_import_directory];
+            unbind = bound.size && bound.rva < slot + sizeof(section_header_t) && bound.rva + bound.size > slot;
+        }
+        if (!unbind && std::any_of(file + slot, file + slot + sizeof(section_header_t), [](uint8_t b) { return b != 0; }))
+        {
+            std::printf("Bytes after the section table of %s are in use\n", source.c_str());
+            return false;
+        }
+
+        std::vector<uint64_t> offsets;
+        uint64_t size = 0;
+        for (const auto& function : functions)
+        {
+            size = align_up(size, function_alignment);
+            offsets.push_back(size);
+            size += function.code.size();
+        }
+
+        section_header_t section{};
+        std::memcpy(section.name, ".devirt", 7);
+        const auto virtual_address = align_up(virtual_end, opt.section_alignment);
+        const auto raw_offset = align_up(file_size, opt.file_alignment);
+        const auto raw_size = align_up(size, opt.file_alignment);
+        if (virtual_address + align_up(size, opt.section_alignment) > UINT32_MAX || raw_offset + raw_size > UINT32_MAX)
+        {
+            std::printf("Devirtualized code does not fit %s\n", source.c_str());
+            return false;
+        }
+        section.virtual_size = (uint32_t)size;
+        section.virtual_address = (uint32_t)virtual_address;
+        section.size_of_raw_data = (uint32_t)raw_size;
+        section.pointer_to_raw_data = (uint32_t)raw_offset;
+        section.characteristics = section_cnt_code | section_mem_execute | section_mem_read;
+
+        // int3 between functions, zeroes past the virtual size
+        //
+        std::vector<uint8_t> data(raw_size, 0);
+        std::fill(data.begin(), data.begin() + size, 0xCC);
+        for (size_t i = 0; i < functions.size(); i++)
+            std::copy(functions[i].code.begin(), functions[i].code.end(), data.begin() + offsets[i]);
+
+        // jmp rel32 over the first bytes of every VM entry
+        //
+        std::vector<std::pair<uint64_t, std::array<uint8_t, 5>>> jumps;
+        for (size_t i = 0; i < functions.size(); i++)
+        {
+            const auto entry = functions[i].entry_offset;
+            auto va = input.offset_to_va(entry);
+            if (!va || !input.offset_to_va(entry + 4))
+            {
+                std::printf("Entry at 0x%llx is not backed by %s\n", (unsigned long long)entry, source.c_str());
+                return false;
+            }
+
+            auto rel = (int32_t)((int64_t)(virtual_address + offsets[i]) - (int64_t)(*va - input.image_base + 5));
+            std::array<uint8_t, 5> jmp{ 0xE9 };
+            std::memcpy(jmp.data() + 1, &rel, sizeof(rel));
+            jumps.emplace_back(entry, jmp);
+        }
+
+        nt.file_header.number_of_sections++;
+        opt.size_of_image = (uint32_t)align_up(virtual_address + size, opt.section_alignment);
+        opt.size_of_code += section.size_of_raw_data;
+        opt.checksum = 0;
+        // A signature no longer matches and would have to stay the last thing in the file
+        //
+        if (opt.number_of_rva_and_sizes > security_directory)
+            opt.data_directory[security_directory] = {};
+        if (unbind)
+            opt.data_directory[bound_import_directory] = {};
+
+        std::error_code ec;
+        std::filesystem::copy_file(source, path, std::filesystem::copy_options::overwrite_existing, ec);
+        if (ec)
+        {
+            std::printf("Failed to copy %s to %s\n", source.c_str(), path.c_str());
+            return false;
+        }
+
+        std::fstream out(path, std::ios::in | std::ios::out | std::ios::binary);
+        auto put = [&](uint64_t offset, const void* bytes, size_t length)
+        {
+            out.seekp((std::streamoff)offset);
+            out.write((const char*)bytes, (std::streamsize)length);
+        };
+
+        // The optional header may be shorter than ours, never write into the section table
+        //
+        put(dos->e_lfanew, &nt, offsetof(nt_headers64_t, optional_header) +
+            std::min<size_t>(nt.file_header.size_of_optional_header, sizeof(optional_header64_t)));
+        put(slot, &section, sizeof(section));
+        for (const auto& [offset, jmp] : jumps)
+            put(offset, jmp.data(), jmp.size());
+        put(raw_offset, data.data(), data.size());
+        if (!out.good())
+        {
+            std::printf("Failed to write %s\n", path.c_str());
+            return false;
+        }
+        return true;
+    }
+}
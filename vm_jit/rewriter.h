@@ -0,0 +1,38 @@
+#pragma once
+#include "image.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pe
+{
+    // Places devirtualized functions in a section appended to the image and redirects
+    // every VM entry to its function with a jmp rel32, so code size is never limited by
+    // what follows the entry.
+    //
+    // Functions start on a cache line each, in entry order. The output is a plain file
+    // copy (copy_file_range / CopyFile underneath) with only the headers, the entry
+    // jumps and the new section written over it.
+    //
+    struct rewriter
+    {
+        struct function_t
+        {
+            uint64_t entry_offset = 0;
+            std::vector<uint8_t> code;
+        };
+
+        const image& input;
+        std::vector<function_t> functions;
+
+        explicit rewriter(const image& input) : input(input) {}
+
+        void add(uint64_t entry_offset, std::vector<uint8_t> code);
+
+        // Prints the reason and returns false if the image has no room for the section
+        // header, an entry is not backed by the file or the output can't be written
+        //
+        bool write(const std::string& source, const std::string& path) const;
+    };
+}
@@ -0,0 +1,132 @@
+#include "scan.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cctype>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCAN_SSE2
+#endif
+
+namespace scan
+{
+    pattern_t pattern_t::parse(std::string_view text)
+    {
+        pattern_t out;
+        auto hex = [](char c) -> uint8_t
+        {
+            return std::isdigit((unsigned char)c) ? c - '0' : (std::toupper((unsigned char)c) - 'A' + 10);
+        };
+
+        for (size_t i = 0; i < text.size();)
+        {
+            if (text[i] == ' ')
+            {
+                i++;
+                continue;
+            }
+
+            if (text[i] == '?')
+            {
+                out.bytes.push_back(0);
+                out.mask.push_back(0);
+                i += (i + 1 < text.size() && text[i + 1] == '?') ? 2 : 1;
+                continue;
+            }
+
+            assert(i + 1 < text.size());
+            out.bytes.push_back((uint8_t)(hex(text[i]) << 4 | hex(text[i + 1])));
+            out.mask.push_back(0xFF);
+            i += 2;
+        }
+
+        assert(out.size() >= 2 && out.mask[0] && out.mask[1]);
+        return out;
+    }
+
+    bool pattern_t::matches(const uint8_t* data) const
+    {
+        for (size_t i = 0; i < bytes.size(); i++)
+        {
+            if ((data[i] & mask[i]) != bytes[i])
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<match_t> find_all(std::span<const uint8_t> data, std::span<const pattern_t> patterns)
+    {
+        std::vector<match_t> out;
+        const auto* base = data.data();
+        const size_t n = data.size();
+
+        // Candidate at pos, check bounds and the whole pattern
+        //
+        auto check = [&](size_t pos, size_t k)
+        {
+            const auto& pattern = patterns[k];
+            if (pos + pattern.size() <= n && pattern.matches(base + pos))
+                out.push_back({ pos, k });
+        };
+
+        size_t i = 0;
+
+#if defined(SCAN_AVX2)
+
+        // Second load is one byte ahead, stop while it still fits
+        //
+        for (; i + 33 <= n; i += 32)
+        {
+            auto b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i));
+            auto b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i + 1));
+
+            for (size_t k = 0; k < patterns.size(); k++)
+            {
+                auto a0 = _mm256_set1_epi8((char)patterns[k].bytes[0]);
+                auto a1 = _mm256_set1_epi8((char)patterns[k].bytes[1]);
+                auto eq = _mm256_and_si256(_mm256_cmpeq_epi8(b0, a0), _mm256_cmpeq_epi8(b1, a1));
+                for (auto bits = (uint32_t)_mm256_movemask_epi8(eq); bits; bits &= bits - 1)
+                    check(i + std::countr_zero(bits), k);
+            }
+        }
+#elif defined(SCAN_SSE2)
+
+        for (; i + 17 <= n; i += 16)
+        {
+            auto b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + i));
+            auto b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + i + 1));
+
+            for (size_t k = 0; k < patterns.size(); k++)
+            {
+                auto a0 = _mm_set1_epi8((char)patterns[k].bytes[0]);
+                auto a1 = _mm_set1_epi8((char)patterns[k].bytes[1]);
+                auto eq = _mm_and_si128(_mm_cmpeq_epi8(b0, a0), _mm_cmpeq_epi8(b1, a1));
+                for (auto bits = (uint32_t)_mm_movemask_epi8(eq); bits; bits &= bits - 1)
+                    check(i + std::countr_zero(bits), k);
+            }
+        }
+#endif
+
+        // Scalar tail, or everything without SIMD
+        //
+        for (; i + 1 < n; i++)
+        {
+            for (size_t k = 0; k < patterns.size(); k++)
+            {
+                if (base[i] == patterns[k].bytes[0] && base[i + 1] == patterns[k].bytes[1])
+                    check(i, k);
+            }
+        }
+
+        std::sort(out.begin(), out.end(), [](const match_t& a, const match_t& b)
+            {
+                return a.offset != b.offset ? a.offset < b.offset : a.pattern < b.pattern;
+            });
+        return out;
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// Multi-pattern byte scanner. The first two bytes of every pattern are compared
+// 32 (AVX2) or 16 (SSE2) positions at a time, full patterns are only checked
+// at positions where both match.
+//
+namespace scan
+{
+    struct pattern_t
+    {
+        std::vector<uint8_t> bytes;
+        // 0xFF for bytes that must match, 0x00 for wildcards
+        //
+        std::vector<uint8_t> mask;
+
+        // IDA style, "49 8B 00 48 C1 C8 ?? FF E0". The first two bytes can't be wildcards.
+        //
+        static pattern_t parse(std::string_view text);
+
+        size_t size() const { return bytes.size(); }
+        bool matches(const uint8_t* data) const;
+    };
+
+    struct match_t
+    {
+        size_t offset;
+        size_t pattern;
+    };
+
+    // Every match of every pattern, sorted by offset
+    //
+    std::vector<match_t> find_all(std::span<const uint8_t> data, std::span<const pattern_t> patterns);
+}
@@ -0,0 +1,638 @@
+#include "semantics.h"
+
+#include <array>
+#include <bit>
+#include <map>
+#include <optional>
+
+namespace vm
+{
+    enum class kind_t : uint8_t
+    {
+        Const,
+        // Initial value of a GPR
+        //
+        Reg,
+        // Rolling key before fetch n
+        //
+        Key,
+        // Raw and decrypted bytecode slot n
+        //
+        Fetch,
+        Operand,
+        // VM stack slot n on entry
+        //
+        Slot,
+        Load,
+        Add,
+        Sub,
+        Xor,
+        And,
+        Or,
+        Not,
+        Neg,
+        Mul,
+        Ror,
+        Rol,
+        Shl,
+        Shr,
+        // Compared values, true when they differ
+        //
+        Ne,
+        // a ? b : c
+        //
+        Select,
+        Unknown
+    };
+
+    using value_t = uint32_t;
+
+    struct expr_t
+    {
+        kind_t kind;
+        uint8_t size = 8;
+        value_t a = 0;
+        value_t b = 0;
+        value_t c = 0;
+        uint64_t value = 0;
+    };
+
+    struct machine_t
+    {
+        const state& vm;
+        std::vector<expr_t> arena;
+        std::array<value_t, x86::gpr_count> regs{};
+
+        // VM stack, offsets are relative to rsp on entry
+        //
+        int64_t sp = 0;
+        std::map<int64_t, value_t> stack;
+        // Writes through anything but rsp
+        //
+        std::vector<std::pair<value_t, value_t>> stores;
+
+        std::optional<value_t> flags;
+        std::optional<value_t> target;
+        bool ret = false;
+
+        std::vector<uint64_t> ror_keys;
+        std::optional<uint64_t> jcc_key;
+
+        explicit machine_t(const state& vm) : vm(vm)
+        {
+            for (size_t i = 0; i < regs.size(); i++)
+                regs[i] = make({ kind_t::Reg, 8, 0, 0, 0, i });
+
+            regs[x86::reg::gpr_index(vm.rkey_r)] = make({ kind_t::Key, 8, 0, 0, 0, 0 });
+        }
+
+        const expr_t& at(value_t v) const { return arena[v]; }
+
+        value_t make(const expr_t& e)
+        {
+            arena.push_back(e);
+            return (value_t)arena.size() - 1;
+        }
+
+        value_t constant(uint64_t v) { return make({ kind_t::Const, 8, 0, 0, 0, v }); }
+        value_t unknown() { return make({ kind_t::Unknown }); }
+
+        bool is_const(value_t v) const { return at(v).kind == kind_t::Const; }
+        bool is_reg(value_t v, x86::zydis_register_t reg) const
+        {
+            return at(v).kind == kind_t::Reg && at(v).value == (uint64_t)x86::reg::gpr_index(reg);
+        }
+
+        value_t unary(kind_t kind, value_t a)
+        {
+            if (is_const(a))
+            {
+                auto x = at(a).value;
+                return constant(kind == kind_t::Not ? ~x : 0 - x);
+            }
+            // not(not(x))
+            //
+            if (kind == kind_t::Not && at(a).kind == kind_t::Not)
+                return at(a).a;
+            return make({ kind, 8, a });
+        }
+
+        value_t binary(kind_t kind, value_t a, value_t b)
+        {
+            if (is_const(a) && is_const(b))
+            {
+                auto x = at(a).value, y = at(b).value;
+                switch (kind)
+                {
+                case kind_t::Add: return constant(x + y);
+                case kind_t::Sub: return constant(x - y);
+                case kind_t::Xor: return constant(x ^ y);
+                case kind_t::And: return constant(x & y);
+                case kind_t::Or:  return constant(x | y);
+                case kind_t::Mul: return constant(x * y);
+                case kind_t::Ror: return constant(std::rotr(x, (int)(y & 63)));
+                case kind_t::Rol: return constant(std::rotl(x, (int)(y & 63)));
+                case kind_t::Shl: return constant(x << (y & 63));
+                case kind_t::Shr: return constant(x >> (y & 63));
+                default: break;
+                }
+            }
+
+            // x op 0 == x
+            //
+            if (is_const(b) && !at(b).value && kind != kind_t::And && kind != kind_t::Mul)
+                return a;
+
+            // x - -y == x + y
+            //
+            if (kind == kind_t::Sub && at(b).kind == kind_t::Neg)
+                return binary(kind_t::Add, a, at(b).a);
+
+            // Keep pointer arithmetic as base + constant, add r8, 8 twice is r8 + 16
+            //
+            if (kind == kind_t::Sub && is_const(b))
+                return binary(kind_t::Add, a, constant(0 - at(b).value));
+            if (kind == kind_t::Add && is_const(b) && at(a).kind == kind_t::Add && is_const(at(a).b))
+                return binary(kind_t::Add, at(a).a, constant(at(at(a).b).value + at(b).value));
+
+            return make({ kind, 8, a, b });
+        }
+
+        // Structural equality, commutative operators match in either order
+        //
+        bool same(value_t a, value_t b) const
+        {
+            if (a == b)
+                return true;
+
+            const auto& x = at(a);
+            const auto& y = at(b);
+            if (x.kind != y.kind || x.kind == kind_t::Unknown)
+                return false;
+
+            switch (x.kind)
+            {
+            case kind_t::Const:
+            case kind_t::Reg:
+            case kind_t::Key:
+            case kind_t::Fetch:
+            case kind_t::Operand:
+            case kind_t::Slot:
+                return x.value == y.value;
+            case kind_t::Load:
+                return x.size == y.size && same(x.a, y.a);
+            case kind_t::Not:
+            case kind_t::Neg:
+                return same(x.a, y.a);
+            case kind_t::Add:
+            case kind_t::Xor:
+            case kind_t::And:
+            case kind_t::Or:
+            case kind_t::Mul:
+            case kind_t::Ne:
+                return (same(x.a, y.a) && same(x.b, y.b)) || (same(x.a, y.b) && same(x.b, y.a));
+            case kind_t::Select:
+                return same(x.a, y.a) && same(x.b, y.b) && same(x.c, y.c);
+            default:
+                return same(x.a, y.a) && same(x.b, y.b);
+            }
+        }
+
+        // Bytecode slot n if v is vip + 8 * n
+        //
+        std::optional<uint64_t> fetch_index(value_t v) const
+        {
+            if (is_reg(v, vm.vip_r))
+                return 0;
+            if (at(v).kind == kind_t::Add && is_reg(at(v).a, vm.vip_r) && is_const(at(v).b) && !(at(at(v).b).value & 7))
+                return at(at(v).b).value / 8;
+            return std::nullopt;
+        }
+
+        // Register reads, sub registers of symbolic values are approximated by the full register
+        //
+        value_t get(x86::zydis_register_t reg)
+        {
+            auto idx = x86::reg::gpr_index(reg);
+            if (idx == -1)
+                return unknown();
+
+            if (x86::reg::extend(reg) == ZYDIS_REGISTER_RSP)
+                return binary(kind_t::Add, regs[idx], constant(sp));
+
+            auto v = regs[idx];
+            auto size = x86::reg::size(reg);
+            if (size < 8 && is_const(v))
+                return constant(at(v).value & ((1ull << (size * 8)) - 1));
+            return v;
+        }
+
+        void set(x86::zydis_register_t reg, value_t v)
+        {
+            auto idx = x86::reg::gpr_index(reg);
+            if (idx == -1 || x86::reg::extend(reg) == ZYDIS_REGISTER_RSP)
+                return;
+
+            switch (x86::reg::size(reg))
+            {
+            case 8:
+                regs[idx] = v;
+                break;
+            case 4:
+                // 32-bit writes zero the upper half
+                //
+                regs[idx] = is_const(v) ? constant(at(v).value & 0xFFFFFFFF) : v;
+                break;
+            default:
+                regs[idx] = unknown();
+                break;
+            }
+        }
+
+        struct address_t
+        {
+            bool stack = false;
+            int64_t offset = 0;
+            value_t value = 0;
+        };
+
+        address_t address(const x86::operand_t& op)
+        {
+            address_t out;
+            if (op.mem.base == ZYDIS_REGISTER_RSP && op.mem.index == ZYDIS_REGISTER_NONE)
+            {
+                out.stack = true;
+                out.offset = sp + op.mem.disp;
+                return out;
+            }
+
+            auto v = op.mem.base != ZYDIS_REGISTER_NONE ? get(op.mem.base) : constant(0);
+            if (op.mem.index != ZYDIS_REGISTER_NONE)
+                v = binary(kind_t::Add, v, binary(kind_t::Mul, get(op.mem.index), constant(op.mem.scale)));
+            out.value = binary(kind_t::Add, v, constant((uint64_t)op.mem.disp));
+            return out;
+        }
+
+        value_t load_stack(int64_t offset)
+        {
+            if (auto it = stack.find(offset); it != stack.end())
+                return it->second;
+            if (offset >= 0 && !(offset & 7))
+                return make({ kind_t::Slot, 8, 0, 0, 0, (uint64_t)offset / 8 });
+            return unknown();
+        }
+
+        value_t load(const address_t& addr, uint8_t size)
+        {
+            if (addr.stack)
+                return load_stack(addr.offset);
+
+            if (size == 8)
+            {
+                if (auto n = fetch_index(addr.value))
+                    return make({ kind_t::Fetch, 8, 0, 0, 0, *n });
+            }
+            return make({ kind_t::Load, size, addr.value });
+        }
+
+        void store(const address_t& addr, value_t v)
+        {
+            if (addr.stack)
+                stack[addr.offset] = v;
+            else
+                stores.push_back({ addr.value, v });
+        }
+
+        value_t read(const x86::operand_t& op)
+        {
+            switch (op.type)
+            {
+            case ZYDIS_OPERAND_TYPE_REGISTER:
+                return get(op.reg);
+            case ZYDIS_OPERAND_TYPE_IMMEDIATE:
+                return constant(op.imm);
+            case ZYDIS_OPERAND_TYPE_MEMORY:
+                return load(address(op), (uint8_t)(op.size / 8));
+            default:
+                return unknown();
+            }
+        }
+
+        void write(const x86::operand_t& op, value_t v)
+        {
+            if (op.type == ZYDIS_OPERAND_TYPE_REGISTER)
+                set(op.reg, v);
+            else if (op.type == ZYDIS_OPERAND_TYPE_MEMORY)
+                store(address(op), v);
+        }
+
+        // ror of (fetch n ^ key n) by a constant is the decryption of bytecode slot n
+        //
+        std::optional<value_t> decrypt(value_t v, uint64_t n)
+        {
+            const auto& e = at(v);
+            if (e.kind != kind_t::Xor)
+                return std::nullopt;
+
+            auto fetch = at(e.a).kind == kind_t::Fetch ? e.a : e.b;
+            auto key = fetch == e.a ? e.b : e.a;
+            if (at(fetch).kind != kind_t::Fetch || at(key).kind != kind_t::Key ||
+                at(fetch).value != at(key).value || at(fetch).value != ror_keys.size())
+                return std::nullopt;
+
+            ror_keys.push_back(n);
+            return make({ kind_t::Operand, 8, 0, 0, 0, at(fetch).value });
+        }
+
+        void execute(const x86::instruction_t& instr)
+        {
+            auto count = instr.operand_count();
+            auto op = [&](size_t n) -> const x86::operand_t& { return instr.operand(n); };
+
+            switch (instr.mnemonic())
+            {
+            case ZYDIS_MNEMONIC_NOP:
+                break;
+            case ZYDIS_MNEMONIC_MOV:
+            case ZYDIS_MNEMONIC_MOVZX:
+                write(op(0), read(op(1)));
+                break;
+            case ZYDIS_MNEMONIC_LEA:
+            {
+                auto addr = address(op(1));
+                write(op(0), addr.stack ?
+                    binary(kind_t::Add, regs[x86::reg::gpr_index(ZYDIS_REGISTER_RSP)], constant(addr.offset)) : addr.value);
+                break;
+            }
+            case ZYDIS_MNEMONIC_ADD:
+            case ZYDIS_MNEMONIC_SUB:
+            {
+                auto kind = instr.mnemonic() == ZYDIS_MNEMONIC_ADD ? kind_t::Add : kind_t::Sub;
+                if (op(0).type == ZYDIS_OPERAND_TYPE_REGISTER && x86::reg::extend(op(0).reg) == ZYDIS_REGISTER_RSP)
+                {
+                    // Stack pointer adjustments only make sense with constants
+                    //
+                    auto v = read(op(1));
+                    if (is_const(v))
+                        sp += kind == kind_t::Add ? (int64_t)at(v).value : -(int64_t)at(v).value;
+                    break;
+                }
+                write(op(0), binary(kind, read(op(0)), read(op(1))));
+                break;
+            }
+            case ZYDIS_MNEMONIC_XOR:
+            {
+                if (op(0).type == ZYDIS_OPERAND_TYPE_REGISTER && op(1).type == ZYDIS_OPERAND_TYPE_REGISTER && op(0).reg == op(1).reg)
+                {
+                    write(op(0), constant(0));
+                    break;
+                }
+
+                auto a = read(op(0));
+                auto b = read(op(1));
+                // Key update after a decryption, key n ^ operand n is key n + 1
+                //
+                if (at(a).kind == kind_t::Key && at(b).kind == kind_t::Operand && at(a).value == at(b).value)
+                {
+                    write(op(0), make({ kind_t::Key, 8, 0, 0, 0, at(a).value + 1 }));
+                    break;
+                }
+                write(op(0), binary(kind_t::Xor, a, b));
+                break;
+            }
+            case ZYDIS_MNEMONIC_AND:
+                write(op(0), binary(kind_t::And, read(op(0)), read(op(1))));
+                break;
+            case ZYDIS_MNEMONIC_OR:
+                write(op(0), binary(kind_t::Or, read(op(0)), read(op(1))));
+                break;
+            case ZYDIS_MNEMONIC_NOT:
+                write(op(0), unary(kind_t::Not, read(op(0))));
+                break;
+            case ZYDIS_MNEMONIC_NEG:
+                write(op(0), unary(kind_t::Neg, read(op(0))));
+                break;
+            case ZYDIS_MNEMONIC_ROR:
+            case ZYDIS_MNEMONIC_ROL:
+            case ZYDIS_MNEMONIC_SHL:
+            case ZYDIS_MNEMONIC_SHR:
+            {
+                auto v = read(op(0));
+                auto n = count > 1 ? read(op(1)) : constant(1);
+                auto kind = instr.mnemonic() == ZYDIS_MNEMONIC_ROR ? kind_t::Ror :
+                    instr.mnemonic() == ZYDIS_MNEMONIC_ROL ? kind_t::Rol :
+                    instr.mnemonic() == ZYDIS_MNEMONIC_SHL ? kind_t::Shl : kind_t::Shr;
+
+                if (kind == kind_t::Ror && is_const(n))
+                {
+                    if (auto operand = decrypt(v, at(n).value & 63))
+                    {
+                        write(op(0), *operand);
+                        break;
+                    }
+                }
+
+                // Conditional dispatch rotates by a key selected with cmov, the constant
+                // it falls back to is the fall-through key
+                //
+                if (kind == kind_t::Ror && at(n).kind == kind_t::Select && is_const(at(n).c))
+                    jcc_key = at(at(n).c).value;
+
+                write(op(0), binary(kind, v, n));
+                break;
+            }
+            case ZYDIS_MNEMONIC_MUL:
+            {
+                // rdx:rax = rax * src, only the low half is of interest
+                //
+                auto v = binary(kind_t::Mul, get(ZYDIS_REGISTER_RAX), read(op(0)));
+                set(ZYDIS_REGISTER_RAX, v);
+                set(ZYDIS_REGISTER_RDX, unknown());
+                break;
+            }
+            case ZYDIS_MNEMONIC_IMUL:
+                if (count == 3)
+                {
+                    write(op(0), binary(kind_t::Mul, read(op(1)), read(op(2))));
+                }
+                else if (count == 2)
+                {
+                    write(op(0), binary(kind_t::Mul, read(op(0)), read(op(1))));
+                }
+                else
+                {
+                    set(ZYDIS_REGISTER_RAX, binary(kind_t::Mul, get(ZYDIS_REGISTER_RAX), read(op(0))));
+                    set(ZYDIS_REGISTER_RDX, unknown());
+                }
+                break;
+            case ZYDIS_MNEMONIC_PUSH:
+            {
+                auto v = read(op(0));
+                sp -= 8;
+                stack[sp] = v;
+                break;
+            }
+            case ZYDIS_MNEMONIC_POP:
+            {
+                auto v = load_stack(sp);
+                sp += 8;
+                write(op(0), v);
+                break;
+            }
+            case ZYDIS_MNEMONIC_CMP:
+                flags = make({ kind_t::Ne, 8, read(op(0)), read(op(1)) });
+                break;
+            case ZYDIS_MNEMONIC_TEST:
+                flags = make({ kind_t::Ne, 8, binary(kind_t::And, read(op(0)), read(op(1))), constant(0) });
+                break;
+            case ZYDIS_MNEMONIC_CMOVNZ:
+            case ZYDIS_MNEMONIC_CMOVZ:
+            {
+                auto cond = flags ? *flags : unknown();
+                auto taken = read(op(1));
+                auto old = read(op(0));
+                // Select is always "differs ? b : c", cmovz swaps the arms
+                //
+                if (instr.mnemonic() == ZYDIS_MNEMONIC_CMOVNZ)
+                    write(op(0), make({ kind_t::Select, 8, cond, taken, old }));
+                else
+                    write(op(0), make({ kind_t::Select, 8, cond, old, taken }));
+                break;
+            }
+            case ZYDIS_MNEMONIC_JMP:
+                target = read(op(0));
+                break;
+            case ZYDIS_MNEMONIC_RET:
+                // Either the Exit or a push reg; ret dispatch, classify tells them apart
+                //
+                ret = true;
+                target = load_stack(sp);
+                sp += 8;
+                break;
+            default:
+                // Unmodelled, clobber whatever it writes
+                //
+                for (size_t i = 0; i < x86::gpr_count; i++)
+                {
+                    if (instr.routine->write_masks[instr.index] & (1u << i))
+                        regs[i] = unknown();
+                }
+                flags.reset();
+                break;
+            }
+        }
+
+        // [vreg + operand * 8]
+        //
+        bool is_vreg_slot(value_t addr, value_t operand) const
+        {
+            const auto& e = at(addr);
+            if (e.kind != kind_t::Add)
+                return false;
+
+            auto index = is_reg(e.a, vm.vreg_r) ? e.b : is_reg(e.b, vm.vreg_r) ? e.a : ~0u;
+            if (index == ~0u || at(index).kind != kind_t::Mul)
+                return false;
+
+            const auto& mul = at(index);
+            return (same(mul.a, operand) && is_const(mul.b) && at(mul.b).value == 8) ||
+                (same(mul.b, operand) && is_const(mul.a) && at(mul.a).value == 8);
+        }
+
+        bool is_slot(value_t v, uint64_t n) const
+        {
+            return at(v).kind == kind_t::Slot && at(v).value == n;
+        }
+
+        // op(slot 0, slot 1) in either order
+        //
+        bool is_binary(value_t v, kind_t kind) const
+        {
+            const auto& e = at(v);
+            return e.kind == kind &&
+                ((is_slot(e.a, 0) && is_slot(e.b, 1)) || (is_slot(e.a, 1) && is_slot(e.b, 0)));
+        }
+
+        // Control leaves through the last decrypted slot, by jmp or by push and ret
+        //
+        bool dispatches() const
+        {
+            return !ror_keys.empty() && target && at(*target).kind == kind_t::Operand &&
+                at(*target).value == ror_keys.size() - 1;
+        }
+
+        opcodes classify()
+        {
+            // Return address plus the 15 saved registers, unless the ret goes to the
+            // handler that was just decrypted
+            //
+            if (ret && !dispatches())
+                return sp >= 16 * 8 ? opcodes::Exit : opcodes::Invalid;
+
+            // vip is selected first and then advanced past the fetch
+            //
+            auto vip = regs[x86::reg::gpr_index(vm.vip_r)];
+            if (at(vip).kind == kind_t::Add && is_const(at(vip).b))
+                vip = at(vip).a;
+            if (at(vip).kind == kind_t::Select)
+                return jcc_key ? opcodes::Jnz : opcodes::Invalid;
+
+            // Everything else dispatches through the last decrypted slot
+            //
+            if (!dispatches())
+                return opcodes::Invalid;
+
+            auto top = load_stack(sp);
+
+            if (ror_keys.size() == 2)
+            {
+                auto operand = make({ kind_t::Operand, 8, 0, 0, 0, 0 });
+                if (sp == -8 && same(top, operand))
+                    return opcodes::PushConst;
+                if (sp == -8 && at(top).kind == kind_t::Load && at(top).size == 8 && is_vreg_slot(at(top).a, operand))
+                    return opcodes::PushVreg;
+                if (sp == 8)
+                {
+                    for (const auto& [addr, v] : stores)
+                    {
+                        if (is_slot(v, 0) && is_vreg_slot(addr, operand))
+                            return opcodes::PopVreg;
+                    }
+                }
+                return opcodes::Invalid;
+            }
+
+            if (sp == 8)
+            {
+                if (is_binary(top, kind_t::Add))
+                    return opcodes::Add;
+                if (at(top).kind == kind_t::Not && is_binary(at(top).a, kind_t::And))
+                    return opcodes::Nand;
+                if (is_binary(top, kind_t::Mul))
+                    return opcodes::Mul;
+            }
+            else if (sp == 0 && at(top).kind == kind_t::Load && is_slot(at(top).a, 0))
+            {
+                if (at(top).size == 1)
+                    return opcodes::Read8;
+                if (at(top).size == 8)
+                    return opcodes::Read64;
+            }
+            return opcodes::Invalid;
+        }
+    };
+
+    summary_t summarize(const state& state, const x86::routine_t& routine)
+    {
+        machine_t machine(state);
+        for (auto instr : routine)
+            machine.execute(instr);
+
+        summary_t out;
+        out.op = machine.classify();
+        out.ror_keys = machine.ror_keys;
+        out.jcc_key = machine.jcc_key.value_or(0);
+        out.stack_delta = -machine.sp;
+        return out;
+    }
+}
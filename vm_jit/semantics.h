@@ -0,0 +1,34 @@
+#pragma once
+#include "vm.h"
+
+#include <vector>
+
+namespace vm
+{
+    // What a handler does to the VM, derived by symbolically executing its routine
+    //
+    struct summary_t
+    {
+        opcodes op = opcodes::Invalid;
+        // One per bytecode fetch, the last one decrypts the next handler
+        //
+        std::vector<uint64_t> ror_keys;
+        // Jnz only, fall-through ror key
+        //
+        uint64_t jcc_key = 0;
+        // Bytes the VM stack grew by, negative for handlers that consume more than they push
+        //
+        int64_t stack_delta = 0;
+    };
+
+    // Runs the routine over symbolic registers and stack. The vip register, rolling key
+    // and every stack slot the handler finds on entry are tracked as symbols, decrypted
+    // fetches are recognized by shape and the opcode is read off what ends up on the
+    // stack, in vregs and in the vip register.
+    //
+    // Only instructions handlers actually use are modelled (mov/movzx/lea, add/sub/xor/
+    // and/or/not/neg, ror/rol/shl/shr, mul/imul, push/pop, cmp/test, cmovcc, jmp, ret).
+    // Anything else clobbers its destination.
+    //
+    summary_t summarize(const state& state, const x86::routine_t& routine);
+}
@@ -0,0 +1,119 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace stats
+{
+    std::atomic<int> verbosity = 0;
+
+    static constexpr size_t phase_count = (size_t)phase_t::Count;
+    static constexpr size_t counter_count = (size_t)counter_t::Count;
+
+    static std::atomic<uint64_t> phase_ns[phase_count];
+    static std::atomic<uint64_t> phase_calls[phase_count];
+    static std::atomic<uint64_t> counters[counter_count];
+
+    static const char* phase_names[phase_count] =
+    {
+        "decode", "classify", "ir_build", "ir_optimize",
+        "regalloc", "encode", "lift", "llvm_passes", "write",
+    };
+
+    static const char* counter_names[counter_count] =
+    {
+        "handlers", "knowledge_hits", "instructions", "decrypts", "ir_values", "ir_optimized", "code_bytes",
+    };
+
+    void add(phase_t phase, uint64_t ns)
+    {
+        phase_ns[(size_t)phase].fetch_add(ns, std::memory_order_relaxed);
+        phase_calls[(size_t)phase].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void add(counter_t counter, uint64_t n)
+    {
+        counters[(size_t)counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    struct pass_t
+    {
+        uint64_t ns = 0;
+        uint64_t calls = 0;
+    };
+
+    // Named at runtime and far less frequent than phases, a lock is fine
+    //
+    static std::mutex pass_lock;
+    static std::map<std::string, pass_t> passes;
+
+    void add(const std::string& pass, uint64_t ns)
+    {
+        std::lock_guard guard(pass_lock);
+        auto& entry = passes[pass];
+        entry.ns += ns;
+        entry.calls++;
+    }
+
+    void print()
+    {
+        std::printf("%-12s %12s %10s\n", "phase", "ms", "calls");
+        for (size_t i = 0; i < phase_count; i++)
+        {
+            auto calls = phase_calls[i].load();
+            if (!calls)
+                continue;
+            std::printf("%-12s %12.3f %10llu\n", phase_names[i], phase_ns[i].load() / 1e6, (unsigned long long)calls);
+        }
+        for (size_t i = 0; i < counter_count; i++)
+            std::printf("%-14s %llu\n", counter_names[i], (unsigned long long)counters[i].load());
+
+        // Slowest passes only, the JSON report has all of them
+        //
+        std::lock_guard guard(pass_lock);
+        if (passes.empty())
+            return;
+        std::vector<std::pair<std::string, pass_t>> sorted(passes.begin(), passes.end());
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.ns > b.second.ns; });
+        sorted.resize(std::min<size_t>(sorted.size(), 15));
+
+        std::printf("%-40s %12s %10s\n", "llvm pass", "ms", "calls");
+        for (const auto& [name, pass] : sorted)
+            std::printf("%-40s %12.3f %10llu\n", name.c_str(), pass.ns / 1e6, (unsigned long long)pass.calls);
+    }
+
+    bool save(const std::string& path)
+    {
+        auto* file = std::fopen(path.c_str(), "w");
+        if (!file)
+            return false;
+
+        std::fprintf(file, "{\n  \"phases\": {\n");
+        for (size_t i = 0; i < phase_count; i++)
+        {
+            std::fprintf(file, "    \"%s\": { \"ns\": %llu, \"calls\": %llu }%s\n", phase_names[i],
+                (unsigned long long)phase_ns[i].load(), (unsigned long long)phase_calls[i].load(), i + 1 < phase_count ? "," : "");
+        }
+        std::fprintf(file, "  },\n  \"counters\": {\n");
+        for (size_t i = 0; i < counter_count; i++)
+        {
+            std::fprintf(file, "    \"%s\": %llu%s\n", counter_names[i],
+                (unsigned long long)counters[i].load(), i + 1 < counter_count ? "," : "");
+        }
+        std::fprintf(file, "  },\n  \"passes\": {\n");
+        {
+            std::lock_guard guard(pass_lock);
+            size_t i = 0;
+            for (const auto& [name, pass] : passes)
+            {
+                std::fprintf(file, "    \"%s\": { \"ns\": %llu, \"calls\": %llu }%s\n", name.c_str(),
+                    (unsigned long long)pass.ns, (unsigned long long)pass.calls, ++i < passes.size() ? "," : "");
+            }
+        }
+        std::fprintf(file, "  }\n}\n");
+        return std::fclose(file) == 0;
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace stats
+{
+    // Time spent per phase, summed over every thread that ran it
+    //
+    enum class phase_t : uint8_t
+    {
+        Decode,
+        Classify,
+        IrBuild,
+        IrOptimize,
+        RegAlloc,
+        Encode,
+        Lift,
+        LlvmPasses,
+        Write,
+        Count,
+    };
+
+    enum class counter_t : uint8_t
+    {
+        // Handlers decoded, and how many of them the knowledge base classified
+        //
+        Handlers,
+        KnowledgeHits,
+        // VM instructions stepped by the explorer and bytecode slots it decrypted. A
+        // decrypt is a few ALU ops, too short to put a clock around.
+        //
+        Instructions,
+        Decrypts,
+        // Live IR values before and after optimization, over every function compiled
+        //
+        IrValues,
+        IrOptimized,
+        CodeBytes,
+        Count,
+    };
+
+    // 0 off, 1 phase summary and JSON, 2 asmjit logger output on top
+    //
+    extern std::atomic<int> verbosity;
+
+    inline bool enabled()
+    {
+        return verbosity.load(std::memory_order_relaxed) > 0;
+    }
+
+    void add(phase_t phase, uint64_t ns);
+    void add(counter_t counter, uint64_t n = 1);
+    // Time per LLVM pass by name, part of the llvm_passes phase
+    //
+    void add(const std::string& pass, uint64_t ns);
+
+    // Times its own lifetime, the clock is not read at all with stats disabled
+    //
+    struct scope_t
+    {
+        phase_t phase;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+
+        explicit scope_t(phase_t phase) : phase(phase), active(enabled())
+        {
+            if (active)
+                start = std::chrono::steady_clock::now();
+        }
+
+        ~scope_t()
+        {
+            stop();
+        }
+
+        // Ends the phase early when it doesn't line up with a C++ scope
+        //
+        void stop()
+        {
+            if (active)
+                add(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            active = false;
+        }
+
+        scope_t(const scope_t&) = delete;
+        scope_t& operator=(const scope_t&) = delete;
+    };
+
+    inline void count(counter_t counter, uint64_t n = 1)
+    {
+        if (enabled())
+            add(counter, n);
+    }
+
+    void print();
+
+    // {"phases": {"decode": {"ns": .., "calls": ..}, ..}, "counters": {"handlers": .., ..},
+    //  "passes": {"InstCombinePass": {"ns": .., "calls": ..}, ..}}
+    //
+    bool save(const std::string& path);
+}
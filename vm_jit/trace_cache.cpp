@@ -0,0 +1,289 @@
+#include "trace_cache.h"
+#include "hash.h"
+
+#include <fstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace vm
+{
+    static constexpr uint32_t trace_magic = 0x43544D56; // "VMTC"
+    // Bump whenever the format or the meaning of traced instructions changes
+    //
+    static constexpr uint32_t trace_version = 4;
+
+    trace_key_t make_trace_key(const state& state, uint64_t ror_key, uint64_t entry_offset, const knowledge_base& knowledge)
+    {
+        trace_key_t key;
+        key.image_hash = hash::hash64(state.image->file_data(), state.image->file_size());
+        key.vip = state.vip;
+        key.rkey = state.rkey;
+        key.ror_key = ror_key;
+        key.entry_offset = entry_offset;
+        key.vip_r = state.vip_r;
+        key.vreg_r = state.vreg_r;
+        key.rkey_r = state.rkey_r;
+        key.knowledge = knowledge.generation;
+        return key;
+    }
+
+    bool is_complete(const trace_t& trace)
+    {
+        for (const auto& block : trace.blocks)
+        {
+            // Every block ends in an exit or runs into bytecode already traced
+            //
+            if (block.next != ~0ull)
+                continue;
+            if (block.instructions.empty() || block.instructions.back().op != opcodes::Exit)
+                return false;
+        }
+        return true;
+    }
+
+    static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+    static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+    struct writer_t
+    {
+        std::vector<uint8_t> out;
+
+        void u8(uint8_t v) { out.push_back(v); }
+
+        void u64(uint64_t v)
+        {
+            auto* p = reinterpret_cast<const uint8_t*>(&v);
+            out.insert(out.end(), p, p + sizeof(v));
+        }
+
+        void varint(uint64_t v)
+        {
+            while (v >= 0x80)
+            {
+                out.push_back((uint8_t)v | 0x80);
+                v >>= 7;
+            }
+            out.push_back((uint8_t)v);
+        }
+    };
+
+    struct reader_t
+    {
+        const uint8_t* p;
+        const uint8_t* end;
+        bool ok = true;
+
+        uint8_t u8()
+        {
+            if (p == end) return ok = false, 0;
+            return *p++;
+        }
+
+        uint64_t u64()
+        {
+            uint64_t v = 0;
+            if (end - p < (ptrdiff_t)sizeof(v)) return ok = false, 0;
+            std::memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            return v;
+        }
+
+        uint64_t varint()
+        {
+            uint64_t v = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                if (p == end) break;
+                auto b = *p++;
+                v |= (uint64_t)(b & 0x7F) << shift;
+                if (!(b & 0x80))
+                    return v;
+            }
+            ok = false;
+            return 0;
+        }
+    };
+
+    bool save_trace(const std::string& path, const trace_key_t& key, const trace_t& trace)
+    {
+        writer_t w;
+        w.u64(((uint64_t)trace_version << 32) | trace_magic);
+        w.u64(key.image_hash);
+        w.u64(key.vip);
+        w.u64(key.rkey);
+        w.u64(key.ror_key);
+        w.u64(key.entry_offset);
+        w.u64(key.vip_r);
+        w.u64(key.vreg_r);
+        w.u64(key.rkey_r);
+        w.u64(key.classifier);
+        w.u64(key.knowledge);
+        w.varint(trace.blocks.size());
+
+        vip_t last = 0;
+        auto delta = [&](vip_t vip)
+        {
+            w.varint(zigzag((int64_t)(vip - last)));
+            last = vip;
+        };
+
+        for (const auto& block : trace.blocks)
+        {
+            w.varint(block.instructions.size());
+            delta(block.vip);
+            w.varint(block.next + 1);
+
+            for (const auto& instr : block.instructions)
+            {
+                w.u8((uint8_t)instr.op);
+                delta(instr.vip);
+                w.varint(instr.operand);
+                if (instr.op == opcodes::Jnz)
+                {
+                    w.varint(instr.branch_rkey);
+                    w.varint(instr.branch_ror_key);
+                }
+            }
+        }
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(w.out.data()), w.out.size());
+        return file.good();
+    }
+
+    // Read-only view of a whole file
+    //
+    struct mapped_file_t
+    {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+
+        explicit mapped_file_t(const std::string& path)
+        {
+#ifdef _WIN32
+            auto handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (handle == INVALID_HANDLE_VALUE)
+                return;
+
+            LARGE_INTEGER length;
+            auto mapping = GetFileSizeEx(handle, &length) && length.QuadPart ?
+                CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+            CloseHandle(handle);
+            if (!mapping)
+                return;
+
+            data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            CloseHandle(mapping);
+            size = data ? (size_t)length.QuadPart : 0;
+#else
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd == -1)
+                return;
+
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                auto* ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (ptr != MAP_FAILED)
+                {
+                    data = static_cast<const uint8_t*>(ptr);
+                    size = (size_t)st.st_size;
+                }
+            }
+            close(fd);
+#endif
+        }
+
+        ~mapped_file_t()
+        {
+            if (!data)
+                return;
+#ifdef _WIN32
+            UnmapViewOfFile(data);
+#else
+            munmap(const_cast<uint8_t*>(data), size);
+#endif
+        }
+
+        mapped_file_t(const mapped_file_t&) = delete;
+        mapped_file_t& operator=(const mapped_file_t&) = delete;
+    };
+
+    std::optional<trace_t> load_trace(const std::string& path, const trace_key_t& key)
+    {
+        mapped_file_t file(path);
+        if (!file.data)
+            return std::nullopt;
+
+        reader_t r{ file.data, file.data + file.size };
+        if (r.u64() != (((uint64_t)trace_version << 32) | trace_magic))
+            return std::nullopt;
+
+        trace_key_t stored;
+        stored.image_hash = r.u64();
+        stored.vip = r.u64();
+        stored.rkey = r.u64();
+        stored.ror_key = r.u64();
+        stored.entry_offset = r.u64();
+        stored.vip_r = (uint32_t)r.u64();
+        stored.vreg_r = (uint32_t)r.u64();
+        stored.rkey_r = (uint32_t)r.u64();
+        stored.classifier = (uint32_t)r.u64();
+        stored.knowledge = r.u64();
+        if (!r.ok || stored != key)
+            return std::nullopt;
+
+        trace_t out;
+        // Every block takes at least 3 bytes, don't trust the count beyond that
+        //
+        auto count = r.varint();
+        if (!r.ok || count > file.size / 3)
+            return std::nullopt;
+        out.blocks.resize(count);
+
+        vip_t last = 0;
+        auto delta = [&]()
+        {
+            last += (vip_t)unzigzag(r.varint());
+            return last;
+        };
+
+        for (auto& block : out.blocks)
+        {
+            auto instructions = r.varint();
+            if (!r.ok || instructions > file.size)
+                return std::nullopt;
+
+            block.vip = delta();
+            block.next = r.varint() - 1;
+            block.instructions.resize(instructions);
+
+            for (auto& instr : block.instructions)
+            {
+                auto op = r.u8();
+                if (op > (uint8_t)opcodes::Invalid)
+                    return std::nullopt;
+
+                instr.op = (opcodes)op;
+                instr.vip = delta();
+                instr.operand = r.varint();
+                if (instr.op == opcodes::Jnz)
+                {
+                    instr.branch_rkey = r.varint();
+                    instr.branch_ror_key = r.varint();
+                }
+            }
+            if (!r.ok)
+                return std::nullopt;
+        }
+        return out;
+    }
+}
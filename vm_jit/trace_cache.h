@@ -0,0 +1,51 @@
+#pragma once
+#include "explorer.h"
+#include "knowledge.h"
+
+#include <optional>
+#include <string>
+
+namespace vm
+{
+    // Everything a trace depends on, a cached trace is only reused if all of it matches
+    //
+    struct trace_key_t
+    {
+        uint64_t image_hash = 0;
+        vip_t vip = 0;
+        uint64_t rkey = 0;
+        uint64_t ror_key = 0;
+        uint64_t entry_offset = 0;
+        // Register roles the handlers were decoded under
+        //
+        uint32_t vip_r = 0;
+        uint32_t vreg_r = 0;
+        uint32_t rkey_r = 0;
+        // Traces decoded by an older classifier, or with other knowledge base entries,
+        // can differ on the same image
+        //
+        uint32_t classifier = classifier_version;
+        uint64_t knowledge = 0;
+
+        bool operator==(const trace_key_t&) const = default;
+    };
+
+    trace_key_t make_trace_key(const state& state, uint64_t ror_key, uint64_t entry_offset, const knowledge_base& knowledge);
+
+    // False if some path stopped at a handler that could not be decoded or left the
+    // image. Such a trace is not cached, a later classifier may get further.
+    //
+    bool is_complete(const trace_t& trace);
+
+    // On-disk trace:
+    //
+    //   header  magic, version, trace_key_t, block count
+    //   block   varint count, zigzag vip delta, varint next + 1
+    //   instr   op byte, zigzag vip delta, varint operand [, varint branch rkey, varint branch ror key]
+    //
+    // VIP deltas are taken against the previous VIP in the file, bytecode slots are
+    // 8 bytes apart so almost every delta fits a single byte.
+    //
+    bool save_trace(const std::string& path, const trace_key_t& key, const trace_t& trace);
+    std::optional<trace_t> load_trace(const std::string& path, const trace_key_t& key);
+}
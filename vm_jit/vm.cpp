@@ -1,4 +1,7 @@
 #include "vm.h"
+#include "pattern.h"
+
+#include <bit>
 
 namespace vm
 {
@@ -11,79 +14,106 @@ namespace vm
 		* .text:000000014002CCB5                 ror     rax, 5
 		* .text:000000014002CCB9                 xor     r10, rax
 		*/
-		auto v = *reinterpret_cast<uint64_t*>(vip);
+		auto v = image->read<uint64_t>(vip);
 		vip += sizeof(vip);
 
 		v = v ^ rkey;
-		v = _rotr64(v, (int)ror_key);
+		v = std::rotr(v, (int)ror_key);
 		rkey ^= v;
 
 		return v;
 	}
 
-	std::vector<uint64_t> extract_ror_keys(const x86::routine_t& routine)
-	{
-		std::vector<uint64_t> out;
-		int from = 0;
-		auto f_ror = [&](const x86::zydis_instruction_t& instr) -> bool
-		{
-			return instr.mnemonic == ZYDIS_MNEMONIC_ROR &&
-				instr.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-				instr.operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE;
-		};
+	namespace p = x86::pattern;
 
-		while (true)
-		{
-			from = routine.next(f_ror, from);
-			if (from == -1)
-				break;
+	/*
+	* Operand / next handler fetch, captures ror key
+	*
+	*   mov     rcx, [r8]
+	*   add     r8, 8
+	*   xor     rcx, r10
+	*   ror     rcx, 17h
+	*   xor     r10, rcx
+	*/
+	using fetch_p = p::seq<
+		p::ins<ZYDIS_MNEMONIC_MOV, p::reg_cap<0>, p::mem_cap<1>>,
+		p::ins<ZYDIS_MNEMONIC_ADD, p::reg_cap<1>, p::imm<8>>,
+		p::ins<ZYDIS_MNEMONIC_XOR, p::reg_cap<0>, p::reg_cap<2>>,
+		p::ins<ZYDIS_MNEMONIC_ROR, p::reg_cap<0>, p::imm_cap<0>>,
+		p::ins<ZYDIS_MNEMONIC_XOR, p::reg_cap<2>, p::reg_cap<0>>
+	>;
 
-			assert(from < routine.size() - 1);
-			assert(from > 0);
+	/*
+	* Conditional dispatch, ror key is taken from rcx
+	*
+	*   mov     rcx, 13h
+	*   ...
+	*   ror     rax, cl
+	*/
+	using jcc_ror_p = p::ins<ZYDIS_MNEMONIC_ROR, p::reg<ZYDIS_REGISTER_RAX>, p::reg<ZYDIS_REGISTER_CL>>;
+	using jcc_load_p = p::ins<ZYDIS_MNEMONIC_MOV, p::reg<ZYDIS_REGISTER_RCX>, p::imm_cap<0>>;
 
-			const auto& before = routine[(size_t)from - 1].instr;
-			const auto& after = routine[(size_t)from + 1].instr;
+	std::vector<int> find_ror_keys(const state& state, const x86::routine_t& routine)
+	{
+		std::vector<int> out;
 
-			if (before.mnemonic == ZYDIS_MNEMONIC_XOR &&
-				after.mnemonic == ZYDIS_MNEMONIC_XOR)
-			{
-				out.push_back(routine[from].instr.operands[1].imm.value.u);
-			}
+		// Pin vip and rolling key registers so only real fetches match
+		//
+		p::captures_t seed;
+		seed.reg[1] = state.vip_r;
+		seed.reg[2] = state.rkey_r;
 
-			from++;
-		}
+		// ror is the fourth instruction of the fetch
+		//
+		p::for_each<fetch_p>(routine, seed, [&](int i, const p::captures_t&)
+			{
+				out.push_back(i + 3);
+			});
 
 		return out;
 	}
 
-	uint64_t extact_jcc_key(const x86::routine_t& routine)
+	int find_jcc_key(const x86::routine_t& routine)
 	{
-		auto f_ror = [&](const x86::zydis_instruction_t& instr) -> bool
-		{
-			return instr.mnemonic == ZYDIS_MNEMONIC_ROR &&
-				instr.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-				instr.operands[0].reg.value == ZYDIS_REGISTER_RAX &&
-				instr.operands[1].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-				instr.operands[1].reg.value == ZYDIS_REGISTER_CL;
-		};
-
-		auto f_load = [&](const x86::zydis_instruction_t& instr) -> bool
-		{
-			return instr.mnemonic == ZYDIS_MNEMONIC_MOV &&
-				instr.operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-				instr.operands[0].reg.value == ZYDIS_REGISTER_RCX &&
-				instr.operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE;
-		};
-
 		// Check if decryption present
 		//
-		auto i_ror = routine.prev(f_ror);
-		assert(i_ror != -1);
+		auto i_ror = p::rfind<jcc_ror_p>(routine);
+		if (i_ror == -1)
+			return -1;
 		// Find last rcx load
 		//
-		auto i_load = routine.prev(f_load, i_ror);
+		return p::rfind<jcc_load_p>(routine, i_ror);
+	}
+
+	std::vector<uint64_t> extract_ror_keys(const state& state, const x86::routine_t& routine)
+	{
+		std::vector<uint64_t> out;
+		for (auto i : find_ror_keys(state, routine))
+			out.push_back(routine[i].operand(1).imm);
+		return out;
+	}
+
+	uint64_t extact_jcc_key(const x86::routine_t& routine)
+	{
+		auto i_load = find_jcc_key(routine);
 		assert(i_load != -1);
 
-		return routine[i_load].instr.operands[1].imm.value.u;
+		return routine[i_load].operand(1).imm;
+	}
+
+	int stack_delta(opcodes op)
+	{
+		switch (op)
+		{
+		case opcodes::PopVreg:   return -1;
+		case opcodes::PushVreg:  return 1;
+		case opcodes::PushConst: return 1;
+		case opcodes::Add:
+		case opcodes::Nand:
+		case opcodes::Mul:       return -1;
+		case opcodes::Jnz:       return -5;
+		case opcodes::Exit:      return -15;
+		default:                 return 0;
+		}
 	}
 }
@@ -1,8 +1,8 @@
 #pragma once
 #include "disasm.h"
+#include "image.h"
 
 #include <cstdint>
-#include <intrin.h>
 
 namespace vm
 {
@@ -28,25 +28,45 @@ namespace vm
 		opcodes op = opcodes::Invalid;
 		vip_t vip = ~0ull;
 		uint64_t operand = ~0ull;
+		// Jnz only: rolling key and ror key the taken edge continues with
+		//
+		uint64_t branch_rkey = ~0ull;
+		uint64_t branch_ror_key = ~0ull;
 	};
 
 	struct state
 	{
+		const pe::image* image;
 		vip_t vip;
 		uint64_t rkey;
 
-		const x86::zydis_register_t vip_r = ZYDIS_REGISTER_R8;
-		const x86::zydis_register_t vreg_r = ZYDIS_REGISTER_R9;
-		const x86::zydis_register_t rkey_r = ZYDIS_REGISTER_R10;
+		// Register roles, defaults match the original sample, entry discovery overrides them
+		//
+		x86::zydis_register_t vip_r = ZYDIS_REGISTER_R8;
+		x86::zydis_register_t vreg_r = ZYDIS_REGISTER_R9;
+		x86::zydis_register_t rkey_r = ZYDIS_REGISTER_R10;
 
+		// Emulated VM stack and registers, values are exact as long as they come from constants
+		//
 		std::vector<uint64_t> stack;
+		std::vector<uint64_t> vregs;
 
-		state(vip_t vip, uint64_t rkey)
-			: vip(vip), rkey(rkey), stack(15, 0) {}
+		state(const pe::image& image, vip_t vip, uint64_t rkey)
+			: image(&image), vip(vip), rkey(rkey), stack(15, 0), vregs(15, 0) {}
 
 		uint64_t decrypt_vip(uint64_t ror_key);
 	};
 
-	std::vector<uint64_t> extract_ror_keys(const x86::routine_t& routine);
+	// Positions of the ror instructions of every fetch and of the rcx load holding the
+	// Jnz fall-through key, -1 if there is none
+	//
+	std::vector<int> find_ror_keys(const state& state, const x86::routine_t& routine);
+	int find_jcc_key(const x86::routine_t& routine);
+
+	std::vector<uint64_t> extract_ror_keys(const state& state, const x86::routine_t& routine);
 	uint64_t extact_jcc_key(const x86::routine_t& routine);
+
+	// Slots the VM stack grows by, Exit leaves nothing usable behind
+	//
+	int stack_delta(opcodes op);
 }